@@ -24,6 +24,8 @@
 
 class CommSendEvent : public StageEvent
 {
+    CLTYPETAG(CommSendEvent, StageEvent)
+
 public:
     CommSendEvent(void *conn):
         mConn(conn)
@@ -38,6 +40,8 @@ public:
 
 class CommRecvEvent: public StageEvent
 {
+    CLTYPETAG(CommRecvEvent, StageEvent)
+
 public:
     CommRecvEvent(int sock): mSocket(sock) {}
     ~CommRecvEvent(){}
@@ -57,7 +57,7 @@ struct MsgDesc {
         for (std::vector<IoVec::vec_t*>::iterator it = attachMems.begin();
                 it != attachMems.end(); it++)
         {
-            delete (char *)(*it)->base;
+            IoVec::freeBase((*it)->base, (*it)->alloc);
 
             delete (*it);
         }
@@ -110,6 +110,8 @@ struct MsgDesc {
 
 class CommEvent : public StageEvent
 {
+    CLTYPETAG(CommEvent, StageEvent)
+
 public:
     //! CommEvent completion status type
     /**
@@ -327,6 +329,12 @@ public:
      * just set the status and done
      */
     void completeEvent(CommEvent::status_t stev);
+    //! Complete the event with RESOURCE_FAILURE, a stage has no room for it
+    /**
+     * A request received by the server is answered with a RESOURCE_FAILURE
+     * response right away.
+     */
+    void shed();
     //! Deallocates the resources associated with MsgDesc
     /**
      * Frees the array of pointers to IoVec::vec_t structures, the 
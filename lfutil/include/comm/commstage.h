@@ -32,6 +32,7 @@
 #include "seda/stage.h"
 #include "seda/stageevent.h"
 #include "seda/callback.h"
+#include "seda/dispatchtable.h"
 
 #include "lang/serializable.h"
 #include "io/selectdir.h"
@@ -107,6 +108,8 @@ private:
 
     Stage                      *mNextStage;
 
+    DispatchTable<CommStage>    mDispatch;       //!< handlers by event type
+
     u32_t                       mSendCounter;    //!< a counter for the messages
     pthread_mutex_t             mCounterMutex;   //!< counter lock
 };
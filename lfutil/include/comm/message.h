@@ -21,12 +21,15 @@
 #define MESSAGE_H_
 
 #include "lang/serializable.h"
+#include "lang/typetag.h"
 #include "trace/log.h"
 #include "lang/lstring.h"
 
 
 class Message : public Serializable
 {
+    CLTYPETAG_ROOT(Message)
+
 public:
     Message(int type):mType(type){}
     virtual ~Message() {}
@@ -25,6 +25,8 @@
 
 class Request : public Message
 {
+    CLTYPETAG(Request, Message)
+
 public:
     Request():
         Message(MESSAGE_BASIC_REQUEST)
@@ -27,6 +27,8 @@
 
 class Response : public Message
 {
+    CLTYPETAG(Response, Message)
+
 public:
     Response():
         Message(MESSAGE_BASIC_RESPONSE)
@@ -0,0 +1,109 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * typetag.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#ifndef TYPETAG_H_
+#define TYPETAG_H_
+
+#include "defs.h"
+
+//! Type of a class in a tagged hierarchy
+/**
+ * Every class declared with CLTYPETAG has exactly one tag, which links to
+ * the tag of its parent class.  Telling the type of an object is then a
+ * virtual call to typeTag() and, for a base class, a walk up the parent
+ * links, instead of a dynamic_cast for every candidate type.
+ *
+ * Tags are numbered densely from 0 in the order they are first used, so
+ * the id can index a table, see DispatchTable.
+ */
+class CLtypeTag
+{
+public:
+    CLtypeTag(const CLtypeTag *parent, const char *name);
+
+    u32_t            getId() const     { return mId; }
+    const CLtypeTag *getParent() const { return mParent; }
+    const char      *getName() const   { return mName; }
+
+    //! Whether the class of this tag is tag's class or derives from it
+    bool isA(const CLtypeTag &tag) const
+    {
+        for (const CLtypeTag *t = this; t; t = t->mParent)
+        {
+            if (t == &tag)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //! Number of tags created so far
+    static u32_t count();
+
+private:
+    CLtypeTag(const CLtypeTag &);
+    CLtypeTag &operator=(const CLtypeTag &);
+
+    u32_t            mId;
+    const CLtypeTag *mParent;
+    const char      *mName;
+};
+
+/**
+ * Put in the class declaration, parent is the tagged base class.  A
+ * derived class without a tag of its own has the tag of its base.
+ */
+#define CLTYPETAG(cls, parent)                                          \
+public:                                                                 \
+    static const CLtypeTag &classTag()                                  \
+    {                                                                   \
+        static const CLtypeTag tag(&parent::classTag(), #cls);          \
+        return tag;                                                     \
+    }                                                                   \
+    virtual const CLtypeTag &typeTag() const                            \
+    {                                                                   \
+        return classTag();                                              \
+    }
+
+//! Tag of the root class of a hierarchy
+#define CLTYPETAG_ROOT(cls)                                             \
+public:                                                                 \
+    static const CLtypeTag &classTag()                                  \
+    {                                                                   \
+        static const CLtypeTag tag(NULL, #cls);                         \
+        return tag;                                                     \
+    }                                                                   \
+    virtual const CLtypeTag &typeTag() const                            \
+    {                                                                   \
+        return classTag();                                              \
+    }
+
+//! Cast obj to T* if it is one, NULL otherwise
+template <class T, class O>
+inline T *typetag_cast(O *obj)
+{
+    if (obj && obj->typeTag().isA(T::classTag()))
+    {
+        return static_cast<T *>(obj);
+    }
+    return NULL;
+}
+
+#endif /* TYPETAG_H_ */
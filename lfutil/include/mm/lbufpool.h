@@ -0,0 +1,178 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * lbufpool.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#ifndef LBUFPOOL_H_
+#define LBUFPOOL_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "defs.h"
+
+#define CLBUFPOOL_MIN_SHIFT        10   // smallest class, 1K
+#define CLBUFPOOL_MAX_SHIFT        30   // largest class, 1G
+#define CLBUFPOOL_CLASS_NUM        (CLBUFPOOL_MAX_SHIFT - CLBUFPOOL_MIN_SHIFT + 1)
+#define CLBUFPOOL_MMAP_SHIFT       17   // classes from 128K are mmap'ed
+#define CLBUFPOOL_TC_MAX_COUNT     16   // buffers per class in a thread cache
+#define CLBUFPOOL_NODE_NUM         8    // NUMA nodes with free lists of their own
+
+#define CLBUFPOOL_DEFAULT_TC_SIZE  (4 * ONE_MILLION)
+
+//! Pool of power-of-two sized data buffers
+/**
+ * Buffers are grouped in size classes from 1K to 1G, a request is served
+ * from the smallest class which holds it. Released buffers are kept in a
+ * small per-thread cache first and then in per-class global free lists,
+ * so the steady state of the network receive path doesn't touch the
+ * system allocator nor fault in fresh pages.
+ *
+ * Classes from 128K up are mapped with mmap, and optionally backed by
+ * huge pages. Requests above the largest class are mapped directly and
+ * unmapped on release.
+ *
+ * With NUMA local allocation each node has free lists of its own: a
+ * buffer goes back to the lists of the node its memory is on and is only
+ * handed out again to threads running on that node, and the mapped
+ * classes are bound to the node of the thread which maps them.
+ *
+ * The total memory held by the pool, in use or cached, can be capped;
+ * get() returns NULL when the cap would be exceeded even after the global
+ * free lists have been trimmed.
+ */
+class CLbufpool
+{
+public:
+    //! Pool statistics, all sizes are in bytes of class capacity
+    typedef struct _Stats
+    {
+        u64_t allocs;       //!< number of get() calls
+        u64_t hits;         //!< get() served by a cached buffer
+        u64_t failures;     //!< get() rejected by the memory cap
+        u64_t outstanding;  //!< bytes handed out and not put back yet
+        u64_t highWater;    //!< highest value outstanding has reached
+        u64_t reserved;     //!< bytes held by the pool, in use or cached
+    } Stats;
+
+    CLbufpool();
+    ~CLbufpool();
+
+    /**
+     * Get a buffer of at least size bytes
+     * @return NULL if the memory cap is reached or the system is out of
+     *         memory
+     */
+    void *get(size_t size);
+
+    /**
+     * Give a buffer back to the pool, buf must come from get()
+     */
+    void put(void *buf);
+
+    /**
+     * Release all buffers cached in the global free lists
+     */
+    void trim();
+
+    /**
+     * Cap of the memory held by the pool, 0 means unlimited
+     */
+    void  setMaxSize(u64_t maxSize);
+    u64_t getMaxSize();
+
+    /**
+     * Bytes one thread may cache, 0 disables the thread caches.
+     * Only affects threads which haven't used the pool yet.
+     */
+    void  setThreadCacheSize(u64_t size);
+    u64_t getThreadCacheSize();
+
+    /**
+     * Back the mmap'ed classes with huge pages, falls back to
+     * transparent huge pages when none are reserved
+     */
+    void setHugePage(bool enable);
+    bool getHugePage();
+
+    /**
+     * Keep buffers on the NUMA node of the threads using them, threads
+     * should be pinned to a node for it to pay off
+     */
+    void setNumaLocal(bool enable);
+    bool getNumaLocal();
+
+    void getStats(Stats &stats);
+    void output(std::string &info);
+
+private:
+    typedef struct _BufHdr
+    {
+        void   *mem;        //!< start of the underlying allocation
+        size_t  memLen;     //!< mapped length, 0 for heap memory
+        u32_t   magic;
+        s32_t   cls;        //!< size class, -1 for oversized buffers
+        s32_t   node;       //!< free lists the buffer goes back to
+    } BufHdr;
+
+    typedef struct _ThreadCache
+    {
+        CLbufpool *pool;
+        u64_t      bytes;
+        int        count[CLBUFPOOL_CLASS_NUM];
+        void      *bufs[CLBUFPOOL_CLASS_NUM][CLBUFPOOL_TC_MAX_COUNT];
+    } ThreadCache;
+
+    static int     classOf(size_t size);
+    static size_t  classSize(int cls);
+    static BufHdr *hdrOf(void *buf);
+    static void    flushThreadCache(void *arg);
+
+    ThreadCache *getThreadCache();
+    int          homeNode();
+
+    void *allocBuf(int cls, size_t size, int node);
+    void  freeBuf(BufHdr *hdr);
+    void  putGlobal(int cls, void *buf);
+
+    void  addOutstanding(u64_t len);
+
+private:
+    std::vector<void *>  mFree[CLBUFPOOL_NODE_NUM][CLBUFPOOL_CLASS_NUM];
+    pthread_mutex_t      mLocks[CLBUFPOOL_NODE_NUM][CLBUFPOOL_CLASS_NUM];
+    pthread_key_t        mCacheKey;
+
+    u64_t                mMaxSize;
+    u64_t                mThreadCacheSize;
+    bool                 mHugePage;
+    bool                 mNumaLocal;
+
+    u64_t                mAllocs;
+    u64_t                mHits;
+    u64_t                mFailures;
+    u64_t                mOutstanding;
+    u64_t                mHighWater;
+    u64_t                mReserved;
+};
+
+/**
+ * The buffer pool shared by the network layer
+ */
+CLbufpool*& theBufPool();
+
+#endif /* LBUFPOOL_H_ */
@@ -0,0 +1,213 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * lobjpool.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#ifndef LOBJPOOL_H_
+#define LOBJPOOL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "defs.h"
+
+#define CLOBJPOOL_ALIGN_SHIFT      4    // classes are 16 bytes apart
+#define CLOBJPOOL_MAX_SIZE         1024 // larger objects use the heap
+#define CLOBJPOOL_CLASS_NUM        (CLOBJPOOL_MAX_SIZE >> CLOBJPOOL_ALIGN_SHIFT)
+#define CLOBJPOOL_SLAB_SIZE        (16 * 1024)
+#define CLOBJPOOL_TC_MAX_COUNT     64   // objects per class in a thread cache
+#define CLOBJPOOL_BATCH            (CLOBJPOOL_TC_MAX_COUNT / 2)
+
+//! Pool of small fixed size objects
+/**
+ * Memory for objects up to 1K, in size classes 16 bytes apart, is carved
+ * out of slabs which are never given back to the system.  Released
+ * objects are chained on a per-thread free list of their class first,
+ * batches of them move between the thread lists and per-class global
+ * lists, so the steady state of a thread neither locks nor touches the
+ * system allocator.  Larger objects go to malloc.
+ *
+ * It backs the class level operator new/delete of the hot event and
+ * callback classes, see CLOBJPOOL_DECLARE.  The size has to be given back
+ * on put(), which the sized operator delete does even for derived classes
+ * as long as the destructor is virtual.
+ */
+class CLobjpool
+{
+public:
+    //! Pool statistics
+    typedef struct _Stats
+    {
+        u64_t allocs;       //!< number of get() calls
+        u64_t hits;         //!< get() served without carving a new slab
+        u64_t live;         //!< objects handed out and not put back yet
+        u64_t reserved;     //!< bytes of slabs held by the pool
+    } Stats;
+
+    CLobjpool(const char *name);
+    ~CLobjpool();
+
+    /**
+     * Get memory for an object of size bytes
+     * @return NULL if the system is out of memory
+     */
+    void *get(size_t size);
+
+    /**
+     * Give back an object, size must be the one passed to get()
+     */
+    void put(void *obj, size_t size);
+
+    void getStats(Stats &stats);
+    void output(std::string &info);
+
+private:
+    typedef struct _ThreadCache
+    {
+        CLobjpool *pool;
+        u64_t      allocs;
+        u64_t      hits;
+        u64_t      frees;
+        u32_t      count[CLOBJPOOL_CLASS_NUM];
+        void      *head[CLOBJPOOL_CLASS_NUM];
+    } ThreadCache;
+
+    static int     classOf(size_t size);
+    static size_t  classSize(int cls);
+    static void    flushThreadCache(void *arg);
+
+    ThreadCache *getThreadCache();
+
+    int   refill(ThreadCache *tc, int cls);
+    void  putGlobal(int cls, void *first, void *last);
+
+private:
+    std::string          mName;
+
+    void                *mFree[CLOBJPOOL_CLASS_NUM];
+    std::vector<void *>  mSlabs[CLOBJPOOL_CLASS_NUM];
+    pthread_mutex_t      mLocks[CLOBJPOOL_CLASS_NUM];
+    pthread_key_t        mCacheKey;
+
+    // counters of the live thread caches are summed up on getStats()
+    std::vector<ThreadCache *> mCaches;
+    pthread_mutex_t      mCacheLock;
+    u64_t                mAllocs;   //!< of the exited threads
+    u64_t                mHits;
+    u64_t                mFrees;
+    u64_t                mReserved;
+};
+
+//! Class level operator new/delete served by a CLobjpool
+/**
+ * Put in the public part of a class declaration, objPool() is then
+ * defined by CLOBJPOOL_DEFINE in its source file.  Derived classes share
+ * the pool.  new returns NULL rather than throwing when memory runs out.
+ */
+#define CLOBJPOOL_DECLARE()                                             \
+public:                                                                 \
+    static CLobjpool *objPool();                                        \
+    static void *operator new(size_t size) throw()                      \
+    {                                                                   \
+        return objPool()->get(size);                                    \
+    }                                                                   \
+    static void operator delete(void *obj, size_t size)                 \
+    {                                                                   \
+        objPool()->put(obj, size);                                      \
+    }
+
+#define CLOBJPOOL_DEFINE(cls, name)                                     \
+CLobjpool *cls::objPool()                                               \
+{                                                                       \
+    static CLobjpool *pool = new CLobjpool(name);                       \
+                                                                        \
+    return pool;                                                        \
+}
+
+/**
+ * The pool behind CLobjallocator
+ */
+CLobjpool *theNodePool();
+
+//! STL allocator of single objects from theNodePool()
+/**
+ * For node based containers, arrays bigger than a pool class go to the
+ * heap.
+ */
+template <class T>
+class CLobjallocator
+{
+public:
+    typedef size_t     size_type;
+    typedef ptrdiff_t  difference_type;
+    typedef T         *pointer;
+    typedef const T   *const_pointer;
+    typedef T         &reference;
+    typedef const T   &const_reference;
+    typedef T          value_type;
+
+    template <class U>
+    struct rebind
+    {
+        typedef CLobjallocator<U> other;
+    };
+
+    CLobjallocator() {}
+    CLobjallocator(const CLobjallocator &) {}
+    template <class U>
+    CLobjallocator(const CLobjallocator<U> &) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void * = 0)
+    {
+        void *p = theNodePool()->get(n * sizeof(T));
+        if (p == NULL)
+        {
+            throw std::bad_alloc();
+        }
+        return (pointer)p;
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        theNodePool()->put(p, n * sizeof(T));
+    }
+
+    size_type max_size() const { return ((size_type)-1) / sizeof(T); }
+
+    void construct(pointer p, const T &val) { new ((void *)p) T(val); }
+    void destroy(pointer p) { p->~T(); }
+};
+
+template <class T, class U>
+inline bool operator==(const CLobjallocator<T> &, const CLobjallocator<U> &)
+{
+    return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const CLobjallocator<T> &, const CLobjallocator<U> &)
+{
+    return false;
+}
+
+#endif /* LOBJPOOL_H_ */
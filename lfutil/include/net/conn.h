@@ -218,6 +218,13 @@ public:
      */
     void acquire();
 
+    //! Acquire connection unless it is being cleaned up
+    /**
+     * @return false if cleanup has started, the connection must not be
+     *         used then
+     */
+    bool tryAcquire();
+
     //! Return if the connection is not referenced
     bool isIdle();
 
@@ -393,6 +400,31 @@ public:
     void       removeEventEntry(u32_t msgId);
     CommEvent* getAndRmEvent(u32_t msgId);
 
+    //! Load of the connection, read without lock to balance a pool
+    /**
+     * getInflight() returns the requests waiting for their response,
+     * getPendingBytes() the bytes queued and not sent yet
+     */
+    u32_t      getInflight() const { return mInflight; }
+    u64_t      getPendingBytes() const { return mPendingBytes; }
+
+    //! Drain the connection of a pool before closing it
+    /**
+     * A draining connection isn't handed out to new requests, it is closed
+     * once nothing has happened on it for a while, see
+     * ConnMgr::findDrained(). The caller holds ConnMgr's mapMutex.
+     */
+    void       startDrain(time_t now)
+    {
+        mDrainSn   = mActivitySn;
+        mDrainTime = now;
+    }
+    void       stopDrain() { mDrainTime = 0; }
+    bool       isDraining() const { return mDrainTime != 0; }
+    time_t     getDrainTime() const { return mDrainTime; }
+
+    //! No activity since draining started
+    bool       isDrainQuiet() const { return mActivitySn == mDrainSn; }
 
     //! Set default socket send/receive buffer size for non-listen connections
     static void setSndBufSz(int size);
@@ -414,6 +446,18 @@ public:
     static int getMaxBlockSize();
     static void setMaxBlockSize(int size);
 
+    //! Set/get the per connection read-ahead buffer size, 0 disables it
+    static int getReadAheadSize();
+    static void setReadAheadSize(int size);
+
+    //! Set/get the fdatasync policy of received attach files
+    static s64_t getRecvFileSync();
+    static void setRecvFileSync(s64_t sync);
+
+    //! Set/get whether attach files are received with splice
+    static bool getRecvFileSplice();
+    static void setRecvFileSplice(bool splice);
+
     static void setSocketProperty(std::map<std::string, std::string> &section);
 
     static EndPoint&  getLocalEp();
@@ -488,6 +532,8 @@ protected:
 
     static int recvFile(IoVec *iov, cb_param_t* cbp, Conn *conn);
 
+    static int recvOpenFile(cb_param_t* cbp);
+
 protected:
 
     //! Copy constructor
@@ -512,18 +558,48 @@ protected:
      */
     void cleanupVec(IoVec *iov, cleanup_t how);
 
+    //! Whether cleanup has started, checked without lock by the byte
+    //! moving loops
+    bool isCleaning();
+
+    //! Tear the connection down, called once the last reference is gone
+    int  finishCleanup(cleanup_t how);
+
     //! Make progress on active send vector
     /**
-     * If the socket is ready for sending, data from the currently active
-     * send IoVec will be sent until all vector data is transmitted or
-     * the socket becomes busy (unavailable). In the former case, the vector
-     * is completed and the vector's callback is invoked.
+     * If the socket is ready for sending, the currently active send IoVec
+     * and the vectors queued behind it (up to IOV_MAX) are pushed with one
+     * sendmsg call. Partially written vectors keep their progress in
+     * xferred, every completed vector's callback is invoked in queue order.
+     * Gathering stops after a vector which is followed by an attach file,
+     * the file data has to go out before the next vector. The vector is
+     * completed only when the whole file has been sent by sendFileProgress.
      * If the socket is busy, the method returns an appropriate error status.
      *
      * @return status of vector processing
      */
     status_t sendvecProgress();
 
+    //! Complete the active send vector and make the next one active
+    void     completeSendVec(IoVec::state_t state);
+
+    //! Whether the vector is followed by an attach file
+    static bool hasFileTail(IoVec *iov);
+
+    //! Make progress on the attach file of the active send vector
+    /**
+     * The file is opened on first call and kept open until it is sent
+     * completely, each call pushes as much as the socket takes with
+     * non-blocking sendfile and resumes where the previous one stopped.
+     *
+     * @return SUCCESS when the file is sent, CONN_ERR_UNAVAIL when the
+     *         socket is full, CONN_ERR_BROKEN on error
+     */
+    status_t sendFileProgress();
+
+    //! Close the attach file being sent, if any
+    void     closeSendFile();
+
     //! Make progress on active receive vector
     /**
      * If the socket is ready for receiving (data available for reading),
@@ -536,6 +612,32 @@ protected:
      */
     status_t recvvecProgress();
 
+    //! Read from socket until the read-ahead buffer holds want bytes
+    /**
+     * Buffered bytes are moved to the beginning of the buffer first, so a
+     * vector of up to the buffer size can always be lent out contiguously.
+     *
+     * @return result of the last ::recv, > 0 if want bytes are buffered
+     */
+    ssize_t  readAhead(size_t want);
+
+    //! Receive the attach file of the active receive vector to disk
+    /**
+     * The vector has no buffer, its size is the file length. Bytes already
+     * in the read-ahead buffer are written first, the rest is moved
+     * socket -> pipe -> file with splice, or through a bounce buffer when
+     * splice isn't supported. The file stays open until it is complete.
+     *
+     * @return result of the last socket operation, like ::recv
+     */
+    ssize_t  recvFileProgress(IoVec *rvec);
+
+    ssize_t  recvFileSplice(size_t want);
+    ssize_t  recvFileCopy(size_t want);
+
+    //! Close the attach file being received, fdatasync it if configured
+    void     closeRecvFile(bool complete);
+
 
 private:
     struct msg_cntr_t
@@ -556,6 +658,11 @@ private:
     static int       gListenRcvBufSize;   //!< listen socket receive buffer size
 
     static int      gMaxBlockSize;          //!< one block buffer size
+    static int      gReadAheadSize;         //!< read-ahead buffer size
+    static s64_t    gRecvFileSync;          //!< fdatasync of received files
+                                            // 0 never, -1 at the end,
+                                            // N every N bytes
+    static bool     gRecvFileSplice;        //!< receive files with splice
 
     static int       gTimeout;            //!< socket timeout
 
@@ -572,34 +679,50 @@ private:
 
     int              mSock;              //!< connection socket
 
-    nextrecv_t       mNextRecvPart;      //!< next component of received packet
-    status_t         mConnState;         //!< connection state
+    volatile nextrecv_t mNextRecvPart;   //!< next component of received packet
+    volatile status_t   mConnState;      //!< connection state
 
-    bool             mCleaning;          //!< connection is being cleaned up
     cleanup_t        mCleanType;         //!< cleanup type for disconnect
 
-    int              mRefCount;          //!< reference count of connection references
+    //! reference count of connection references, the top bit is set
+    //! once the connection is being cleaned up
+    volatile u32_t   mRefState;
     msg_cntr_t       mMsgCounter;        //!< counter for messages
     u64_t            mActivitySn;        //!< serial number of last connect activity
 
     static u64_t     globalActSn;        //!< serial number of connect activities
                                          // used to find non active connections to close
+    u64_t            mDrainSn;           //!< mActivitySn when draining started
+    time_t           mDrainTime;         //!< when draining started, 0 if not
     EndPoint         mPeerEp;            //!< peer's EndPoint
-    pthread_mutex_t  mMutex;             //!< mutex protecting the Conn members
 
     IoVec              *mCurSendBlock;  //!< current vector being sent
     std::deque<IoVec *> mSendQ;         //!< queue for vectors to be sent
     pthread_mutex_t     mSendMutex;     //!< send queue mutex
     bool                mReadyToSend;   //!< indicates that socket is ready for send
+    int                 mSendFileFd;    //!< attach file being sent, -1 if none
+    off_t               mSendFileOffset;//!< next offset of the attach file
+    u64_t               mSendFileRemain;//!< attach file bytes left to send
+    volatile u64_t      mPendingBytes;  //!< bytes of the vectors not sent yet
 
     IoVec              *mCurRecvBlock;  //!< current vector being received into
     std::deque<IoVec *> mRecvQ;         //!< queue of receive vectors
     pthread_mutex_t     mRecvMutex;     //!< receive queue mutex
     bool                mReadyRecv;     //!< flag that data is available for read
     cb_param_t         *mRecvCb;        //!< recv callback parameter, won't free until cleanup Connection
+    char               *mRaBuf;         //!< read-ahead buffer
+    size_t              mRaPos;         //!< offset of the first buffered byte
+    size_t              mRaLen;         //!< number of buffered bytes
+    int                 mRecvFileFd;    //!< attach file being received, -1 if none
+    int                 mRecvPipe[2];   //!< pipe for splicing the attach file
+    size_t              mRecvPipeSize;  //!< capacity of mRecvPipe
+    bool                mRecvFileSplice;//!< splice works for the current file
+    u64_t               mRecvFileUnsynced; //!< bytes written since fdatasync
+    char               *mRecvFileBuf;   //!< bounce buffer when not splicing
 
     std::map<u32_t, CommEvent*> mSendEventMap;        //!< map(requestID, send event)
     pthread_mutex_t             mEventMapMutex;
+    volatile u32_t              mInflight;            //!< size of mSendEventMap
 
 
 };
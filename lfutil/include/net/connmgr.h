@@ -19,6 +19,10 @@
 #include "os/mutex.h"
 #include "net/conn.h"
 
+#define CONNMGR_CHUNK_SHIFT   10
+#define CONNMGR_CHUNK_SIZE    (1 << CONNMGR_CHUNK_SHIFT)
+#define CONNMGR_CHUNK_NUM     1024      // the table covers sockets below 1M
+
 //! Connection manager
 /**
  * @author Longda
@@ -27,6 +31,13 @@
  * ConnMgr maintains maps between Conn objects and end point descriptors
  * or socket file descriptors.
  *
+ * Connections are indexed by socket in a two level table, chunks of
+ * CONNMGR_CHUNK_SIZE slots are allocated on demand and kept until the
+ * manager is destroyed. Looking up a socket takes no lock: readers run
+ * inside an epoch read section, and a removed Conn is retired instead of
+ * being deleted, it is only freed once every thread which could have seen
+ * it has left its read section. Inserting and removing still require
+ * mapMutex, as does the end point map.
  */
 class ConnMgr
 {
@@ -40,7 +51,8 @@ public:
         ERR_LOCK_BUSY,      //!< lock is busy, taken by another thread
         ERR_LOCK_AOWNED,    //!< attempt to lock an already owned lock
         ERR_LOCK_NOTOWNED,  //!< attempt to unlock without a prior lock
-        ERR_LOCK            //!< some other locking error
+        ERR_LOCK,           //!< some other locking error
+        ERR_NO_SLOT         //!< socket is beyond the connection table
     } status_t;
 
 public:
@@ -59,10 +71,12 @@ public:
 
     //! Find a connection by socket
     /**
-     * Finds a connection by socket. 
+     * Finds a connection by socket and acquires it, the caller has to
+     * release it. Doesn't need mapMutex.
      * 
      * @param[in]   sock    socket to lookup connection by
-     * @return connection found or 0 if no connection for this socket is found
+     * @return connection found or 0 if no connection for this socket is
+     *         found or the connection is being cleaned up
      */
     Conn* find(const int& sock);
 
@@ -74,6 +88,45 @@ public:
      */
     Conn* find(EndPoint& ep);
 
+    //! Find the least loaded connection to an end point
+    /**
+     * Connections are compared by requests in flight, then by bytes queued
+     * for sending, a draining connection is only returned if there is no
+     * other. The connection returned is acquired.
+     *
+     * @param[in]   ep          end point to look up the connections by
+     * @param[out]  poolSize    number of connections to ep
+     * @param[out]  poolInflight requests in flight on all of them
+     * @return  connection or 0 if there is no usable connection to ep
+     */
+    Conn* findLeastLoaded(EndPoint& ep, size_t& poolSize, u32_t& poolInflight);
+
+    //! Find a connection to an end point which is done draining
+    /**
+     * Data threads look connections up by socket without mapMutex, so a
+     * connection can't be closed just because it looks unused at one
+     * point. It is drained first: one connection of the pool stops taking
+     * new requests, and is returned once nothing has happened on it, nor
+     * is in flight or queued, for a whole interval. Any activity restarts
+     * the interval. The caller holds mapMutex.
+     *
+     * @param[in]   ep          end point to look up the connection by
+     * @param[in]   except      connection not to be drained
+     * @param[in]   now         current time
+     * @param[in]   interval    seconds a connection has to stay quiet
+     * @return  acquired connection or 0 if none is done draining yet
+     */
+    Conn* findDrained(EndPoint& ep, Conn* except, time_t now,
+            time_t interval);
+
+    //! Take back the draining connection of an end point
+    /**
+     * The caller holds mapMutex.
+     *
+     * @return  true if a connection was draining
+     */
+    bool stopDrain(EndPoint& ep);
+
     //! Insert aconnection
     /**
      * Inserts a new connection in the internal maps. Attempting to insert
@@ -82,7 +135,7 @@ public:
      * @param[in]   ep      end point
      * @param[in]   sock    socket
      * @param[in]   conn    connection
-     * return status (SUCCESS, ERR_AINSERTED) 
+     * return status (SUCCESS, ERR_AINSERTED, ERR_NO_SLOT)
      */
     ConnMgr::status_t insert(EndPoint& ep, const int sock, Conn* conn);
 
@@ -138,6 +191,26 @@ public:
      */
     void list();
 
+    //! Enter a lock free read section
+    /**
+     * A Conn seen by the calling thread, through find() or an epoll event,
+     * won't be freed until the matching readUnlock(). Read sections nest.
+     */
+    static void readLock();
+
+    //! Leave a lock free read section
+    static void readUnlock();
+
+    //! Hand over a cleaned up connection to be deleted
+    /**
+     * The connection is deleted once no thread can be inside a read
+     * section which started before it was retired.
+     */
+    static void retire(Conn* conn);
+
+    //! Delete the retired connections no reader can see any longer
+    static void reclaim();
+
     /**
      * due to debug lock, so put it public
      */
@@ -145,8 +218,15 @@ public:
 
 private:
     typedef std::map<std::string, std::set<int> > EpSockMap;
-    std::map<int, Conn*> sockConnMap;           //!< map between socket and Conn
+    typedef Conn* volatile ConnSlot;
+
+    //! Slot of sock in the table, allocate its chunk if alloc is set
+    ConnSlot* slotOf(int sock, bool alloc);
+
+    //! Connection of sock without acquiring it, only valid in a read section
+    Conn* peek(int sock);
 
+    ConnSlot* volatile mChunks[CONNMGR_CHUNK_NUM]; //!< socket --> Conn table
 
     EpSockMap epSockMap; //!< map between EndPoint and scoket
     //pthread_mutex_t mapMutex;     //!< mutex for both maps
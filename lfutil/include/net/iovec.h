@@ -37,14 +37,30 @@
  */
 class IoVec {
 public:
+    //! Enumeration for type of vector buffer memory
+    /**
+     * Knwoing the type of memory allocation in the callback helps with
+     * determining whether the memory will be freed in the callback or not.
+     * The latter case is applicable when the buffer is allocated by the 
+     * user code.
+     */
+    typedef enum {
+        SYS_ALLOC = 0,  //!< System allocated
+        USER_ALLOC,     //!< User allocated
+        POOL_ALLOC      //!< Allocated from the buffer pool
+    } alloc_t;
+
     //! Structure representing a basic memory vector
     /**
      * This structure is similar to struct iovec defined in sys/uio.h and
      * used by the scatter/gather I/O calls, such as writev() and readv(). 
+     * alloc tells how base is freed, it is left as SYS_ALLOC by aggregate
+     * and value initialization.
      */
     struct vec_t {
         void *base;     //!< pointer of vector buffer
         int   size;    //!< size of memory vector
+        alloc_t alloc;  //!< type of memory allocation of base
     };
 
     //! Enumeration for vector status
@@ -59,18 +75,6 @@ public:
         CLEANUP         //!< the vector is being cleaned up
     } state_t;
 
-    //! Enumeration for type of vector buffer memory
-    /**
-     * Knwoing the type of memory allocation in the callback helps with
-     * determining whether the memory will be freed in the callback or not.
-     * The latter case is applicable when the buffer is allocated by the 
-     * user code.
-     */
-    typedef enum {
-        SYS_ALLOC = 0,  //!< System allocated
-        USER_ALLOC      //!< User allocated
-    } alloc_t;
-
     //! Enumeration for callback return status
     /**
      * The registered with the IoVec callback returns status code indicating
@@ -137,6 +141,27 @@ public:
      */
     void cleanup();
 
+    //! Free the vector buffer according to its allocation type
+    /**
+     * User allocated buffers are left alone, the base is set to NULL in
+     * any case.
+     */
+    void releaseBase();
+
+    //! Allocate a vector buffer from the buffer pool
+    /**
+     * @param[in]   size    buffer size
+     * @return      buffer pointer, NULL if the pool is exhausted
+     */
+    static void* allocBase(size_t size);
+
+    //! Free a buffer according to its allocation type
+    /**
+     * @param[in]   base    buffer pointer
+     * @param[in]   alloc   allocation type of the buffer
+     */
+    static void freeBase(void *base, IoVec::alloc_t alloc);
+
     //! Set vector base 
     /**
      * @param[in]   base    vector buffer pointer
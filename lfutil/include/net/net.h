@@ -16,6 +16,7 @@
 #include <vector>
 #include <deque>
 
+#include "os/lcpuset.h"
 #include "seda/stage.h"
 
 #include "net/iovec.h"
@@ -69,10 +70,18 @@
  * @date   5/20/07
  */
 
+//! Per data thread socket queue
+/**
+ * Producers (the epoll threads and CommStage) push sockets under mutex and
+ * signal cond only when the consumer has parked. The consumer spins on
+ * pending for a short while before parking, so a burst of requests is
+ * picked up without a futex round trip.
+ */
 class DataThreadParam
 {
 public:
-    DataThreadParam()
+    DataThreadParam() :
+        parked(false), pending(0)
     {
         MUTEX_INIT(&mutex, NULL);
         COND_INIT(&cond, NULL);
@@ -93,9 +102,43 @@ public:
     pthread_mutex_t    mutex;
     pthread_cond_t     cond;
     std::deque<int>    sockQ;
+    bool               parked;     //!< consumer is waiting on cond
+    volatile u32_t     pending;    //!< sockQ size, readable without mutex
 
 };
 
+//! Per reactor state
+/**
+ * In reactor mode each reactor thread owns the sockets with
+ * sock % reactor number == index. It waits on its own epoll fd and does
+ * recv/send progress inline. Other threads hand sockets over through
+ * sendQ/recvQ and wake the reactor with evfd.
+ */
+class ReactorParam
+{
+public:
+    ReactorParam() :
+        epfd(-1), evfd(-1), notified(false), exitFlag(false)
+    {
+        MUTEX_INIT(&mutex, NULL);
+    }
+
+    ~ReactorParam()
+    {
+        MUTEX_DESTROY(&mutex);
+    }
+
+public:
+    pthread_t          tid;
+    int                epfd;       //!< reactor epoll fd
+    int                evfd;       //!< eventfd to wake up the reactor
+    pthread_mutex_t    mutex;      //!< protect the following members
+    std::deque<int>    sendQ;      //!< sockets with new data to send
+    std::deque<int>    recvQ;      //!< sockets with data left to recv
+    bool               notified;   //!< evfd has been written, not read
+    bool               exitFlag;
+};
+
 class Net
 {
 public:
@@ -173,6 +216,18 @@ public:
      */
     Conn* getConn(EndPoint& ep, bool serverSide = false, int sock = -1);
 
+    //! Pick the connection of the pool to an end point for a new request
+    /**
+     * Returns the least loaded connection, acquired, or NULL when there is
+     * none or when all of them are busy and the pool may grow. Closes an
+     * idle connection when the pool is lightly loaded and hasn't grown for
+     * a while. The caller holds the ConnMgr mapMutex.
+     *
+     * The pool holds up to NetConnPoolSize connections, a connection is
+     * busy when NetConnPoolLoad requests are in flight on it.
+     */
+    Conn* pickConn(EndPoint& ep);
+
     //! Delete a connection
     /**
      * Removes a connection from Net's connection manager by provifing the
@@ -201,9 +256,10 @@ public:
      * Adds a socket to the send epoll file descriptor
      * 
      * @param[in]   sock    socket to be added to the send selector
+     * @param[in]   conn    connection of sock, carried by its events
      * @return      status (SUCCESS, NET_ERR_EPOLL)
      */
-    Net::status_t addToSendSelector(int sock);
+    Net::status_t addToSendSelector(int sock, Conn *conn);
     void          delSendSelector(int sock);
 
     //! Adds a socket to the receive epoll selector
@@ -211,9 +267,10 @@ public:
      * Adds a socket to the receive epoll file descriptor
      * 
      * @param[in]   sock    socket to be added to the receive selector
+     * @param[in]   conn    connection of sock, carried by its events
      * @return      status (SUCCESS, NET_ERR_EPOLL)
      */
-    Net::status_t addToRecvSelector(int sock);
+    Net::status_t addToRecvSelector(int sock, Conn *conn);
     void          delRecvSelector(int sock);
 
     //! Add a new connection
@@ -235,7 +292,7 @@ public:
     /**
      * This is a helper method for removing connections. In addition to
      * calling ConnMgr's remove method, it also calls the connection
-     * callback
+     * callback. The caller holds the ConnMgr mapMutex.
      *
      * @param[in]   conn    connection to be removed 
      * @return      error status
@@ -267,6 +324,8 @@ protected:
     {
         THREAD_INFO_LEN = 8,    //!< size of thread notification message
         MAX_EPOLL_EVENTS = 64,    //!< maximum epoll events at a time
+        EPOLL_QUIESCE_MS = 1000,  //!< longest epoll wait, an epoll thread
+                                  //!< blocks conn reclaiming meanwhile
         ERR_BUF_SIZE = 256    //!< size of error buffer
     };
 
@@ -283,6 +342,30 @@ protected:
     int  startDataThread(int threadIndex, bool isSend);
     void cleanupThreads();
 
+    /**
+     * Create a net thread on the CPUs of NetCpus and NetNumaNode
+     * @return 0 or the error of pthread_create
+     */
+    int  createThread(pthread_t *tid, void *(*func)(void *), void *arg);
+
+    /**
+     * Reactor mode, enabled by NetReactorMode in [Default].
+     *
+     * ReactorThread --> one per NetThreadCount, wait on its own epoll fd
+     *               --> recv/send progress of the owned sockets inline
+     * pushReactor   --> hand a socket over to its owner reactor
+     */
+    void          loadConfig();
+    int           setupReactors();
+    int           startReactors();
+    void          cleanupReactors();
+    ReactorParam *getReactor(int sock);
+    void          pushReactor(int sock, bool isSend);
+    void          reactorSendReady(Conn *conn);
+    int           getListenEpfd();
+    static void*  ReactorThread(void *arg);
+           void   reactorLoop(int reactorIndex);
+
     /*
      * net send data thread
      *
@@ -296,6 +379,7 @@ protected:
     static void* SendEPollThread(void* arg);
     static void* SendThread(void *arg);
            void  sendData(int sock);
+           void  sendData(Conn *conn);
 
     /**
      * net receive data thread
@@ -310,8 +394,18 @@ protected:
     static void* RecvEPollThread(void* arg);
     static void* RecvThread(void *arg);
            void  recvData(int sock);
+           void  recvData(Conn *conn);
+
+    /**
+     * Epoll events carry the Conn in data.ptr, the notification fds carry
+     * NULL and the listen socket carries the Net itself.
+     *
+     * brokenConn --> remove the connection of a hung up socket
+     */
+    void brokenConn(Conn *conn);
 
     void handlingData(int threadIndex, bool isSending);
+    void pushSock(DataThreadParam *dataParam, int sock);
 
     //! Accept sockets
     /**
@@ -320,6 +414,13 @@ protected:
      */
     virtual void acceptConns();
 
+    //! Get listener socket
+    /**
+     * @return socket for listening for new connections, or
+     *         Sock::DISCONNECTED if the Net doesn't accept any
+     */
+    virtual int getListenSock() const;
+
     //! Remove connections not active for the longest time
     /**
      * @return the number of removed connections
@@ -336,6 +437,16 @@ protected:
     int       recvPfd[2],   sendPfd[2];     //!< notification pipe descriptors
     int       recvEpfd,     sendEpfd;       //!< receive and send epoll file descriptors
 
+    u32_t           mSpinCount;            //!< data thread spins before parking
+    int             mNetThreadCount;       //!< data threads or reactors
+    bool            mReactorMode;          //!< run per-core reactors
+    CLcpuset        mCpus;                 //!< net threads are pinned to
+    u32_t           mConnPoolSize;         //!< connections per end point
+    u32_t           mConnPoolLoad;         //!< requests in flight which
+                                           //!< make a connection busy
+    time_t          mConnPoolGrowTime;     //!< last time a pool has grown
+    std::vector<ReactorParam *>            mReactors;
+
     pthread_mutex_t netMutex;              //!< mutex lock
     bool            initFlag;              //!< flag indicating if Net has been initialized
     bool            shutdownFlag;          //!< flag indicating if Net has been finalized
@@ -56,7 +56,7 @@ public:
     /**
      * @return socket for listening for new connections
      */
-    int getListenSock() const;
+    virtual int getListenSock() const;
 
     /**
      * override net functions
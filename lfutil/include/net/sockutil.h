@@ -58,7 +58,8 @@ public:
     typedef enum
     {
         DIR_IN = 0,     //!< read epoll events
-        DIR_OUT         //!< write epoll events
+        DIR_OUT,        //!< write epoll events
+        DIR_INOUT       //!< both read and write epoll events
     } dir_t;
 
     //! Enumeration for different constants in the Sock namespace
@@ -70,7 +71,7 @@ public:
         EPOLL_FDESC = 1024, //!< number of epoll socket descriptors
         HOST_BUF_SIZE = 4096, //!< auxiliary data buf size in gethostbyname_r
         SOCK_SEND_BUF_SIZE = 262144, //!< size of socket write kernel buffers
-        SOCK_RECV_BUF_SIZE = 16384   //!< size of socket read kernel buffers
+        SOCK_RECV_BUF_SIZE = 262144  //!< size of socket read kernel buffers
     };
 
 public:
@@ -179,7 +180,8 @@ public:
      * @return                  SUCCESS, ERR_EPOLL_CREATE, ERR_EPOLL_ADD
      *
      * @pre     notifyFd is a valid socket or a pipe descriptor
-     * @post    epfd has notifyFd in its fd set generating read events
+     * @post    epfd has notifyFd in its fd set generating read events,
+     *          reported with a NULL data.ptr
      */
     static Sock::status_t createSelector(int notifyFd, int& epfd);
 
@@ -192,13 +194,16 @@ public:
      * @param[in]   sock    socket to be added to the epoll selector
      * @param[in]   dir     direction for event generation (in/read or out/write)
      * @param[in]   epfd    epoll selector
+     * @param[in]   data    returned in data.ptr of the socket's events,
+     *                      must not be NULL
      * @return              SUCCESS, ERR_EPOLL_ADD
      *
      * @pre     sock and epfd are valid socket and epoll file descriptors
      * @post    sock is added to epfd with ET event generation in direction
      * specified by dir
      */
-    static Sock::status_t addToSelector(int sock, Sock::dir_t dir, int epfd);
+    static Sock::status_t addToSelector(int sock, Sock::dir_t dir, int epfd,
+            void *data);
     static Sock::status_t rmFromSelector(int sock, int epfd);
 
     //! Creates, binds, and listens to a INET socket
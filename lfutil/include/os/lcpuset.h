@@ -0,0 +1,115 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * lcpuset.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: Longda Feng
+ */
+
+#ifndef LCPUSET_H_
+#define LCPUSET_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+
+#include "defs.h"
+
+#define CLCPUSET_NO_NODE    -1
+
+//! CPUs threads are pinned to
+/**
+ * A set is given either as a list of CPUs such as "0-7,16-23", or as a
+ * NUMA node whose CPUs are read from sysfs, or both, which keeps the
+ * listed CPUs of the node. Threads are pinned when they are created, so
+ * their stacks and whatever they allocate first are on their node.
+ *
+ * An empty set leaves threads where the scheduler puts them. Without
+ * NUMA every CPU belongs to node 0.
+ */
+class CLcpuset
+{
+public:
+    CLcpuset();
+
+    /**
+     * Take the CPUs of a list and/or of a NUMA node, empty strings are
+     * ignored
+     * @return false if the list is malformed, the node doesn't exist or
+     *         no CPU is left
+     */
+    bool configure(const std::string &cpus, const std::string &node);
+
+    /**
+     * Take the CPUs of a list such as "0-7,16-23"
+     * @return false if the list is malformed or names no CPU
+     */
+    bool parse(const std::string &list);
+
+    /**
+     * Keep the CPUs of a NUMA node only, all of them if the set is empty
+     * @return false if the node doesn't exist or no CPU is left
+     */
+    bool setNode(int node);
+
+    bool empty() const;
+    int  count() const;
+
+    /**
+     * CPU at index in increasing order, -1 if the set has fewer CPUs
+     */
+    int getCpu(int index) const;
+
+    /**
+     * NUMA node of the CPUs, CLCPUSET_NO_NODE if the set is empty or
+     * spans several nodes
+     */
+    int getNode() const;
+
+    /**
+     * Pin the threads created with attr to the CPUs, nothing to do for
+     * an empty set
+     * @return 0 or the error of pthread_attr_setaffinity_np
+     */
+    int apply(pthread_attr_t *attr) const;
+
+    /**
+     * Pin the calling thread to the CPUs
+     * @return 0 or the error of pthread_setaffinity_np
+     */
+    int apply() const;
+
+    std::string toString() const;
+
+    //! Number of NUMA nodes, 1 without NUMA
+    static int nodeCount();
+
+    //! NUMA node of a CPU, 0 for an unknown CPU
+    static int nodeOfCpu(int cpu);
+
+    //! NUMA node the calling thread runs on
+    static int currentNode();
+
+    /**
+     * Ask for the pages of a mapping to come from node, must be called
+     * before the pages are touched
+     * @return 0 or errno of mbind
+     */
+    static int bindMemory(void *addr, size_t len, int node);
+
+private:
+    cpu_set_t   mCpus;
+};
+
+#endif /* LCPUSET_H_ */
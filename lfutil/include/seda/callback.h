@@ -16,6 +16,7 @@
 
 // Include Files
 #include "defs.h"
+#include "mm/lobjpool.h"
 
 /** 
  * @file
@@ -56,7 +57,9 @@ class CallbackContext;
  * the callback.  If the stage that is calling done() on the event wants
  * to execute the callback stack in place, it can call the doneImmediate()
  * interface.  Note that this will execute the *entire* callback stack on
- * the current thread.
+ * the current thread.  A callback marked with setInline() is run in
+ * place by done() too, when done() is called from a thread of the target
+ * stage's pool, which saves scheduling the callback.
  */
 
 class CompletionCallback {
@@ -65,6 +68,9 @@ class CompletionCallback {
 
 public:
 
+    // callbacks come from an object pool
+    CLOBJPOOL_DECLARE()
+
     //! Constructor
     CompletionCallback(Stage* trgt, CallbackContext* ctx = NULL);
 
@@ -86,6 +92,23 @@ public:
     //! Reschedule this event as a callback on the target stage
     void eventReschedule(StageEvent* ev);
 
+    //! Stage which set this callback
+    Stage* getTargetStage() const { return targetStage; }
+
+    //! Let done() run this callback on the calling thread
+    /**
+     * Only takes effect when done() is called from a thread of the target
+     * stage's pool, see Threadpool::runCallback().  The callback must not
+     * mind running on the stack of whoever calls done().
+     */
+    void setInline(bool flag) { inlineFlag = flag; }
+
+    //! Run this callback on the calling thread if it is allowed to
+    /**
+     * @return true if the callback has run and deleted itself
+     */
+    bool eventInline(StageEvent* ev);
+
     //! Complete this event if it has timed out
     void eventTimeout(StageEvent* ev);
 
@@ -97,6 +120,7 @@ protected:
     CallbackContext*    context;     //!< argument to pass when invoking cb
     CompletionCallback* nextCb;      //!< next event in the chain
     bool                evHistFlag;  //!< true if event histories are enabled
+    bool                inlineFlag;  //!< may run on the thread of done()
 };
 
 
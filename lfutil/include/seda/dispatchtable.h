@@ -0,0 +1,148 @@
+// __CR__
+// Copyright (c) 2008-2010 Longda Corporation
+// All Rights Reserved
+//
+// This software contains the intellectual property of Longda Corporation
+// or is licensed to Longda Corporation from third parties.  Use of this
+// software and the intellectual property contained therein is expressly
+// limited to the terms and conditions of the License Agreement under which
+// it is provided by or on behalf of Longda.
+// __CR__
+
+
+#ifndef _DISPATCHTABLE_HXX_
+#define _DISPATCHTABLE_HXX_
+
+// Include Files
+#include <vector>
+
+#include "lang/typetag.h"
+#include "seda/stageevent.h"
+
+/**
+ *  @file
+ *  @author Longda
+ *  @date   10/17/26
+ */
+
+class CallbackContext;
+
+//! Handlers of a stage class by event type
+/**
+ * A stage fills the table in its constructor with one handler method per
+ * event class, the method takes the event already cast to its class:
+ * <pre>
+ *     handlers.addHandler<CommEvent, &CommStage::sendRequest>();
+ *     handlers.addCallback<CommEvent, &CommStage::sendResponse>();
+ * </pre>
+ * handleEvent() and callbackEvent() then find the handler from the type
+ * tag of the event, an event of a class without a handler goes to the
+ * handler of its closest base class.  The table is read only once the
+ * stage is connected.
+ */
+template <class S>
+class DispatchTable {
+
+public:
+
+    DispatchTable() {}
+
+    //! Let S::H handle events of class E
+    template <class E, void (S::*H)(E*)>
+    void addHandler()
+    {
+        set(handlers, E::classTag(), &handleThunk<E, H>);
+    }
+
+    //! Let S::H run the callbacks of events of class E
+    template <class E, void (S::*H)(E*, CallbackContext*)>
+    void addCallback()
+    {
+        set(callbacks, E::classTag(), &callbackThunk<E, H>);
+    }
+
+    //! Let S::H run the callbacks of events of class E, without context
+    template <class E, void (S::*H)(E*)>
+    void addCallback()
+    {
+        set(callbacks, E::classTag(), &callbackNoCtxThunk<E, H>);
+    }
+
+    //! Handle an event
+    /**
+     * @return false if there is no handler for the event
+     */
+    bool handle(S* stage, StageEvent* event) const
+    {
+        Handler h = find(handlers, event->typeTag());
+        if (h == NULL) {
+            return false;
+        }
+        h(stage, event);
+        return true;
+    }
+
+    //! Run the callback of an event
+    /**
+     * @return false if there is no callback handler for the event
+     */
+    bool callback(S* stage, StageEvent* event, CallbackContext* ctx) const
+    {
+        Callback h = find(callbacks, event->typeTag());
+        if (h == NULL) {
+            return false;
+        }
+        h(stage, event, ctx);
+        return true;
+    }
+
+private:
+
+    typedef void (*Handler)(S*, StageEvent*);
+    typedef void (*Callback)(S*, StageEvent*, CallbackContext*);
+
+    template <class E, void (S::*H)(E*)>
+    static void handleThunk(S* stage, StageEvent* event)
+    {
+        (stage->*H)(static_cast<E*>(event));
+    }
+
+    template <class E, void (S::*H)(E*, CallbackContext*)>
+    static void callbackThunk(S* stage, StageEvent* event,
+                              CallbackContext* ctx)
+    {
+        (stage->*H)(static_cast<E*>(event), ctx);
+    }
+
+    template <class E, void (S::*H)(E*)>
+    static void callbackNoCtxThunk(S* stage, StageEvent* event,
+                                   CallbackContext* ctx)
+    {
+        (stage->*H)(static_cast<E*>(event));
+    }
+
+    template <class F>
+    static void set(std::vector<F>& table, const CLtypeTag& tag, F f)
+    {
+        if (table.size() <= tag.getId()) {
+            table.resize(tag.getId() + 1, NULL);
+        }
+        table[tag.getId()] = f;
+    }
+
+    template <class F>
+    static F find(const std::vector<F>& table, const CLtypeTag& tag)
+    {
+        for (const CLtypeTag* t = &tag; t; t = t->getParent()) {
+            if (t->getId() < table.size() && table[t->getId()]) {
+                return table[t->getId()];
+            }
+        }
+        return NULL;
+    }
+
+    std::vector<Handler>  handlers;   //!< by tag id
+    std::vector<Callback> callbacks;  //!< by tag id
+};
+
+#endif // _DISPATCHTABLE_HXX_
@@ -0,0 +1,98 @@
+// __CR__
+// Copyright (c) 2008-2010 Longda Corporation
+// All Rights Reserved
+//
+// This software contains the intellectual property of Longda Corporation
+// or is licensed to Longda Corporation from third parties.  Use of this
+// software and the intellectual property contained therein is expressly
+// limited to the terms and conditions of the License Agreement under which
+// it is provided by or on behalf of Longda.
+// __CR__
+
+
+#ifndef _EVENTQUEUE_HXX_
+#define _EVENTQUEUE_HXX_
+
+
+// Include Files
+#include <pthread.h>
+
+#include "defs.h"
+
+/**
+ *  @file
+ *  @author Longda
+ *  @date   10/17/26
+ */
+
+class StageEvent;
+class EventQueue;
+
+//! Intrusive link of an event in an EventQueue
+/**
+ * StageEvent derives from it so that queueing an event doesn't allocate.
+ * An event is in at most one queue at a time.
+ */
+class EventQueueLink {
+
+protected:
+
+    EventQueueLink() : qNext(NULL) {}
+
+private:
+
+    EventQueueLink* volatile qNext;   //!< next event in the queue
+
+    friend class EventQueue;
+};
+
+//! Multi-producer event queue of a Stage
+/**
+ * push() is lock-free, a producer swaps itself in as the queue head with a
+ * single atomic exchange and then links its predecessor to it, so fan-in
+ * stages don't serialize their producers on a mutex.  pop() walks the
+ * queue from the tail; it is meant for a single consumer, and since the
+ * threads of a pool may drain the same stage concurrently the consumers
+ * are serialized by a mutex that producers never touch.
+ *
+ * Events are FIFO in the order their exchange on the head took place.
+ */
+class EventQueue {
+
+public:
+
+    EventQueue();
+    ~EventQueue();
+
+    //! Append an event, safe from any thread
+    void push(StageEvent* event);
+
+    //! Append events in their order with a single exchange on the head
+    void pushBatch(StageEvent** events, unsigned long count);
+
+    //! Take the oldest event
+    /**
+     * @return the event, or NULL if the queue is empty
+     */
+    StageEvent* pop();
+
+    //! Number of events queued, exact only when the queue is quiescent
+    unsigned long size() const { return qSize; }
+
+    bool empty() const { return qSize == 0; }
+
+private:
+
+    void pushLink(EventQueueLink* link) { pushChain(link, link); }
+    void pushChain(EventQueueLink* first, EventQueueLink* last);
+
+    EventQueueLink* volatile  head;          //!< last pushed, producers
+    volatile unsigned long    qSize;         //!< events queued
+    char                      pad[64];       //!< keep producers and the
+                                             //!< consumer on own lines
+    EventQueueLink*           tail;          //!< next to pop, consumer
+    EventQueueLink            stub;          //!< keeps the queue non-empty
+    pthread_mutex_t           popMutex;      //!< serializes consumers
+};
+
+#endif // _EVENTQUEUE_HXX_
@@ -0,0 +1,152 @@
+// __CR__
+// Copyright (c) 2008-2010 Longda Corporation
+// All Rights Reserved
+//
+// This software contains the intellectual property of Longda Corporation
+// or is licensed to Longda Corporation from third parties.  Use of this
+// software and the intellectual property contained therein is expressly
+// limited to the terms and conditions of the License Agreement under which
+// it is provided by or on behalf of Longda.
+// __CR__
+
+
+#ifndef _POOLCONTROLLER_HXX_
+#define _POOLCONTROLLER_HXX_
+
+// Include Files
+#include <pthread.h>
+#include <vector>
+
+#include "defs.h"
+
+/**
+ *  @file
+ *  @author Longda
+ *  @date   10/18/26
+ */
+
+class Stage;
+class Threadpool;
+
+#define POOLCONTROLLER_INTERVAL       500   //!< msec between samples
+#define POOLCONTROLLER_GROW_SAMPLES   2     //!< loaded samples to grow
+#define POOLCONTROLLER_SHRINK_SAMPLES 20    //!< idle samples to shrink
+#define POOLCONTROLLER_GAIN           5     //!< percent, see setSampling()
+#define POOLCONTROLLER_GROW_QUEUE     4     //!< events queued per thread
+
+//! Resizes thread pools after their load
+/**
+ * A thread of its own samples every pool added at an interval: the
+ * events queued at the stages of the pool, the threads sleeping for want
+ * of work and the events handled since the last sample.  It adds threads
+ * to a pool whose stages have more than its grow threshold of events
+ * queued per thread while no thread is idle, for several samples in a
+ * row; and kills threads of a pool which has had idle threads on every
+ * sample of a longer window, half of the fewest seen idle.  A pool never
+ * leaves its min and max threads.
+ * <p>
+ * The grow and shrink conditions leave a band in between where the pool
+ * keeps its size, and both need the condition to hold over a number of
+ * samples, so a burst or a lull doesn't resize a pool.  When a pool has
+ * grown but handles no more events per second than before while still
+ * loaded, more threads don't help, the CPUs or a lock are saturated:
+ * the pool stays at the size reached until it has shrunk again.
+ */
+class PoolController {
+
+public:
+
+    PoolController();
+
+    //! Destructor, stops the controller thread
+    ~PoolController();
+
+    //! Let the controller resize a pool
+    /**
+     * @param[in] pool        pool to resize, outlives the controller
+     * @param[in] minThreads  threads kept at least
+     * @param[in] maxThreads  threads at most
+     * @param[in] growQueue   events queued per thread to grow the pool
+     *
+     * @pre controller not started
+     */
+    void addPool(Threadpool* pool, unsigned int minThreads,
+                 unsigned int maxThreads, unsigned int growQueue);
+
+    //! Count the queue of a stage in the load of its pool
+    /**
+     * Stages of pools not added are ignored.
+     *
+     * @pre controller not started
+     */
+    void addStage(Stage* stage);
+
+    //! Set how the pools are sampled
+    /**
+     * @param[in] msec           interval between samples
+     * @param[in] growSamples    samples in a row loaded to grow a pool
+     * @param[in] shrinkSamples  samples in a row with idle threads to
+     *                           shrink a pool
+     * @param[in] gain           percent more events per second a pool
+     *                           has to handle after growing to grow again
+     *
+     * @pre controller not started
+     */
+    void setSampling(u32_t msec, u32_t growSamples, u32_t shrinkSamples,
+                     u32_t gain);
+
+    //! Whether any pool was added
+    bool empty() const { return pools.empty(); }
+
+    //! Start the controller thread
+    /**
+     * @return false if the thread can't be created
+     */
+    bool start();
+
+    //! Stop the controller thread, waits for a resize in progress
+    void stop();
+
+private:
+
+    //! Load and hysteresis state of a pool
+    typedef struct _PoolState {
+        Threadpool*         pool;
+        std::vector<Stage*> stages;
+        unsigned int        minThreads;
+        unsigned int        maxThreads;
+        unsigned int        growQueue;
+        unsigned int        ceiling;     //!< size found not to help
+        u32_t               hot;         //!< loaded samples in a row
+        u32_t               cold;        //!< idle samples in a row
+        unsigned int        fewestIdle;  //!< over the cold samples
+        unsigned long       lastHandled; //!< events at the last sample
+        u64_t               hotEvents;   //!< handled over the hot samples
+        u64_t               hotUsec;     //!< time of the hot samples
+        u64_t               grownRate;   //!< events/s before last growth
+    } PoolState;
+
+    PoolController(const PoolController&);
+    PoolController& operator=(const PoolController&);
+
+    static void* runController(void* arg);
+
+    //! Sample a pool and resize it if due
+    void adjust(PoolState& ps, u64_t elapsed);
+
+    void grow(PoolState& ps, unsigned int threads, unsigned long backlog);
+    void shrink(PoolState& ps, unsigned int threads);
+
+    std::vector<PoolState> pools;
+    u32_t                  interval;       //!< msec
+    u32_t                  growSamples;
+    u32_t                  shrinkSamples;
+    u32_t                  gain;           //!< percent
+    pthread_mutex_t        mutex;          //!< protects stopping
+    pthread_cond_t         cond;           //!< wakes the thread to stop
+    pthread_t              thread;
+    bool                   running;
+    bool                   stopping;
+};
+
+#endif // _POOLCONTROLLER_HXX_
@@ -21,6 +21,7 @@
 #include <string>
 
 #include "seda/threadpool.h"
+#include "seda/poolcontroller.h"
 
 
 /** 
@@ -178,6 +179,8 @@ private:
     std::map<std::string, Threadpool *> mThreadPools;
     std::map<std::string, Stage *>      mStages;
     std::vector<std::string>            mStageNames;
+    //! resizes the pools with MaxCount above MinCount, NULL if none does
+    PoolController*                     mController;
     
     //! Constructor
     SedaConfig();
@@ -193,6 +196,7 @@ private:
     status_t instantiate();
 
     status_t initThreadPool();
+    status_t initPoolController();
     status_t initStages();
     status_t genNextStages();
 
@@ -205,7 +209,7 @@ private:
 
     //! init event history setting
     /**
-     * Setting theMaxEventHops, theEventHistoryFlag
+     * Setting theMaxEventHops, theEventHistoryFlag, theEventHistorySize
      */
     void initEventHistory();
 
@@ -238,5 +242,6 @@ SedaConfig*& theSedaConfig();
 
 bool& theEventHistoryFlag();
 u32_t& theMaxEventHops();
+u32_t& theEventHistorySize();
 
 #endif //__SEDA_CONFIG__
@@ -16,15 +16,16 @@
 
 // Include Files
 #include <list>
-#include <deque>
 
 // project headers
 #include "defs.h"
 #include "trace/log.h"
+#include "os/mutex.h"
 
 
 //seda headers
 #include "seda/stageevent.h"
+#include "seda/eventqueue.h"
 
 
 /**
@@ -36,6 +37,9 @@
 class Threadpool;
 class CallbackContext;
 
+//! Flag of Stage::eventRef, taking a reference tells whether it is set
+#define STAGE_DISCONNECTED  (~(~0UL >> 1))
+
 
 //! A Stage in a staged event-driven architecture
 /** 
@@ -170,14 +174,65 @@ public:
 
     //! Add an event to the queue.
     /**
+     * When the queue holds its capacity of events the overload policy of
+     * the stage applies, see setCapacity().
+     *
      * @param[in] event Event to add to queue.
      * 
      * @pre  event non-null
-     * @post event added to the end of event queue
+     * @post event added to the end of event queue, or shed
      * @post event must not be de-referenced by caller after return
+     *       unless it is rejected
      * @post event ref count on stage is incremented
+     * @return false if the event is rejected, it is then left to the caller
+     */
+    bool addEvent(StageEvent* event);
+
+    //! Add events the stage has to take, in one pass
+    /**
+     * Neither the queue capacity nor the overload policy applies, the
+     * events are always queued, so this is only for completions the stage
+     * can't refuse, such as callbacks.  The events are queued in their
+     * order with a single exchange and the stage is put on the run queue
+     * for all of them at once.
+     *
+     * @post the events must not be de-referenced by caller after return
      */
-    void addEvent(StageEvent* event);
+    void addEvents(StageEvent** events, unsigned int count);
+
+    //! What addEvent() does when the queue is full
+    typedef enum {
+        OVERLOAD_BLOCK = 0,     //!< wait until the queue has room
+        OVERLOAD_REJECT,        //!< return false, the caller keeps the event
+        OVERLOAD_DROP_OLDEST,   //!< shed the oldest queued event instead
+        OVERLOAD_SHED           //!< shed the new event
+    } OverloadPolicy;
+
+    //! Bound the queue of the stage
+    /**
+     * An event added while capacity events are queued is handled by the
+     * policy, callbacks coming back to the stage are always queued.
+     * Shed events are completed by StageEvent::shed(), which runs their
+     * callbacks.  Producers racing for the last slots may get a few
+     * events past the capacity.
+     * <p>
+     * A thread of the stage's own pool is never blocked, it could be the
+     * one to drain the queue, its events go past the capacity instead.
+     * addEvents() bypasses the capacity.
+     * <p>
+     * Every producer of a stage with OVERLOAD_REJECT has to check the
+     * result of addEvent(), a rejected event is still the caller's.
+     *
+     * @param[in] capacity  events queued at most, 0 for no limit
+     * @param[in] policy    what to do with events beyond it
+     *
+     * @pre  stage not connected
+     */
+    void setCapacity(u32_t capacity, OverloadPolicy policy);
+
+    //! Number of events which found the queue full
+    u64_t getOverloads() const
+        { return overloads; }
 
     //! Query length of queue
     /**
@@ -191,11 +246,28 @@ public:
      */
     bool qempty() const;
 
+    //! Set how many events a thread handles per stage activation
+    /**
+     * By default every event is scheduled on its own and a thread goes
+     * back to the run queue after each one.  With a quantum above 1 the
+     * stage is scheduled once per activation instead; the thread which
+     * takes it handles up to quantum events, or as many as it can within
+     * usec microseconds when usec isn't 0, before it requeues the stage.
+     * A stage has at most as many activations as its pool has threads.
+     *
+     * @param[in] quantum  events per activation, 0 or 1 for no batching
+     * @param[in] usec     time budget of an activation, 0 for none
+     *
+     * @pre  stage not connected
+     */
+    void setBatch(u32_t quantum, u32_t usec);
+
     //! Query whether stage is connected
     /**
      * @return true if stage is connected
      */
-    bool isConnected() const { return connected; }
+    bool isConnected() const
+        { return (eventRef & STAGE_DISCONNECTED) == 0; }
 
     //! Perform Stage-specific processing for an event
     /**
@@ -208,6 +280,25 @@ public:
      */
     virtual void handleEvent(StageEvent* event) = 0;
 
+    //! Perform Stage-specific processing for a batch of events
+    /**
+     * Called instead of handleEvent() for a stage which drains several
+     * events per activation, see setBatch().  A stage can override it to
+     * amortize work over the batch, like grouping writes under one sync.
+     * The default handles the events one by one.
+     *
+     * @param[in] events  events to be handled, in queue order
+     * @param[in] n       number of events, at least 1
+     *
+     * @post  events must not be de-referenced by caller after return
+     */
+    virtual void handleEvents(StageEvent** events, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            handleEvent(events[i]);
+        }
+    }
+
     //! Perform Stage-specific callback processing for an event
     /**
      * Implement callback processing according to the requirements of
@@ -259,6 +350,19 @@ protected:
      */
     StageEvent* removeEvent();
 
+    //! Wake the producers waiting for room, after events are removed
+    void wakeProducers();
+
+    //! Apply the overload policy to an event for a full queue
+    /**
+     * @return 1 if addEvent() is to queue the event, 0 if it has been
+     *         taken care of, -1 if it is rejected
+     */
+    int overload(StageEvent* event);
+
+    //! Queue event in place of the oldest one, which is shed
+    bool replaceOldest(StageEvent* event);
+
     //! Release ref on stage from event.
     /**
      * Release event reference on stage.  Called only by service thread.
@@ -307,12 +411,23 @@ protected:
 
 private:
 
-    std::deque<StageEvent*> eventList;      //!< event queue
-    mutable pthread_mutex_t listMutex;      //!< protects the event queue
+    EventQueue              eventList;      //!< event queue
+    pthread_mutex_t         disconnectMutex;//!< protects disconnectCond
     pthread_cond_t          disconnectCond; //!< wait here for disconnect
-    bool                    connected;      //!< is stage connected to pool?
-    unsigned long           eventRef;       //!< # of outstanding events
+    bool                    drained;        //!< last event released
+    volatile unsigned long  eventRef;       //!< # of outstanding events,
+                                            //!< STAGE_DISCONNECTED if the
+                                            //!< stage isn't connected
     Threadpool*             thPool;         //!< Threadpool for this stage
+    u32_t                   batchQuantum;   //!< events per activation
+    u32_t                   batchTime;      //!< usec per activation
+    volatile unsigned int   activations;    //!< threads on the stage
+    u32_t                   capacity;       //!< max queued, 0 for no limit
+    OverloadPolicy          overloadPolicy; //!< applied beyond capacity
+    volatile u64_t          overloads;      //!< events finding it full
+    volatile unsigned int   blockedProducers;//!< waiting for room
+    pthread_mutex_t         overloadMutex;  //!< protects overloadCond
+    pthread_cond_t          overloadCond;   //!< wait here for room
 
 protected:
 
@@ -328,15 +443,38 @@ protected:
 inline void Stage::setPool(Threadpool* th) {
     ASSERT((th != NULL), "threadpool not available for stage %s",
            this->getName());
-    ASSERT(!connected, "attempt to set threadpool while connected: %s",
+    ASSERT(!isConnected(), "attempt to set threadpool while connected: %s",
            this->getName());
     thPool = th;
 }
 
+inline void Stage::setBatch(u32_t quantum, u32_t usec) {
+    ASSERT(!isConnected(), "attempt to set batching while connected: %s",
+           this->getName());
+    batchQuantum = quantum;
+    batchTime    = usec;
+}
+
+inline void Stage::setCapacity(u32_t cap, OverloadPolicy policy) {
+    ASSERT(!isConnected(), "attempt to set capacity while connected: %s",
+           this->getName());
+    capacity       = cap;
+    overloadPolicy = policy;
+}
+
+inline void Stage::wakeProducers() {
+    // a producer counts itself blocked before it checks the queue length
+    if (blockedProducers) {
+        MUTEX_LOCK(&overloadMutex);
+        COND_BRAODCAST(&overloadCond);
+        MUTEX_UNLOCK(&overloadMutex);
+    }
+}
+
 inline void Stage::pushStage(Stage* st) {
     ASSERT((st != NULL), "next stage not available for stage %s",
            this->getName());
-    ASSERT(!connected, "attempt to set push stage while connected: %s",
+    ASSERT(!isConnected(), "attempt to set push stage while connected: %s",
            this->getName());
     nextStageList.push_back(st);
 }
@@ -21,6 +21,9 @@
 #include <time.h>
 
 #include "defs.h"
+#include "lang/typetag.h"
+#include "mm/lobjpool.h"
+#include "seda/eventqueue.h"
 
 /** 
  * @file
@@ -28,6 +31,11 @@
  * @date   1/24/07
  */
 
+//! Max hops kept in the history of an event, EventHistorySize lowers it
+#ifndef STAGE_EVENT_HIST_SIZE
+#define STAGE_EVENT_HIST_SIZE 8
+#endif
+
 class CompletionCallback;
 class UserData;
 class Stage;
@@ -59,12 +67,20 @@ class TimeoutInfo;
  * Calling doneImmediate() has the same effect as done(), except that the
  * callbacks are executed on the current stack.
  * </ul>
+ * The event carries its own link for the stage queue, so queueing it
+ * doesn't allocate.
  */
 
-class StageEvent {
+class StageEvent : public EventQueueLink {
 
 public:
-    
+
+    // events and all the derived ones come from an object pool
+    CLOBJPOOL_DECLARE()
+
+    // event classes with a handler of their own declare CLTYPETAG
+    CLTYPETAG_ROOT(StageEvent)
+
     //! Constructor
     /**
      *  Should not create StageEvents on the stack.  done() assumes that
@@ -85,6 +101,16 @@ public:
     //! Processing for this event is done; execute callbacks immediately
     void doneImmediate();
     
+    //! Processing for this event is done; callbacks to be added by caller
+    /**
+     *  For a caller completing many events at once, which adds them to
+     *  their stages in batches, see Stage::addEvents().  Without a
+     *  callback the event is released as by done().
+     *
+     *  @return the stage to add the event to as a callback, or NULL
+     */
+    Stage* doneTarget();
+
     //! Processing for this event is done if the event has timed out
     /**
      *  \c timeoutEvent() will be called instead of \c callbackEvent()
@@ -92,6 +118,13 @@ public:
      */
     void doneTimeout();
 
+    //! A stage has no room for this event; complete it
+    /**
+     *  Runs the callbacks like \c done() by default.  An event which
+     *  carries a status sets a failure first.
+     */
+    virtual void shed();
+
     //! Set the completion callback
     void pushCallback(CompletionCallback* cb);
 
@@ -134,14 +167,35 @@ public:
         TIMEOUT_EV
     } HistType;
 
-    //! Add stage to list of stages which have handled this event
+    //! A stage which has handled this event
+    typedef struct _HistEntry {
+        Stage*   stage;
+        HistType type;
+        s64_t    usec;              //!< when the stage got the event
+    } HistEntry;
+
+    //! Add stage to the history of stages which have handled this event
     void saveStage(Stage* stg, HistType type);
 
-private:
+    //! Number of stages which have handled this event
+    u32_t getStageHops() const { return stageHops; }
+
+    //! Number of entries in the history, the last hops up to its size
+    u32_t getHistoryCount() const;
 
-    typedef std::pair<Stage*, HistType> HistEntry;
+    //! Entry i of the history, 0 is the oldest one kept
+    const HistEntry& getHistory(u32_t i) const;
+
+    //! Name of a history entry type
+    static const char* histTypeName(HistType type);
+
+    //! Print the history as "stage:type:+usec" from the oldest entry
+    void dumpHistory(std::string& info) const;
+
+private:
 
-    std::list<HistEntry>* history; //!< List of stages which have handled ev
+    HistEntry history[STAGE_EVENT_HIST_SIZE];   //!< ring of the last hops
+    u32_t histNext;                 //!< slot of the next entry
     u32_t stageHops;                //!< Number of stages which have handled ev
 
 
@@ -191,5 +245,6 @@ public:
 
 bool& theEventHistoryFlag();
 u32_t& theMaxEventHops();
+u32_t& theEventHistorySize();
 
 #endif // _STAGEEVENT_HXX_
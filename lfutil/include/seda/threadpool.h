@@ -17,8 +17,15 @@
 
 #include "defs.h"
 
+#include "os/lcpuset.h"
 #include "seda/killthread.h"
 
+#define THREADPOOL_MAX_WORKERS 1024  //!< threads a pool may have at once
+#define THREADPOOL_MAX_STEAL   32    //!< stages taken by one steal
+#define THREADPOOL_MAX_BATCH   64    //!< events per Stage::handleEvents()
+#define THREADPOOL_INLINE_DEPTH 8    //!< default of setInlineDepth()
+#define THREADPOOL_CALLBACK_DEPTH 4  //!< default of setCallbackDepth()
+
 /** 
  *  @file
  *  @author Longda
@@ -26,23 +33,38 @@
  */
 
 class Stage;
+class StageEvent;
 
 //! A thread pool for one or more seda stages
 /** 
- * The Threadpool class consists of a pool of worker threads and a
- * scheduling queue of active seda Stages that have events that need
- * processing.  Each thread in the thread pool constantly examines the
- * head of the scheduling queue for a scheduled stage.  It then removes
- * the scheduled stage from the queue, and selects an event from the
- * Stage's event queue for processing. The thread then processes the event
- * using the Stage's handleEvent() member function before starting the
- * process over.  If the thread finds the scheduling queue empty, it sleeps
- * on a condition waiting for Stages to schedule themselves.
+ * The Threadpool class consists of a pool of worker threads, each with
+ * its own scheduling queue of active seda Stages that have events that
+ * need processing.  Each thread constantly examines the head of its queue
+ * for a scheduled stage.  It then removes the scheduled stage from the
+ * queue, and selects an event from the Stage's event queue for processing.
+ * The thread then processes the event using the Stage's handleEvent()
+ * member function before starting the process over.
+ * <p>
+ * A stage scheduled by a thread of the pool goes to that thread's queue,
+ * stages scheduled from outside are spread over the queues round robin.
+ * A thread which finds its queue empty steals half of the queue of a
+ * randomly chosen thread, and only if every queue is empty it sleeps on
+ * a condition waiting for Stages to schedule themselves.  So the threads
+ * don't contend on a single run queue for every event.
+ * <p>
+ * When a handler schedules a stage of its own pool and the thread's queue
+ * is empty, the stage isn't queued at all: the thread runs it as soon as
+ * the handler returns, so the event stays on the core whose cache holds
+ * it.  Such handoffs are limited to a number in a row, see
+ * setInlineDepth().
  * <p>
  * The number of threads in the pool can be controlled by clients. On
  * creation, the caller provides a parameter indicating the initial number
  * of worker threads, but this number can be adjusted at any time by using
  * the addThreads(), numThreads(), and killThreads() interfaces.
+ * <p>
+ * A pool may be given CPUs to run on, every thread it creates is pinned
+ * to them from its start, see CLcpuset.
  */
 class Threadpool {
 
@@ -52,10 +74,12 @@ public:
     /**
      * @param[in] threads The number of threads to create.
      * @param[in] name    Name of the thread pool.
+     * @param[in] cpus    CPUs the threads are pinned to, empty for none
      *
      * @post thread pool has <i>threads</i> threads running
      */
-    Threadpool(unsigned int threads, const std::string& name = std::string());
+    Threadpool(unsigned int threads, const std::string& name = std::string(),
+               const CLcpuset& cpus = CLcpuset());
 
     //! Destructor
     /**
@@ -70,6 +94,16 @@ public:
      * @return number of threads in the thread pool.
      */
     unsigned int numThreads();
+
+    //! Query number of threads sleeping for want of work
+    unsigned int numIdle() const { return nIdles; }
+
+    //! Events handled by the threads of the pool so far
+    /**
+     * Sums counters kept by each thread without locking, so the result
+     * may lag the latest events by a little.
+     */
+    unsigned long eventsHandled() const;
   
     //! Add threads to the pool
     /**
@@ -97,17 +131,57 @@ public:
     //! Schedule stage with some work
     /**
      * Schedule a stage with some work to be done on the run queue.
+     * A stage with a batch quantum is only put on the run queue when it
+     * has less activations than the pool has threads, see
+     * Stage::setBatch().
      *
      * @param[in] stageP Reference to stage to be scheduled.
+     * @param[in] count  events added to the stage at once, the stage is
+     *                   put on the run queue as often in one go
      * 
      * @pre  stageP must have a non-empty queue.
      * @post stageP is scheduled on the run queue.
      */
-    void schedule(Stage* stageP);
+    void schedule(Stage* stageP, unsigned int count = 1);
 
     //! Get name of thread pool
     const std::string& getName();
 
+    //! CPUs the threads of the pool are pinned to
+    const CLcpuset& getCpus() const { return cpus; }
+
+    //! Set how many stages a thread may run in a row by handoff
+    /**
+     * @param[in] depth  handoffs in a row, 0 queues every stage
+     */
+    void setInlineDepth(unsigned int depth);
+
+    //! Set how many callbacks may run nested on a thread of the pool
+    /**
+     * @param[in] depth  nested callbacks, 0 reschedules every callback
+     */
+    void setCallbackDepth(unsigned int depth);
+
+    //! Run the completion callback of an event on the calling thread
+    /**
+     * Runs the callback of \c stageP like doneImmediate(), if the calling
+     * thread serves the pool of the connected stage and less than the
+     * callback depth of the pool run nested on the thread already.
+     *
+     * @param[in] stageP Stage which set the callback on top of the event.
+     * @param[in] event  Event to complete.
+     *
+     * @return true if the callback has run, false if it has to be
+     *         rescheduled on the stage instead
+     */
+    static bool runCallback(Stage* stageP, StageEvent* event);
+
+    //! Pool of the calling thread
+    /**
+     * @return NULL if the thread doesn't serve a pool
+     */
+    static Threadpool* current();
+
     //! Initialize the static data structures of ThreadPool
     static void createPoolKey();
 
@@ -142,32 +216,84 @@ private:
      * Function which contains the control loop for each service thread.
      * Should not be called except when a thread is created.
      */
-    static void * runThread(void* poolPtr);
+    static void * runThread(void* workerPtr);
+
+    //! Run queue of one service thread
+    typedef struct _Worker {
+        Threadpool*             pool;      //!< pool of the thread
+        pthread_mutex_t         mutex;     //!< protects runQueue
+        std::deque<Stage*>      runQueue;  //!< stages with work to do
+        volatile unsigned int   queued;    //!< runQueue size, read unlocked
+        volatile bool           active;    //!< a thread serves the queue
+        unsigned int            seed;      //!< picks steal victims
+        Stage*                  handoff;   //!< runs after the handler
+        unsigned int            depth;     //!< handoffs in a row
+        unsigned int            cbDepth;   //!< callbacks run nested
+        volatile unsigned long  handled;   //!< events handled, own thread
+    } Worker;
+
+    //! Allocate one more run queue
+    void addWorker();
+
+    //! Put a stage on a run queue count times
+    void enqueue(Stage* stageP, unsigned int count = 1);
+
+    //! Drain events of a batching stage for one activation
+    /**
+     * @return number of events taken from the stage
+     */
+    unsigned int runBatch(Stage* runStage);
+
+    //! Handle one event of a stage
+    void runEvent(Stage* runStage, StageEvent* event);
+
+    //! Complete callbacks and timed out events
+    /**
+     * @return true if the event is left to be handled by the stage
+     */
+    bool prepareEvent(Stage* runStage, StageEvent* event);
+
+    //! Take the next stage to run, sleeps until there is one
+    Stage* takeWork(Worker* self);
+
+    //! Take a stage from the queue of another thread
+    Stage* steal(Worker* self);
+
+    //! Whether any run queue has stages
+    bool hasWork();
+
+    //! Wake up to count sleeping threads
+    void wakeIdle(unsigned int count = 1);
 
-    //! Save the thread pool pointer for this thread
-    static void setThreadPoolPtr(const Threadpool* thdPool);
+    //! Save the run queue for this thread
+    static void setWorker(Worker* worker);
 
-    //! Get the thread pool pointer for this thread
-    static const Threadpool* getThreadPoolPtr();
+    //! Get the run queue of this thread, NULL if not a service thread
+    static Worker* getWorker();
 
 private:
 
     // run queue state
-    pthread_mutex_t    runMutex;   //!< protects the run queue
+    Worker*            workers[THREADPOOL_MAX_WORKERS]; //!< run queues
+    volatile unsigned int nWorkers;   //!< run queues allocated
+    volatile unsigned int nextWorker; //!< round robin for outside threads
+    pthread_mutex_t    runMutex;   //!< protects sleeping on runCond
     pthread_cond_t     runCond;    //!< wait here for stage to be scheduled
-    std::deque<Stage*> runQueue;   //!< list of stages with work to do
     bool               eventhist;  //!< is event history enabled?
+    unsigned int       inlineDepth;//!< handoffs in a row
+    unsigned int       callbackDepth;//!< nested callbacks on a thread
 
     // thread state
     pthread_mutex_t threadMutex;       //!< protects thread state
     pthread_cond_t  threadCond;        //!< wait here when killing threads
     unsigned int    nthreads;          //!< number of service threads
     unsigned int    threadsToKill;     //!< number of pending kill events
-    unsigned int    nIdles;            //!< number of idle threads
+    volatile unsigned int nIdles;      //!< idle threads, runMutex
     KillThreadStage killer;            //!< used to kill threads
     std::string     name;              //!< name of threadpool
+    CLcpuset        cpus;              //!< pins threads when created
 
-    //! key of thread specific to store thread pool pointer
+    //! key of thread specific to store the run queue of the thread
     static pthread_key_t poolPtrKey;
 
     // allow KillThreadStage to kill threads
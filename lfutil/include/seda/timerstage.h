@@ -22,11 +22,15 @@
 #include "seda/stageevent.h"
 #include "seda/stage.h"
 #include "seda/callback.h"
+#include "seda/dispatchtable.h"
+#include "seda/timerwheel.h"
 
 #define NSEC_PER_SEC    1000000000
 #define USEC_PER_SEC    1000000
 #define NSEC_PER_USEC   1000
 
+#define TIMER_MAX_SHARDS    64  // threads beyond share the shards
+
 /**
  *  \author longda
  *  \date October 22, 2007
@@ -43,9 +47,11 @@ class TimerToken
 public:
     TimerToken();
     TimerToken(const struct timeval& t);
+    TimerToken(const struct timeval& t, u64_t n, u32_t s);
     TimerToken(const TimerToken& tt);
     const struct timeval& getTime() const;
     u64_t getNonce() const;
+    u32_t getShard() const;
     bool operator<(const TimerToken& other) const;
     TimerToken& operator=(const TimerToken& src);
     std::string toString() const;
@@ -54,11 +60,12 @@ public:
                                    const TimerToken& tt2);
 
 private:
-    void set(const struct timeval& t, u64_t n);
+    void set(const struct timeval& t, u64_t n, u32_t s);
     static u64_t nextNonce();
 
     struct timeval time;
     u64_t nonce;
+    u32_t shard;
 };
 
 /**
@@ -69,6 +76,8 @@ private:
  */
 class TimerEvent : public StageEvent
 {
+    CLTYPETAG(TimerEvent, StageEvent)
+
 public:
     TimerEvent() : StageEvent() { return; }
     virtual ~TimerEvent() { return; }
@@ -90,6 +99,8 @@ public:
  */
 class TimerRegisterEvent : public TimerEvent
 {
+    CLTYPETAG(TimerRegisterEvent, TimerEvent)
+
 public:
     /**
      *  \brief Create an event to request the registration of a timer
@@ -201,6 +212,8 @@ private:
  */
 class TimerCancelEvent : public TimerEvent
 {
+    CLTYPETAG(TimerCancelEvent, TimerEvent)
+
 public:
     /**
      *  \brief Create an event to request the cancellation of a timer
@@ -276,8 +289,20 @@ private:
  *  will never be invoked before the requested time; the punctuality
  *  of the event triggering will depend on the load on the system.
  *
+ *  A stage may also call \c schedule() and \c cancel() directly,
+ *  which do the same as the events without going through the queue of
+ *  the \c TimerStage; both are thread safe.
+ *
  *  Implementation note: The \c TimerStage creates an internal thread
- *  to maintain the timer.
+ *  to maintain the timer.  Timers are kept in one \c TimerWheel per
+ *  thread arming them, a shard, which the timer thread sweeps.  The
+ *  tick of the wheels is the \c TimerResolution property of the
+ *  stage, in microseconds, 100 by default; a callback fires at most
+ *  one tick late on an idle system.  The thread sleeps in epoll on a
+ *  timerfd set to the next expiry and on an eventfd which an earlier
+ *  timer or the shutdown writes to.  The expired events are handed to
+ *  the stages of their callbacks in one \c Stage::addEvents() per
+ *  stage.
  */
 class TimerStage : public Stage
 {
@@ -291,6 +316,32 @@ public:
      */
     u32_t getNumEvents();
 
+    /**
+     *  \brief Trigger an event after some time, as a \c
+     *  TimerRegisterEvent with relative time would.
+     *
+     *  The \c TimerStage owns the event until it is triggered.
+     *
+     *  \return
+     *    The token to cancel the timer with.
+     */
+    TimerToken schedule(StageEvent* cb, u64_t time_relative_usec);
+
+    /**
+     *  \brief Trigger an event at some time, as a \c
+     *  TimerRegisterEvent with absolute time would.
+     */
+    TimerToken schedule(StageEvent* cb, struct timeval& time_absolute);
+
+    /**
+     *  \brief Cancel a timer, as a \c TimerCancelEvent would.
+     *
+     *  \return
+     *    \c true if the timer was cancelled before it was triggered,
+     *    its event is deleted; \c false otherwise
+     */
+    bool cancel(const TimerToken& token);
+
 protected:
     TimerStage(const char* tag);
     bool setProperties();
@@ -299,29 +350,51 @@ protected:
     void callbackEvent(StageEvent* event, CallbackContext* context);
     void disconnectPrepare();
 
-    // For ordering the keys in the timer_queue.
+    // Orders tokens by deadline, then by nonce.
     static bool
     timerTokenLessThan(const TimerToken& tt1, const TimerToken& tt2);
 
 private:
-    void registerTimer(TimerRegisterEvent& reg_ev);
-    void cancelTimer(TimerCancelEvent& cancel_ev);
+    void registerTimer(TimerRegisterEvent* reg_ev);
+    void cancelTimer(TimerCancelEvent* cancel_ev);
     bool timevalLessThan(const struct timeval& t1, const struct timeval& t2);
-    void triggerTimerCheck();
     void checkTimer();
+    void dispatchExpired(std::vector<StageEvent*>& expired);
+    bool waitTimer(u64_t deadline);
+
+    class TimerShard;
+
+    //! expired events of a sweep going to one stage
+    typedef struct _TimerBatch {
+        Stage* stage;
+        std::vector<StageEvent*> events;
+    } TimerBatch;
+
+    TimerToken scheduleAt(StageEvent* cb, const struct timeval& when);
+    TimerShard* threadShard();
+    void wakeTimer(u64_t deadline);
 
     static void* startTimerThread(void* arg);
+    static u64_t monotonicUsec();
+
+    //! pending timers, the shard of a token is the index and its nonce
+    //! the id in the wheel of the shard
+    TimerShard* volatile shards[TIMER_MAX_SHARDS];
+    u32_t shard_seq;          //! shards handed to threads so far
+    pthread_key_t shard_key;  //! shard of the calling thread
+    u32_t resolution;         //! usec per tick of the wheels
+    volatile u64_t sleep_until; //! usec the timer thread sleeps until
+
+    DispatchTable<TimerStage> dispatch_table; //! handlers by event type
 
-    typedef
-      std::map<TimerToken, StageEvent*,
-               bool(*)(const TimerToken&, const TimerToken&)> timer_queue_t;
-    timer_queue_t timer_queue;
+    std::vector<TimerBatch> batches; //! of the timer thread, by stage
 
-    pthread_mutex_t timer_mutex;
-    pthread_cond_t timer_condv;
+    int timer_fd;        //! timerfd armed at sleep_until
+    int wake_fd;         //! eventfd to wake the timer thread up
+    int epoll_fd;        //! the timer thread waits on both fds
 
-    bool shutdown;       //! true if stage has received the shutdown signal
-    u32_t num_events; //! the number of timer events currently outstanding
+    volatile bool shutdown; //! true if stage has received the shutdown signal
+    volatile u32_t num_events; //! the number of timer events currently outstanding
     pthread_t timer_thread_id; //! thread id of the timer maintenance thread
 };
 
@@ -0,0 +1,144 @@
+// __CR__
+// Copyright (c) 2008-2010 Longda Corporation
+// All Rights Reserved
+//
+// This software contains the intellectual property of Longda Corporation
+// or is licensed to Longda Corporation from third parties.  Use of this
+// software and the intellectual property contained therein is expressly
+// limited to the terms and conditions of the License Agreement under which
+// it is provided by or on behalf of Longda.
+// __CR__
+
+
+#ifndef _TIMERWHEEL_HXX_
+#define _TIMERWHEEL_HXX_
+
+// Include Files
+#include <vector>
+
+#include "defs.h"
+
+/**
+ *  @file
+ *  @author Longda
+ *  @date   10/18/26
+ */
+
+class StageEvent;
+
+#define TIMERWHEEL_ROOT_BITS    8
+#define TIMERWHEEL_LEVEL_BITS   6
+#define TIMERWHEEL_LEVELS       5       // 8 + 4 * 6 = 32 bits of ticks
+#define TIMERWHEEL_ROOT_SIZE    (1 << TIMERWHEEL_ROOT_BITS)
+#define TIMERWHEEL_LEVEL_SIZE   (1 << TIMERWHEEL_LEVEL_BITS)
+#define TIMERWHEEL_SLOTS        (TIMERWHEEL_ROOT_SIZE + \
+                                 (TIMERWHEEL_LEVELS - 1) * TIMERWHEEL_LEVEL_SIZE)
+#define TIMERWHEEL_CHUNK_SIZE   512     // timers allocated at a time
+
+//! No timer is pending, see TimerWheel::nextExpiry()
+#define TIMERWHEEL_NEVER        (~(u64_t)0)
+
+//! Hierarchical timing wheel of timer events
+/**
+ * Time is cut in ticks of resolution microseconds.  The root wheel has a
+ * slot per tick for the next 256 ticks, each of the outer wheels has 64
+ * slots each covering a full turn of the wheel inside it.  A timer is
+ * linked into the slot of its expiry tick in the innermost wheel that
+ * reaches it, and when a wheel completes a turn the next slot of the
+ * wheel outside is cascaded, its timers moved inwards.  Timers further
+ * than 2^32 ticks wait in the outermost wheel until they come in range.
+ * <p>
+ * Adding and cancelling a timer are O(1) and don't allocate once the
+ * pool of timers has grown to the number pending, expiry is O(1) per
+ * tick plus the timers moved.  A timer never expires before its
+ * deadline, and at most one tick after it when expire() is called on
+ * time.
+ * <p>
+ * The wheel is not thread safe.
+ */
+class TimerWheel {
+
+public:
+
+    /**
+     * @param[in] resolution  usec per tick, at least 1
+     * @param[in] now         current time in usec, of the clock used for
+     *                        all the deadlines
+     */
+    TimerWheel(u32_t resolution, u64_t now);
+    ~TimerWheel();
+
+    //! Add a timer for event
+    /**
+     * @param[in] event     event to hand back when the timer expires
+     * @param[in] deadline  usec, a deadline in the past expires on the
+     *                      next tick
+     * @return id to cancel the timer with, never 0
+     */
+    u64_t add(StageEvent* event, u64_t deadline);
+
+    //! Cancel a timer
+    /**
+     * @return the event of the timer, NULL if it has expired or been
+     *         cancelled already
+     */
+    StageEvent* cancel(u64_t id);
+
+    //! Take the events of the timers expired by now
+    /**
+     * @param[in]  now      current time in usec
+     * @param[out] expired  events appended in expiry order
+     */
+    void expire(u64_t now, std::vector<StageEvent*>& expired);
+
+    //! Time to call expire() next
+    /**
+     * Either the deadline of the earliest timer, or earlier when a wheel
+     * has to cascade before the earliest timer is known.
+     *
+     * @return usec, TIMERWHEEL_NEVER if no timer is pending
+     */
+    u64_t nextExpiry() const;
+
+    //! Take the events of all pending timers
+    void drain(std::vector<StageEvent*>& events);
+
+    //! Number of pending timers
+    size_t size() const { return count; }
+
+    u32_t getResolution() const { return resolution; }
+
+private:
+
+    typedef struct _Node {
+        struct _Node* prev;
+        struct _Node* next;
+        StageEvent*   event;        //!< NULL when the node is free
+        u64_t         expires;      //!< tick
+        u32_t         gen;          //!< bumped when the node is freed
+        u32_t         index;        //!< in the pool of nodes
+        u32_t         slot;         //!< slot the node is linked in
+    } Node;
+
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    void  link(Node* node);
+    void  unlink(Node* node);
+    void  cascade(int level, u32_t idx);
+    bool  rootEmptyFrom(u32_t idx) const;
+    Node* allocNode();
+    void  freeNode(Node* node);
+
+    Node               slots[TIMERWHEEL_SLOTS];    //!< list heads
+    u64_t              rootBits[TIMERWHEEL_ROOT_SIZE / 64];
+                                                   //!< non-empty root slots
+    std::vector<Node*> chunks;                     //!< pool of nodes
+    Node*              freeNodes;
+    u32_t              nodeCount;                  //!< nodes carved
+    u64_t              curTick;                    //!< next tick to expire
+    size_t             count;
+    u32_t              resolution;
+};
+
+#endif // _TIMERWHEEL_HXX_
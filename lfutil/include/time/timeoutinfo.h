@@ -16,6 +16,7 @@
 #include <time.h>
 
 #include "os/mutex.h"
+#include "mm/lobjpool.h"
 
 
 //! Timeout info class used to judge if a certain deadline has reached or not.
@@ -29,6 +30,9 @@ class TimeoutInfo
 {
 public:
 
+    // timeout infos come from an object pool
+    CLOBJPOOL_DECLARE()
+
     //! Constructor
     /**
      * @param[in] deadline  deadline of this timeout
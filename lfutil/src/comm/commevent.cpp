@@ -183,6 +183,18 @@ void CommEvent::completeEvent(CommEvent::status_t stev)
     done();
 }
 
+void CommEvent::shed()
+{
+    if (serverGen)
+    {
+        doneWithErrorResponse(RESOURCE_FAILURE, RESOURCE_FAILURE,
+                "Server overloaded");
+        return;
+    }
+
+    completeEvent(RESOURCE_FAILURE);
+}
+
 void CommEvent::setServerGen()
 {
     serverGen = true;
@@ -36,6 +36,9 @@ CommStage::CommStage(const char* tag) :
 
     MUTEX_INIT(&mCounterMutex, &attr);
 
+    mDispatch.addHandler<CommEvent, &CommStage::sendRequest>();
+    mDispatch.addCallback<CommEvent, &CommStage::sendResponse>();
+
     LOG_TRACE("exit");
 }
 
@@ -165,31 +168,9 @@ void CommStage::handleEvent(StageEvent* event)
 {
     LOG_TRACE("Enter\n");
 
-    CommEvent *cev = NULL;
-    CommSendEvent *sev = NULL;
-    CommRecvEvent *rev = NULL;
-
-    if ((cev = dynamic_cast<CommEvent*>(event)))
-    {
-        sendRequest(cev);
-        LOG_TRACE("Exit\n");
-        return;
-    }
-    else if ((sev = dynamic_cast<CommSendEvent *>(event)))
-    {
-        LOG_ERROR("Unexcepted CommSendEvent");
-        event->done();
-        return;
-    }
-    else if ((rev = dynamic_cast<CommRecvEvent *>(event)))
+    if (mDispatch.handle(this, event) == false)
     {
-        LOG_ERROR("Unexcepted CommRecvEvent");
-        event->done();
-        return;
-    }
-    else
-    {
-        LOG_ERROR("Unknow type event");
+        LOG_ERROR("Unexcepted %s", event->typeTag().getName());
         event->done();
         return;
     }
@@ -201,16 +182,9 @@ void CommStage::handleEvent(StageEvent* event)
 void CommStage::callbackEvent(StageEvent* event, CallbackContext* context)
 {
     LOG_TRACE("Enter\n");
-    CommEvent *cev = NULL;
-    if ((cev = dynamic_cast<CommEvent*>(event)))
-    {
-        sendResponse(cev);
-        LOG_TRACE("Exit\n");
-        return;
-    }
-    else
+    if (mDispatch.callback(this, event, context) == false)
     {
-        LOG_ERROR("Unknow type event");
+        LOG_ERROR("Unexcepted %s", event->typeTag().getName());
         event->done();
         return;
     }
@@ -243,7 +217,7 @@ void CommStage::sendRequest(CommEvent *cev)
 
     MsgDesc md = cev->getRequest();
     Message* reqMsg = md.message;
-    if (reqMsg == NULL || dynamic_cast<Request *>(reqMsg) == NULL)
+    if (typetag_cast<Request>(reqMsg) == NULL)
     {
         cev->completeEvent(CommEvent::INVALID_PARAMETER);
 
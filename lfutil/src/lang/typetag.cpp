@@ -0,0 +1,34 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * typetag.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#include "lang/typetag.h"
+
+static volatile u32_t gTypeTagCount = 0;
+
+CLtypeTag::CLtypeTag(const CLtypeTag *parent, const char *name) :
+    mId(__sync_fetch_and_add(&gTypeTagCount, 1)),
+    mParent(parent),
+    mName(name)
+{
+}
+
+u32_t CLtypeTag::count()
+{
+    return gTypeTagCount;
+}
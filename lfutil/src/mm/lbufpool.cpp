@@ -0,0 +1,477 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * lbufpool.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mm/lbufpool.h"
+#include "os/lcpuset.h"
+#include "os/mutex.h"
+#include "trace/log.h"
+
+#define CLBUFPOOL_MAGIC        0x4C425546
+#define CLBUFPOOL_HEAP_HDR     64
+#define CLBUFPOOL_HUGE_PAGE    (2 * ONE_MILLION)
+
+CLbufpool*& theBufPool()
+{
+    static CLbufpool *bufPool = new CLbufpool();
+
+    return bufPool;
+}
+
+CLbufpool::CLbufpool() :
+    mMaxSize(0),
+    mThreadCacheSize(CLBUFPOOL_DEFAULT_TC_SIZE),
+    mHugePage(false),
+    mNumaLocal(false),
+    mAllocs(0),
+    mHits(0),
+    mFailures(0),
+    mOutstanding(0),
+    mHighWater(0),
+    mReserved(0)
+{
+    for (int node = 0; node < CLBUFPOOL_NODE_NUM; node++)
+    {
+        for (int i = 0; i < CLBUFPOOL_CLASS_NUM; i++)
+        {
+            MUTEX_INIT(&mLocks[node][i], NULL);
+        }
+    }
+
+    pthread_key_create(&mCacheKey, CLbufpool::flushThreadCache);
+}
+
+CLbufpool::~CLbufpool()
+{
+    // only the calling thread's cache can be reached here, the other
+    // threads flush theirs when they exit
+    ThreadCache *tc = (ThreadCache *)pthread_getspecific(mCacheKey);
+    if (tc)
+    {
+        pthread_setspecific(mCacheKey, NULL);
+        flushThreadCache(tc);
+    }
+
+    trim();
+
+    pthread_key_delete(mCacheKey);
+
+    for (int node = 0; node < CLBUFPOOL_NODE_NUM; node++)
+    {
+        for (int i = 0; i < CLBUFPOOL_CLASS_NUM; i++)
+        {
+            MUTEX_DESTROY(&mLocks[node][i]);
+        }
+    }
+}
+
+int CLbufpool::classOf(size_t size)
+{
+    int cls = 0;
+    while (cls < CLBUFPOOL_CLASS_NUM && classSize(cls) < size)
+    {
+        cls++;
+    }
+
+    return (cls < CLBUFPOOL_CLASS_NUM) ? cls : -1;
+}
+
+size_t CLbufpool::classSize(int cls)
+{
+    return ((size_t)1) << (cls + CLBUFPOOL_MIN_SHIFT);
+}
+
+CLbufpool::BufHdr *CLbufpool::hdrOf(void *buf)
+{
+    BufHdr *hdr = (BufHdr *)((char *)buf - sizeof(BufHdr));
+
+    ASSERT((hdr->magic == CLBUFPOOL_MAGIC), "buffer not from the pool");
+
+    return hdr;
+}
+
+CLbufpool::ThreadCache *CLbufpool::getThreadCache()
+{
+    if (mThreadCacheSize == 0)
+    {
+        return NULL;
+    }
+
+    ThreadCache *tc = (ThreadCache *)pthread_getspecific(mCacheKey);
+    if (tc == NULL)
+    {
+        tc = new ThreadCache;
+        memset(tc, 0, sizeof(*tc));
+        tc->pool = this;
+        pthread_setspecific(mCacheKey, tc);
+    }
+
+    return tc;
+}
+
+//! Free lists of the calling thread, all threads share node 0's without
+//! NUMA local allocation
+int CLbufpool::homeNode()
+{
+    if (mNumaLocal == false)
+    {
+        return 0;
+    }
+
+    return CLcpuset::currentNode() % CLBUFPOOL_NODE_NUM;
+}
+
+void CLbufpool::flushThreadCache(void *arg)
+{
+    ThreadCache *tc = (ThreadCache *)arg;
+
+    for (int cls = 0; cls < CLBUFPOOL_CLASS_NUM; cls++)
+    {
+        for (int i = 0; i < tc->count[cls]; i++)
+        {
+            tc->pool->putGlobal(cls, tc->bufs[cls][i]);
+        }
+    }
+
+    delete tc;
+}
+
+void *CLbufpool::allocBuf(int cls, size_t size, int node)
+{
+    // The mapped classes keep the header in a page of its own so the data
+    // starts page aligned, oversized buffers are accounted by mapped length
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = (cls < 0) ?
+            ((pageSize + size + pageSize - 1) & ~(pageSize - 1)) :
+            classSize(cls);
+
+    u64_t reserved = __sync_add_and_fetch(&mReserved, (u64_t)len);
+    if (mMaxSize && reserved > mMaxSize)
+    {
+        // Give back the idle buffers before refusing the request
+        trim();
+
+        if (mReserved > mMaxSize)
+        {
+            __sync_sub_and_fetch(&mReserved, (u64_t)len);
+            __sync_add_and_fetch(&mFailures, 1);
+            LOG_WARN("Buffer pool reaches its cap %llu, failed to get %llu",
+                    mMaxSize, (u64_t)size);
+            return NULL;
+        }
+    }
+
+    void   *mem    = NULL;
+    size_t  memLen = 0;
+    char   *buf    = NULL;
+
+    if (cls >= 0 && cls + CLBUFPOOL_MIN_SHIFT < CLBUFPOOL_MMAP_SHIFT)
+    {
+        if (posix_memalign(&mem, CLBUFPOOL_HEAP_HDR,
+                CLBUFPOOL_HEAP_HDR + len) != 0)
+        {
+            mem = NULL;
+        }
+        buf = (char *)mem + CLBUFPOOL_HEAP_HDR;
+    }
+    else
+    {
+        memLen = (cls < 0) ? len : (pageSize + len);
+
+#ifdef MAP_HUGETLB
+        if (mHugePage)
+        {
+            size_t hugeLen = (memLen + CLBUFPOOL_HUGE_PAGE - 1)
+                    & ~((size_t)CLBUFPOOL_HUGE_PAGE - 1);
+            mem = mmap(NULL, hugeLen, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem != MAP_FAILED)
+            {
+                memLen = hugeLen;
+            }
+        }
+#endif
+
+        if (mem == NULL || mem == MAP_FAILED)
+        {
+            mem = mmap(NULL, memLen, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (mem != MAP_FAILED && mHugePage)
+            {
+                madvise(mem, memLen, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        if (mem == MAP_FAILED)
+        {
+            mem = NULL;
+        }
+        else if (mNumaLocal)
+        {
+            // no page is touched yet, they all fault in on the node
+            CLcpuset::bindMemory(mem, memLen, node);
+        }
+        buf = (char *)mem + pageSize;
+    }
+
+    if (mem == NULL)
+    {
+        __sync_sub_and_fetch(&mReserved, (u64_t)len);
+        __sync_add_and_fetch(&mFailures, 1);
+        LOG_ERROR("Failed to alloc %llu bytes buffer", (u64_t)len);
+        return NULL;
+    }
+
+    if (cls < 0 && memLen != len)
+    {
+        __sync_add_and_fetch(&mReserved, (u64_t)(memLen - len));
+    }
+
+    BufHdr *hdr = (BufHdr *)(buf - sizeof(BufHdr));
+    hdr->mem    = mem;
+    hdr->memLen = memLen;
+    hdr->magic  = CLBUFPOOL_MAGIC;
+    hdr->cls    = cls;
+    hdr->node   = node;
+
+    return buf;
+}
+
+void CLbufpool::freeBuf(BufHdr *hdr)
+{
+    size_t len = (hdr->cls < 0) ? hdr->memLen : classSize(hdr->cls);
+
+    hdr->magic = 0;
+    if (hdr->memLen)
+    {
+        munmap(hdr->mem, hdr->memLen);
+    }
+    else
+    {
+        free(hdr->mem);
+    }
+
+    __sync_sub_and_fetch(&mReserved, (u64_t)len);
+}
+
+void CLbufpool::putGlobal(int cls, void *buf)
+{
+    BufHdr *hdr = hdrOf(buf);
+    if (mMaxSize && mReserved > mMaxSize)
+    {
+        freeBuf(hdr);
+        return;
+    }
+
+    int node = hdr->node;
+    MUTEX_LOCK(&mLocks[node][cls]);
+    mFree[node][cls].push_back(buf);
+    MUTEX_UNLOCK(&mLocks[node][cls]);
+}
+
+void CLbufpool::addOutstanding(u64_t len)
+{
+    u64_t outstanding = __sync_add_and_fetch(&mOutstanding, len);
+
+    u64_t highWater = mHighWater;
+    while (outstanding > highWater)
+    {
+        u64_t prev = __sync_val_compare_and_swap(&mHighWater, highWater,
+                outstanding);
+        if (prev == highWater)
+        {
+            break;
+        }
+        highWater = prev;
+    }
+}
+
+void *CLbufpool::get(size_t size)
+{
+    __sync_add_and_fetch(&mAllocs, 1);
+
+    int   cls  = classOf(size);
+    int   node = homeNode();
+    void *buf  = NULL;
+
+    if (cls >= 0)
+    {
+        ThreadCache *tc = getThreadCache();
+        if (tc && tc->count[cls] > 0)
+        {
+            buf = tc->bufs[cls][--tc->count[cls]];
+            tc->bytes -= classSize(cls);
+        }
+        else
+        {
+            MUTEX_LOCK(&mLocks[node][cls]);
+            if (mFree[node][cls].empty() == false)
+            {
+                buf = mFree[node][cls].back();
+                mFree[node][cls].pop_back();
+            }
+            MUTEX_UNLOCK(&mLocks[node][cls]);
+        }
+    }
+
+    if (buf)
+    {
+        __sync_add_and_fetch(&mHits, 1);
+    }
+    else
+    {
+        buf = allocBuf(cls, size, node);
+        if (buf == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    addOutstanding((cls < 0) ? hdrOf(buf)->memLen : classSize(cls));
+
+    return buf;
+}
+
+void CLbufpool::put(void *buf)
+{
+    if (buf == NULL)
+    {
+        return;
+    }
+
+    BufHdr *hdr = hdrOf(buf);
+    int     cls = hdr->cls;
+
+    if (cls < 0)
+    {
+        __sync_sub_and_fetch(&mOutstanding, (u64_t)hdr->memLen);
+        freeBuf(hdr);
+        return;
+    }
+
+    size_t len = classSize(cls);
+    __sync_sub_and_fetch(&mOutstanding, (u64_t)len);
+
+    // a thread caches buffers of its own node only
+    ThreadCache *tc = (hdr->node == homeNode()) ? getThreadCache() : NULL;
+    if (tc && tc->count[cls] < CLBUFPOOL_TC_MAX_COUNT &&
+            tc->bytes + len <= mThreadCacheSize)
+    {
+        tc->bufs[cls][tc->count[cls]++] = buf;
+        tc->bytes += len;
+        return;
+    }
+
+    putGlobal(cls, buf);
+}
+
+void CLbufpool::trim()
+{
+    for (int node = 0; node < CLBUFPOOL_NODE_NUM; node++)
+    {
+        for (int cls = 0; cls < CLBUFPOOL_CLASS_NUM; cls++)
+        {
+            std::vector<void *> idle;
+
+            MUTEX_LOCK(&mLocks[node][cls]);
+            idle.swap(mFree[node][cls]);
+            MUTEX_UNLOCK(&mLocks[node][cls]);
+
+            for (size_t i = 0; i < idle.size(); i++)
+            {
+                freeBuf(hdrOf(idle[i]));
+            }
+        }
+    }
+}
+
+void CLbufpool::setMaxSize(u64_t maxSize)
+{
+    mMaxSize = maxSize;
+}
+
+u64_t CLbufpool::getMaxSize()
+{
+    return mMaxSize;
+}
+
+void CLbufpool::setThreadCacheSize(u64_t size)
+{
+    mThreadCacheSize = size;
+}
+
+u64_t CLbufpool::getThreadCacheSize()
+{
+    return mThreadCacheSize;
+}
+
+void CLbufpool::setHugePage(bool enable)
+{
+    mHugePage = enable;
+}
+
+bool CLbufpool::getHugePage()
+{
+    return mHugePage;
+}
+
+void CLbufpool::setNumaLocal(bool enable)
+{
+    mNumaLocal = enable;
+}
+
+bool CLbufpool::getNumaLocal()
+{
+    return mNumaLocal;
+}
+
+void CLbufpool::getStats(Stats &stats)
+{
+    stats.allocs      = mAllocs;
+    stats.hits        = mHits;
+    stats.failures    = mFailures;
+    stats.outstanding = mOutstanding;
+    stats.highWater   = mHighWater;
+    stats.reserved    = mReserved;
+}
+
+void CLbufpool::output(std::string &info)
+{
+    Stats stats;
+    getStats(stats);
+
+    double hitRate = stats.allocs ?
+            (100.0 * stats.hits / stats.allocs) : 0.0;
+
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+            "Buffer pool allocs:%llu, hit rate:%.2f%%, failures:%llu, "
+            "outstanding:%llu, high water:%llu, reserved:%llu",
+            stats.allocs, hitRate, stats.failures,
+            stats.outstanding, stats.highWater, stats.reserved);
+
+    info = buf;
+}
@@ -0,0 +1,330 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * lobjpool.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm/lobjpool.h"
+#include "os/mutex.h"
+#include "trace/log.h"
+
+CLobjpool *theNodePool()
+{
+    static CLobjpool *nodePool = new CLobjpool("Node");
+
+    return nodePool;
+}
+
+CLobjpool::CLobjpool(const char *name) :
+    mName(name),
+    mAllocs(0),
+    mHits(0),
+    mFrees(0),
+    mReserved(0)
+{
+    for (int i = 0; i < CLOBJPOOL_CLASS_NUM; i++)
+    {
+        mFree[i] = NULL;
+        MUTEX_INIT(&mLocks[i], NULL);
+    }
+    MUTEX_INIT(&mCacheLock, NULL);
+
+    pthread_key_create(&mCacheKey, CLobjpool::flushThreadCache);
+}
+
+CLobjpool::~CLobjpool()
+{
+    // the objects still out point into the slabs, so the pool has to
+    // outlive them, only the calling thread's cache can be reached here
+    ThreadCache *tc = (ThreadCache *)pthread_getspecific(mCacheKey);
+    if (tc)
+    {
+        pthread_setspecific(mCacheKey, NULL);
+        flushThreadCache(tc);
+    }
+
+    pthread_key_delete(mCacheKey);
+
+    for (int i = 0; i < CLOBJPOOL_CLASS_NUM; i++)
+    {
+        for (size_t j = 0; j < mSlabs[i].size(); j++)
+        {
+            free(mSlabs[i][j]);
+        }
+        MUTEX_DESTROY(&mLocks[i]);
+    }
+    MUTEX_DESTROY(&mCacheLock);
+}
+
+int CLobjpool::classOf(size_t size)
+{
+    if (size == 0)
+    {
+        size = 1;
+    }
+    if (size > CLOBJPOOL_MAX_SIZE)
+    {
+        return -1;
+    }
+
+    return (int)((size - 1) >> CLOBJPOOL_ALIGN_SHIFT);
+}
+
+size_t CLobjpool::classSize(int cls)
+{
+    return ((size_t)(cls + 1)) << CLOBJPOOL_ALIGN_SHIFT;
+}
+
+CLobjpool::ThreadCache *CLobjpool::getThreadCache()
+{
+    ThreadCache *tc = (ThreadCache *)pthread_getspecific(mCacheKey);
+    if (tc == NULL)
+    {
+        tc = new ThreadCache;
+        memset(tc, 0, sizeof(*tc));
+        tc->pool = this;
+        pthread_setspecific(mCacheKey, tc);
+
+        MUTEX_LOCK(&mCacheLock);
+        mCaches.push_back(tc);
+        MUTEX_UNLOCK(&mCacheLock);
+    }
+
+    return tc;
+}
+
+void CLobjpool::flushThreadCache(void *arg)
+{
+    ThreadCache *tc   = (ThreadCache *)arg;
+    CLobjpool   *pool = tc->pool;
+
+    for (int cls = 0; cls < CLOBJPOOL_CLASS_NUM; cls++)
+    {
+        if (tc->count[cls] == 0)
+        {
+            continue;
+        }
+
+        void *last = tc->head[cls];
+        while (*(void **)last)
+        {
+            last = *(void **)last;
+        }
+        pool->putGlobal(cls, tc->head[cls], last);
+    }
+
+    MUTEX_LOCK(&pool->mCacheLock);
+    for (size_t i = 0; i < pool->mCaches.size(); i++)
+    {
+        if (pool->mCaches[i] == tc)
+        {
+            pool->mCaches[i] = pool->mCaches.back();
+            pool->mCaches.pop_back();
+            break;
+        }
+    }
+    pool->mAllocs += tc->allocs;
+    pool->mHits   += tc->hits;
+    pool->mFrees  += tc->frees;
+    MUTEX_UNLOCK(&pool->mCacheLock);
+
+    delete tc;
+}
+
+void CLobjpool::putGlobal(int cls, void *first, void *last)
+{
+    MUTEX_LOCK(&mLocks[cls]);
+    *(void **)last = mFree[cls];
+    mFree[cls] = first;
+    MUTEX_UNLOCK(&mLocks[cls]);
+}
+
+/**
+ * Move a batch of free objects of class cls to the thread cache
+ * @return 1 if they come from the global list, 0 if a new slab has been
+ *         carved for them, -1 if the system is out of memory
+ */
+int CLobjpool::refill(ThreadCache *tc, int cls)
+{
+    size_t size = classSize(cls);
+    int    rc   = 1;
+
+    MUTEX_LOCK(&mLocks[cls]);
+    if (mFree[cls] == NULL)
+    {
+        char *slab = (char *)malloc(CLOBJPOOL_SLAB_SIZE);
+        if (slab == NULL)
+        {
+            MUTEX_UNLOCK(&mLocks[cls]);
+            LOG_ERROR("Failed to alloc slab of %s pool", mName.c_str());
+            return -1;
+        }
+        mSlabs[cls].push_back(slab);
+        __sync_add_and_fetch(&mReserved, (u64_t)CLOBJPOOL_SLAB_SIZE);
+
+        // chain the objects of the slab in address order
+        size_t num = CLOBJPOOL_SLAB_SIZE / size;
+        for (size_t i = 0; i < num; i++)
+        {
+            *(void **)(slab + i * size) =
+                    (i + 1 < num) ? (void *)(slab + (i + 1) * size) : NULL;
+        }
+        mFree[cls] = slab;
+        rc = 0;
+    }
+
+    // move a batch over to the thread
+    void *first = mFree[cls];
+    void *last  = first;
+    u32_t count = 1;
+    while (count < CLOBJPOOL_BATCH && *(void **)last)
+    {
+        last = *(void **)last;
+        count++;
+    }
+    mFree[cls] = *(void **)last;
+    MUTEX_UNLOCK(&mLocks[cls]);
+
+    *(void **)last   = tc->head[cls];
+    tc->head[cls]    = first;
+    tc->count[cls]  += count;
+
+    return rc;
+}
+
+void *CLobjpool::get(size_t size)
+{
+    ThreadCache *tc = getThreadCache();
+    tc->allocs++;
+
+    int cls = classOf(size);
+    if (cls < 0)
+    {
+        void *obj = malloc(size);
+        if (obj == NULL)
+        {
+            tc->allocs--;
+        }
+        return obj;
+    }
+
+    int rc = 1;
+    if (tc->count[cls] == 0)
+    {
+        rc = refill(tc, cls);
+        if (rc < 0)
+        {
+            tc->allocs--;
+            return NULL;
+        }
+    }
+    tc->hits += rc;
+
+    void *obj = tc->head[cls];
+    tc->head[cls] = *(void **)obj;
+    tc->count[cls]--;
+
+    return obj;
+}
+
+void CLobjpool::put(void *obj, size_t size)
+{
+    if (obj == NULL)
+    {
+        return;
+    }
+
+    ThreadCache *tc = getThreadCache();
+    tc->frees++;
+
+    int cls = classOf(size);
+    if (cls < 0)
+    {
+        free(obj);
+        return;
+    }
+
+    *(void **)obj = tc->head[cls];
+    tc->head[cls] = obj;
+    if (++tc->count[cls] <= CLOBJPOOL_TC_MAX_COUNT)
+    {
+        return;
+    }
+
+    // keep the objects put last, they are the warm ones, and hand the
+    // rest back to the global list
+    u32_t keep = CLOBJPOOL_TC_MAX_COUNT - CLOBJPOOL_BATCH;
+    void *last = obj;
+    for (u32_t i = 1; i < keep; i++)
+    {
+        last = *(void **)last;
+    }
+    void *first = *(void **)last;
+    *(void **)last = NULL;
+    tc->count[cls] = keep;
+
+    void *tail = first;
+    while (*(void **)tail)
+    {
+        tail = *(void **)tail;
+    }
+    putGlobal(cls, first, tail);
+}
+
+void CLobjpool::getStats(Stats &stats)
+{
+    u64_t allocs, hits, frees;
+
+    // the counters of other threads are read while they change, the sum
+    // is a snapshot of some point during the call
+    MUTEX_LOCK(&mCacheLock);
+    allocs = mAllocs;
+    hits   = mHits;
+    frees  = mFrees;
+    for (size_t i = 0; i < mCaches.size(); i++)
+    {
+        allocs += mCaches[i]->allocs;
+        hits   += mCaches[i]->hits;
+        frees  += mCaches[i]->frees;
+    }
+    MUTEX_UNLOCK(&mCacheLock);
+
+    stats.allocs   = allocs;
+    stats.hits     = hits;
+    stats.live     = (allocs > frees) ? (allocs - frees) : 0;
+    stats.reserved = mReserved;
+}
+
+void CLobjpool::output(std::string &info)
+{
+    Stats stats;
+    getStats(stats);
+
+    double hitRate = stats.allocs ?
+            (100.0 * stats.hits / stats.allocs) : 0.0;
+
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+            "%s pool allocs:%llu, hit rate:%.2f%%, live:%llu, reserved:%llu",
+            mName.c_str(), stats.allocs, hitRate, stats.live,
+            stats.reserved);
+
+    info = buf;
+}
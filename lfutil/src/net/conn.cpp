@@ -15,13 +15,19 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "lang/lstring.h"
 #include "trace/log.h"
 
 #include "time/datetime.h"
+#include "mm/lbufpool.h"
 
 #include "net/conn.h"
+#include "net/connmgr.h"
 #include "net/sockutil.h"
 #include "net/iovec.h"
 
@@ -52,6 +58,17 @@ int Conn::gListenSendBufSize = Sock::SOCK_SEND_BUF_SIZE;
 int Conn::gListenRcvBufSize = Sock::SOCK_RECV_BUF_SIZE;
 
 int Conn::gMaxBlockSize    = 64 * ONE_MILLION;
+int Conn::gReadAheadSize   = 64 * ONE_KILO;
+s64_t Conn::gRecvFileSync  = 0;
+bool Conn::gRecvFileSplice = true;
+
+// mRefState holds the reference count and the cleaning flag in one word,
+// so a reference can't be taken once cleanup has seen the count drop to 0
+#define CONN_REF_CLEANING      0x80000000U
+#define CONN_REF_COUNT_MASK    (CONN_REF_CLEANING - 1)
+
+#define CONN_RECV_FILE_CHUNK   (256 * ONE_KILO)
+#define CONN_RECV_PIPE_SIZE    ONE_MILLION
 int Conn::gTimeout = Sock::SOCK_TIMEOUT;
 
 Deserializable *Conn::gDeserializable = NULL;
@@ -63,17 +80,31 @@ Conn::Conn() :
         mSock(Sock::DISCONNECTED),
         mNextRecvPart(HEADER),
         mConnState(SUCCESS),
-        mCleaning(false),
         mCleanType(ON_CLEANUP),
-        mRefCount(0),
+        mRefState(0),
         mActivitySn(0),
+        mDrainSn(0),
+        mDrainTime(0),
         mCurSendBlock(NULL),
         mSendQ(),
         mReadyToSend(false),
+        mSendFileFd(-1),
+        mSendFileOffset(0),
+        mSendFileRemain(0),
+        mPendingBytes(0),
         mCurRecvBlock(NULL),
         mRecvQ(),
         mReadyRecv(false),
-        mRecvCb(NULL)
+        mRecvCb(NULL),
+        mRaBuf(NULL),
+        mRaPos(0),
+        mRaLen(0),
+        mRecvFileFd(-1),
+        mRecvPipeSize(0),
+        mRecvFileSplice(true),
+        mRecvFileUnsynced(0),
+        mRecvFileBuf(NULL),
+        mInflight(0)
 {
     LOG_TRACE("enter");
 
@@ -81,11 +112,12 @@ Conn::Conn() :
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
 
-    MUTEX_INIT(&mMutex, &attr);
     MUTEX_INIT(&mSendMutex, &attr);
     MUTEX_INIT(&mRecvMutex, &attr);
     MUTEX_INIT(&mEventMapMutex, &attr);
 
+    mRecvPipe[0] = mRecvPipe[1] = -1;
+
     updateActSn();
 
     LOG_TRACE("exit");
@@ -97,9 +129,22 @@ Conn::~Conn()
 
     ASSERT((mCurSendBlock == 0), "mCurSendBlock is not 0");
     ASSERT((mCurRecvBlock == 0), "mCurRecvBlock is not 0");
-    ASSERT((mRefCount == 0), "connection mMsgCounter not 0");
+    ASSERT(((mRefState & CONN_REF_COUNT_MASK) == 0),
+            "connection mMsgCounter not 0");
+
+    if (mRaBuf)
+    {
+        delete[] mRaBuf;
+        mRaBuf = NULL;
+    }
+
+    closeRecvFile(false);
+    if (mRecvPipe[0] >= 0)
+    {
+        close(mRecvPipe[0]);
+        close(mRecvPipe[1]);
+    }
 
-    MUTEX_DESTROY(&mMutex);
     MUTEX_DESTROY(&mSendMutex);
     MUTEX_DESTROY(&mRecvMutex);
     MUTEX_DESTROY(&mEventMapMutex);
@@ -152,18 +197,13 @@ void Conn::setup(int sock)
 {
     LOG_TRACE( "enter");
 
-    int rv = MUTEX_LOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to own mutex");
-
+    // the connection isn't visible to other threads yet
     this->mSock = sock;
     Sock::setCloExec(sock);
     Sock::setNoDelay(sock);
     Sock::setBufSize(sock, gSocketSendBufSize, gSocketRcvBufSize);
     Sock::setNonBlocking(sock);
 
-    rv = MUTEX_UNLOCK(&mMutex);
-    ASSERT((rv == 0), "%s", "thread failed to release mutex");
-
     LOG_TRACE( "exit");
 }
 
@@ -205,26 +245,25 @@ void Conn::cleanupVec(IoVec *iov, cleanup_t how)
 int Conn::cleanup(cleanup_t how)
 {
     LOG_TRACE("enter");
-    int rv;
 
-    rv = MUTEX_LOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to own mutex");
+    // 1. Save cleanup type so we know how to cleanup the connection when
+    // refcnt reaches zero, the atomic below publishes it
+    mCleanType = how;
 
     // 2. Indicate intention to cleanup connection. This will also tell us
     // to stop sending and receiving from the conn socket
-    mCleaning = true;
+    u32_t old = __sync_fetch_and_or(&mRefState, CONN_REF_CLEANING);
+    if (old & CONN_REF_CLEANING)
+    {
+        LOG_WARN("Cleanup of %s:%d connection has already started",
+                mPeerEp.getHostName(), mPeerEp.getPort());
+        return CONN_ERR_BUSY;
+    }
 
     // 3. Check if anybody else is using conn. If yes, can't cleanup now
-    // Return false and let the conn mgr decide how to cleaup this conn
-    if (mRefCount > 0)
+    // The last release() completes the cleanup
+    if (old & CONN_REF_COUNT_MASK)
     {
-        // Save cleanup type so we know how to cleanup the connection when
-        // refcnt reaches zero
-        mCleanType = how;
-
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread failed to release mutex");
-
         LOG_INFO("Prepare to cleanup %s:%d connection, but not now",
                 mPeerEp.getHostName(), mPeerEp.getPort());
 
@@ -233,8 +272,15 @@ int Conn::cleanup(cleanup_t how)
         return CONN_ERR_BUSY;
     }
 
-    rv = MUTEX_UNLOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to release mutex");
+    LOG_TRACE("exit");
+
+    return finishCleanup(how);
+}
+
+int Conn::finishCleanup(cleanup_t how)
+{
+    LOG_TRACE("enter");
+    int rv;
 
     // Clenaup remaining mRecvQ iovecs and mCurRecvBlock
     rv = MUTEX_LOCK(&mRecvMutex);
@@ -261,6 +307,7 @@ int Conn::cleanup(cleanup_t how)
     }
     cleanupVec(mCurSendBlock, how);
     mCurSendBlock = 0;
+    closeSendFile();
 
     rv = MUTEX_UNLOCK(&mSendMutex);
     ASSERT((rv == 0), "thread failed to release mutex");
@@ -278,7 +325,8 @@ int Conn::cleanup(cleanup_t how)
     LOG_INFO("Successfully cleanup connection %s:%d, %p",
             mPeerEp.getHostName(), mPeerEp.getPort(), this);
 
-    delete this;
+    // lock free lookups may still hold a pointer to this connection
+    ConnMgr::retire(this);
 
     LOG_TRACE("exit");
 
@@ -296,24 +344,16 @@ void Conn::release()
 {
     LOG_TRACE("enter");
 
-    bool callCleanup = false;
+    u32_t state = __sync_sub_and_fetch(&mRefState, 1);
 
-    int rv = MUTEX_LOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to own mutex");
+    LOG_DEBUG("Release connection %s:%d, conf count:%u, %p",
+                mPeerEp.getHostName(), mPeerEp.getPort(),
+                state & CONN_REF_COUNT_MASK, this);
 
-    mRefCount--;
-
-    LOG_DEBUG("Release connection %s:%d, conf count:%d, %p",
-                mPeerEp.getHostName(), mPeerEp.getPort(), mRefCount, this);
-
-    if (mRefCount == 0 && mCleaning)
-        callCleanup = true;
-
-    rv = MUTEX_UNLOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to release mutex");
-
-    if (callCleanup)
-        cleanup(mCleanType);
+    // Only the thread dropping the last reference of a connection being
+    // cleaned up sees this, nobody can acquire it any more
+    if (state == CONN_REF_CLEANING)
+        finishCleanup(mCleanType);
 
     LOG_TRACE("exit");
 }
@@ -327,30 +367,33 @@ void Conn::release()
  */
 void Conn::acquire()
 {
-    LOG_TRACE( "%s", "enter");
-
-    int rv = MUTEX_LOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to own mutex");
-
-    mRefCount++;
+    __sync_add_and_fetch(&mRefState, 1);
+}
 
-    rv = MUTEX_UNLOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to release mutex");
+bool Conn::tryAcquire()
+{
+    u32_t state = mRefState;
+    while ((state & CONN_REF_CLEANING) == 0)
+    {
+        u32_t prev = __sync_val_compare_and_swap(&mRefState, state, state + 1);
+        if (prev == state)
+        {
+            return true;
+        }
+        state = prev;
+    }
 
-    LOG_TRACE( "%s", "exit");
+    return false;
 }
 
 bool Conn::isIdle()
 {
-    int rv = MUTEX_LOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to own mutex");
-
-    bool idle = (mRefCount == 0);
-
-    rv = MUTEX_UNLOCK(&mMutex);
-    ASSERT((rv == 0), "thread failed to release mutex");
+    return (mRefState & CONN_REF_COUNT_MASK) == 0;
+}
 
-    return idle;
+bool Conn::isCleaning()
+{
+    return (mRefState & CONN_REF_CLEANING) != 0;
 }
 
 Conn::status_t Conn::send(int numVecs, IoVec* msgVecs[])
@@ -385,6 +428,7 @@ Conn::status_t Conn::postSend(int numVecs, IoVec* msgVecs[])
     for (int i = 0; i < numVecs; i++)
     {
         mSendQ.push_back(msgVecs[i]);
+        mPendingBytes += msgVecs[i]->getSize();
     }
     if (rv == 0)
     {
@@ -399,6 +443,7 @@ Conn::status_t Conn::postSend(IoVec* msgVec)
 {
     int rv = MUTEX_LOCK(&mSendMutex);
     mSendQ.push_back(msgVec);
+    mPendingBytes += msgVec->getSize();
     if (rv == 0)
     {
         rv = MUTEX_UNLOCK(&mSendMutex);
@@ -449,11 +494,111 @@ Conn::status_t Conn::postRecv(IoVec* msgVec)
     return SUCCESS;
 }
 
+bool Conn::hasFileTail(IoVec *iov)
+{
+    if (iov->getCallback() != sendCallback)
+    {
+        return false;
+    }
+
+    cb_param_t *cbp = static_cast<cb_param_t *>(iov->getCallbackParam());
+
+    return (cbp != NULL && cbp->fileLen != 0);
+}
+
+void Conn::completeSendVec(IoVec::state_t state)
+{
+    IoVec* svec = mCurSendBlock;
+    // Clean up current vector, it's given to callback.
+    // mCurSendBlock should not be referenced in this context from now on
+    mCurSendBlock = 0;
+    mPendingBytes -= svec->getSize();
+    IoVec::callback_t cb = svec->getCallback();
+    if (cb)
+    {
+        (cb)(svec, svec->getCallbackParam(), state);
+    }
+
+    // the callback may have posted more vectors, they are behind the
+    // ones already queued
+    if (!mSendQ.empty())
+    {
+        mCurSendBlock = mSendQ.front();
+        mSendQ.pop_front();
+    }
+}
+
+void Conn::closeSendFile()
+{
+    if (mSendFileFd >= 0)
+    {
+        close(mSendFileFd);
+        mSendFileFd = -1;
+    }
+    mSendFileRemain = 0;
+}
+
+Conn::status_t Conn::sendFileProgress()
+{
+    cb_param_t *cbp =
+            static_cast<cb_param_t *>(mCurSendBlock->getCallbackParam());
+
+    if (mSendFileFd < 0)
+    {
+        mSendFileFd = open(cbp->filePath, O_RDONLY);
+        if (mSendFileFd < 0)
+        {
+            // the peer has been told about the file, the stream can't
+            // be resynchronized without it
+            LOG_ERROR("Failed to open %s, %d:%s",
+                    cbp->filePath, errno, strerror(errno));
+            return CONN_ERR_BROKEN;
+        }
+        mSendFileOffset = cbp->fileOffset;
+        mSendFileRemain = cbp->fileLen;
+    }
+
+    while (mSendFileRemain > 0)
+    {
+        size_t count = (mSendFileRemain > ONE_GIGA) ?
+                ONE_GIGA : (size_t)mSendFileRemain;
+
+        ssize_t ns = ::sendfile(mSock, mSendFileFd, &mSendFileOffset, count);
+        if (ns > 0)
+        {
+            mSendFileRemain -= ns;
+        }
+        else if (ns < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (ns < 0 && errno == EAGAIN)
+        {
+            LOG_DEBUG("Can't send any more of %s, %llu left",
+                    cbp->filePath, mSendFileRemain);
+            mReadyToSend = false;
+            return CONN_ERR_UNAVAIL;
+        }
+        else
+        {
+            // ns == 0 means the file is shorter than announced
+            LOG_ERROR("Failed to send %s, %llu left, %d:%s", cbp->filePath,
+                    mSendFileRemain, errno, strerror(errno));
+            closeSendFile();
+            return CONN_ERR_BROKEN;
+        }
+    }
+
+    closeSendFile();
+    return SUCCESS;
+}
+
 Conn::status_t Conn::sendvecProgress()
 {
-    int nw = 0;
-    status_t rc;
-    IoVec::state_t vs;
+    struct iovec   iovs[IOV_MAX];
+    struct msghdr  msg;
+    ssize_t        nw = 0;
+    status_t       rc = SUCCESS;
 
     if (!mCurSendBlock)
     {
@@ -464,158 +609,465 @@ Conn::status_t Conn::sendvecProgress()
         return CONN_ERR_UNAVAIL;
     }
 
-    while (!mCurSendBlock->done())
+    while (mCurSendBlock)
     {
-        int rv = MUTEX_LOCK(&mMutex);
-        ASSERT((rv == 0), "thread failed to own mutex");
-
         // Check if the connection is not in cleanup. If it is, we should
         // not attempt to send. After we have gotten the
         // notification in the RecvThread throuth the receive side epoll fd
         // we are getting SIGPIPE in a subsequent write to the same
         // socket and the process silently dies
-        bool toSend = !mCleaning;
+        if (isCleaning())
+        {
+            LOG_ERROR("conn is being cleaned up, stop sending");
+            rc = CONN_ERR_BROKEN;
+            break;
+        }
 
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread failed to release mutex");
+        if (mCurSendBlock->done() && hasFileTail(mCurSendBlock))
+        {
+            rc = sendFileProgress();
+            if (rc != SUCCESS)
+            {
+                break;
+            }
+            completeSendVec(IoVec::DONE);
+            continue;
+        }
 
-        if (toSend)
+        // Gather the active vector and the queued ones behind it
+        int    iovCnt   = 0;
+        size_t qIndex   = 0;
+        IoVec *vec      = mCurSendBlock;
+        while (true)
         {
-            nw = ::send(mSock, mCurSendBlock->curPtr(), mCurSendBlock->remain(),
-                    MSG_NOSIGNAL);
-//            LOG_DEBUG("::send by socket, %d", mSock);
+            if (vec->remain())
+            {
+                iovs[iovCnt].iov_base = vec->curPtr();
+                iovs[iovCnt].iov_len  = vec->remain();
+                iovCnt++;
+            }
+
+            if (iovCnt == IOV_MAX || hasFileTail(vec) ||
+                qIndex >= mSendQ.size())
+            {
+                break;
+            }
+            vec = mSendQ[qIndex++];
         }
-        else
+
+        if (iovCnt)
         {
-            LOG_ERROR("nw = 0;");
-            nw = 0;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov    = iovs;
+            msg.msg_iovlen = iovCnt;
+
+            nw = ::sendmsg(mSock, &msg, MSG_NOSIGNAL);
+            if (nw < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (nw < 0 && errno == EAGAIN)
+            {
+                LOG_DEBUG("Can't send any more but vector not done, "
+                        "sendQ size:%d", (int)mSendQ.size());
+                mReadyToSend = false; // Can't send any more but vector not done
+                rc = CONN_ERR_UNAVAIL;
+                break;
+            }
+            else if (nw < 0 && errno == EPIPE)
+            {
+                LOG_ERROR("broken socket");
+                rc = CONN_ERR_BROKEN;
+                break;
+            }
+            else if (nw <= 0)
+            {
+                // nw == 0 can only happen if the connection is broken and
+                // this is discovered by the receive thread.
+                LOG_ERROR("unexpected condition: %s", strerror(errno));
+                rc = CONN_ERR_BROKEN;
+                break;
+            }
         }
 
-        if (nw > 0)
-            mCurSendBlock->incXferred(nw); // Increment with the sent chunk size
-        else
-            break;
+        // Account the sent bytes vector by vector, complete finished ones.
+        // A short write leaves the active vector partially sent, the next
+        // sendmsg tells whether the socket is full.
+        size_t left = (iovCnt ? (size_t)nw : 0);
+        while (mCurSendBlock)
+        {
+            size_t remain = mCurSendBlock->remain();
+            if (remain > left)
+            {
+                mCurSendBlock->incXferred(left);
+                break;
+            }
+
+            mCurSendBlock->incXferred(remain);
+            left -= remain;
+            if (hasFileTail(mCurSendBlock))
+            {
+                // completed once its file is sent, in the next round
+                break;
+            }
+            completeSendVec(IoVec::DONE);
+
+            if (left == 0 && mCurSendBlock && mCurSendBlock->remain())
+            {
+                break;
+            }
+        }
     }
 
-    if (mCurSendBlock->done())
+    if (rc == CONN_ERR_BROKEN)
     {
-        vs = IoVec::DONE;
-        rc = SUCCESS;
+        LOG_ERROR("Failed to send data to %s@%d, rc %d:%s, conn_rc:%d",
+                mPeerEp.getHostName(), mPeerEp.getPort(), errno, strerror(errno), rc);
+
+        // complete the active vector, the remaining ones are completed
+        // when the connection is cleaned up
+        closeSendFile();
+        if (mCurSendBlock)
+        {
+            IoVec* svec = mCurSendBlock;
+            mCurSendBlock = 0;
+            IoVec::callback_t cb = svec->getCallback();
+            if (cb)
+            {
+                (cb)(svec, svec->getCallbackParam(), IoVec::ERROR);
+            }
+        }
     }
-    else if (nw < 0 && errno == EAGAIN)
+
+    return rc;
+}
+
+void Conn::setReadyToSend(bool readyToSend)
+{
+    LOG_DEBUG("Set ready to send as true");
+
+    // A sender finding the socket full clears the flag under the send
+    // mutex, unlocked the writable edge could be overwritten by it and
+    // nothing would send on the connection any more
+    int rv = MUTEX_LOCK(&mSendMutex);
+    ASSERT((rv == 0), "thread failed to own mutex");
+    mReadyToSend = readyToSend;
+    rv = MUTEX_UNLOCK(&mSendMutex);
+    ASSERT((rv == 0), "thread failed to release mutex");
+}
+
+Conn::status_t Conn::sendProgress()
+{
+    status_t rc = SUCCESS;
+
+    int rv = MUTEX_LOCK(&mSendMutex);
+    ASSERT((rv == 0), "thread failed to own mutex");
+
+    if (mCurSendBlock == 0 && mSendQ.size() > 0)
     {
-        LOG_DEBUG("Can't send any more but vector not done, sendQ size:%d",
-                (int)mSendQ.size());
-        mReadyToSend = false;         // Can't send any more but vector not done
-        rc = CONN_ERR_UNAVAIL;
+        mCurSendBlock = mSendQ.front();
+        mSendQ.pop_front();
     }
-    else if (nw < 0 && errno == EPIPE)
+
+    if (mReadyToSend)
     {
-        LOG_ERROR("broken socket");
-        vs = IoVec::ERROR;
-        rc = CONN_ERR_BROKEN;
+        rc = sendvecProgress();
+    }
+
+    rv = MUTEX_UNLOCK(&mSendMutex);
+    ASSERT((rv == 0), "thread failed to release mutex");
+
+    if (rc == CONN_ERR_BROKEN)
+    {
+        LOG_ERROR("connection is broken");
+        return rc;
     }
-    else if (nw == 0)
+
+    // We get here if:
+    // 1. There are no more send iovec's
+    // 2. The send socket is full, mCurSendBlock may be 0 or active
+    return SUCCESS;
+}
+
+static int writeFully(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
     {
-        // This can only happen if the connection is broken and this is
-        // discovered by the receive thread. We just need to cleanly release
-        // the current reference to the connection object, so that the
-        // cleanup initiated by the receive thread can complete OK
-        vs = IoVec::ERROR;
-        rc = CONN_ERR_BROKEN;
+        ssize_t nw = ::write(fd, buf, len);
+        if (nw < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nw <= 0)
+        {
+            return -1;
+        }
+        buf += nw;
+        len -= nw;
     }
-    else
+
+    return 0;
+}
+
+void Conn::closeRecvFile(bool complete)
+{
+    if (mRecvFileFd >= 0)
     {
-        LOG_ERROR("unexpected condition: %s", strerror(errno));
-        vs = IoVec::ERROR;
-        rc = CONN_ERR_BROKEN;
+        if (complete && gRecvFileSync != 0 && mRecvFileUnsynced > 0)
+        {
+            fdatasync(mRecvFileFd);
+        }
+        close(mRecvFileFd);
+        mRecvFileFd = -1;
     }
 
-    if (rc != SUCCESS && rc != CONN_ERR_UNAVAIL)
+    if (!complete && mRecvPipe[0] >= 0)
     {
-        LOG_ERROR("Failed to send data to %s@%d, rc %d:%s, conn_rc:%d",
-                mPeerEp.getHostName(), mPeerEp.getPort(), errno, strerror(errno), rc);
+        // bytes may be left in the pipe, don't let them leak into the
+        // next file
+        close(mRecvPipe[0]);
+        close(mRecvPipe[1]);
+        mRecvPipe[0] = mRecvPipe[1] = -1;
     }
 
-    // In all cases except when mCurSendBlock is not done and there is no error
-    // on the connection -> complete mCurSendBlock
-    if (rc != CONN_ERR_UNAVAIL)
+    if (mRecvFileBuf)
     {
-        IoVec* svec = mCurSendBlock;
-        // Clean up current vector, it's given to callback.
-        // mCurSendBlock should not be referenced in this context from now on
-        mCurSendBlock = 0;
-        IoVec::callback_t cb = svec->getCallback();
-        if (cb)
+        IoVec::freeBase(mRecvFileBuf, IoVec::POOL_ALLOC);
+        mRecvFileBuf = NULL;
+    }
+}
+
+ssize_t Conn::recvFileCopy(size_t want)
+{
+    if (mRecvFileBuf == NULL)
+    {
+        mRecvFileBuf = (char *)IoVec::allocBase(CONN_RECV_FILE_CHUNK);
+        if (mRecvFileBuf == NULL)
         {
-            (cb)(svec, svec->getCallbackParam(), vs);
+            errno = ENOMEM;
+            return -1;
         }
     }
 
-    return rc;
+    if (want > CONN_RECV_FILE_CHUNK)
+    {
+        want = CONN_RECV_FILE_CHUNK;
+    }
+
+    ssize_t nr = ::recv(mSock, mRecvFileBuf, want, 0);
+    if (nr > 0 && writeFully(mRecvFileFd, mRecvFileBuf, nr))
+    {
+        LOG_ERROR("Failed to write received file, %d:%s",
+                errno, strerror(errno));
+        return -1;
+    }
+
+    return nr;
 }
 
-void Conn::setReadyToSend(bool readyToSend)
+ssize_t Conn::recvFileSplice(size_t want)
 {
-    LOG_DEBUG("Set ready to send as true");
-    mReadyToSend = readyToSend;
+    if (mRecvPipe[0] < 0)
+    {
+        if (pipe(mRecvPipe))
+        {
+            LOG_WARN("Failed to create pipe, %d:%s, copy the file instead",
+                    errno, strerror(errno));
+            mRecvPipe[0] = mRecvPipe[1] = -1;
+            mRecvFileSplice = false;
+            return recvFileCopy(want);
+        }
+
+        mRecvPipeSize = 64 * ONE_KILO;
+#ifdef F_SETPIPE_SZ
+        int pipeSize = fcntl(mRecvPipe[1], F_SETPIPE_SZ, CONN_RECV_PIPE_SIZE);
+        if (pipeSize > 0)
+        {
+            mRecvPipeSize = pipeSize;
+        }
+#endif
+    }
+
+    if (want > mRecvPipeSize)
+    {
+        want = mRecvPipeSize;
+    }
+
+    ssize_t nr = splice(mSock, NULL, mRecvPipe[1], NULL, want,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (nr < 0 && (errno == EINVAL || errno == ENOSYS))
+    {
+        LOG_WARN("splice from socket unsupported, copy the file instead");
+        mRecvFileSplice = false;
+        return recvFileCopy(want);
+    }
+    if (nr <= 0)
+    {
+        return nr;
+    }
+
+    size_t left = nr;
+    while (left > 0)
+    {
+        ssize_t nw = splice(mRecvPipe[0], NULL, mRecvFileFd, NULL, left,
+                SPLICE_F_MOVE);
+        if (nw > 0)
+        {
+            left -= nw;
+            continue;
+        }
+        if (nw < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nw < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            // The file system can't be spliced to, drain the pipe by hand
+            LOG_WARN("splice to file unsupported, copy the file instead");
+            mRecvFileSplice = false;
+            if (mRecvFileBuf == NULL)
+            {
+                mRecvFileBuf = (char *)IoVec::allocBase(CONN_RECV_FILE_CHUNK);
+            }
+            while (mRecvFileBuf && left > 0)
+            {
+                size_t len = (left > CONN_RECV_FILE_CHUNK) ?
+                        CONN_RECV_FILE_CHUNK : left;
+                ssize_t np = ::read(mRecvPipe[0], mRecvFileBuf, len);
+                if (np < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (np <= 0 || writeFully(mRecvFileFd, mRecvFileBuf, np))
+                {
+                    break;
+                }
+                left -= np;
+            }
+            if (left == 0)
+            {
+                break;
+            }
+        }
+
+        LOG_ERROR("Failed to write received file, %d:%s",
+                errno, strerror(errno));
+        return -1;
+    }
+
+    return nr;
 }
 
-Conn::status_t Conn::sendProgress()
+ssize_t Conn::recvFileProgress(IoVec *rvec)
 {
-    status_t rc;
-    bool sendqEmpty = false;
+    ssize_t nr = 1;
 
-    do
+    if (mRecvFileFd < 0)
     {
-        int rv = MUTEX_LOCK(&mSendMutex);
-        ASSERT((rv == 0), "thread failed to own mutex");
-        if (mReadyToSend)
+        cb_param_t *cbp = static_cast<cb_param_t *>(rvec->getCallbackParam());
+
+        mRecvFileFd = recvOpenFile(cbp);
+        if (mRecvFileFd < 0)
         {
-            rc = sendvecProgress();
+            return -1;
         }
-        else
-            rc = CONN_ERR_UNAVAIL;
+        mRecvFileSplice   = gRecvFileSplice;
+        mRecvFileUnsynced = 0;
+    }
 
-        // if CONN_ERR_NOVEC returned, try to get one from the queue
+    // The head of the file may have come in with the message
+    if (mRaLen > 0)
+    {
+        size_t len = rvec->remain();
+        if (len > mRaLen)
+        {
+            len = mRaLen;
+        }
+        if (writeFully(mRecvFileFd, mRaBuf + mRaPos, len))
+        {
+            LOG_ERROR("Failed to write received file, %d:%s",
+                    errno, strerror(errno));
+            closeRecvFile(false);
+            return -1;
+        }
+        rvec->incXferred(len);
+        mRaPos += len;
+        mRaLen -= len;
+        mRecvFileUnsynced += len;
+    }
 
-        if (rc == CONN_ERR_BROKEN)
+    while (!rvec->done())
+    {
+        size_t want = rvec->remain();
+
+        nr = mRecvFileSplice ? recvFileSplice(want) : recvFileCopy(want);
+        if (nr < 0 && errno == EINTR)
         {
-            rv = MUTEX_UNLOCK(&mSendMutex);
-            ASSERT((rv == 0), "thread failed to release mutex");
-            LOG_ERROR("connection is broken");
-            return rc;
+            continue;
+        }
+        if (nr <= 0)
+        {
+            break;
         }
 
-        if (rc == CONN_ERR_UNAVAIL)
+        rvec->incXferred(nr);
+        mRecvFileUnsynced += nr;
+        if (gRecvFileSync > 0 && mRecvFileUnsynced >= (u64_t)gRecvFileSync)
         {
-            rv = MUTEX_UNLOCK(&mSendMutex);
-            ASSERT((rv == 0), "thread failed to release mutex");
-            break;  // Can't send any more, socket full, mCurSendBlock remains
+            fdatasync(mRecvFileFd);
+            mRecvFileUnsynced = 0;
         }
+    }
 
-        // Here if mCurSendBlock empty, possibly after completion of prev mCurSendBlock
-        if (mSendQ.size() > 0)
+    if (rvec->done())
+    {
+        closeRecvFile(true);
+        nr = 1;
+    }
+    else if (nr == 0 || errno != EAGAIN)
+    {
+        closeRecvFile(false);
+    }
+
+    return nr;
+}
+
+ssize_t Conn::readAhead(size_t want)
+{
+    ssize_t nr = 1;
+
+    if (mRaPos > 0)
+    {
+        if (mRaLen > 0)
         {
-            ASSERT((mCurSendBlock == 0), "mCurSendBlock is not 0");
-            mCurSendBlock = mSendQ.front();
-            mSendQ.pop_front();
+            memmove(mRaBuf, mRaBuf + mRaPos, mRaLen);
+        }
+        mRaPos = 0;
+    }
+
+    while (mRaLen < want)
+    {
+        nr = ::recv(mSock, mRaBuf + mRaLen, gReadAheadSize - mRaLen, 0);
+        if (nr > 0)
+        {
+            mRaLen += nr;
+        }
+        else if (nr < 0 && errno == EINTR)
+        {
+            continue;
         }
         else
-            sendqEmpty = true;
-        rv = MUTEX_UNLOCK(&mSendMutex);
-        ASSERT((rv == 0), "thread failed to release mutex");
-    } while (!sendqEmpty);
-    // We get here if:
-    // 1. There are no more send iovec's
-    // 2. The send socket is full, mCurSendBlock may be 0 or active
+        {
+            break;
+        }
+    }
 
-    return SUCCESS;
+    return nr;
 }
 
 Conn::status_t Conn::recvvecProgress()
 {
-    int nr = 0;
+    ssize_t nr = 1;
     status_t rc;
     IoVec::state_t vs;
 
@@ -629,29 +1081,91 @@ Conn::status_t Conn::recvvecProgress()
         return CONN_ERR_UNAVAIL;
     }
 
-    while (!mCurRecvBlock->done())
+    bool toRecv = !isCleaning();
+    bool toFile = (mNextRecvPart == ATTACHFILE);
+
+    if (mRaBuf == NULL && gReadAheadSize > 0)
     {
-        int rv = MUTEX_LOCK(&mMutex);
-        ASSERT((rv == 0), "thread failed to own mutex");
+        mRaBuf = new char[gReadAheadSize];
+    }
 
-        bool toRecv = !mCleaning;
+    IoVec *rvec = mCurRecvBlock;
+    size_t size = rvec->getSize();
 
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread failed to release mutex");
+    if (!toRecv)
+    {
+        nr = 0;
+    }
+    else if (toFile)
+    {
+        nr = recvFileProgress(rvec);
+    }
+    else if (rvec->getBase() == NULL)
+    {
+        // The buffer is allocated lazily. Lend it out of the read-ahead
+        // buffer when it fits, the callback consumes it before the
+        // read-ahead buffer is touched again.
+        if (mRaBuf && size <= (size_t)gReadAheadSize)
+        {
+            nr = readAhead(size);
+        }
 
-        if (toRecv)
-            nr = ::recv(mSock, mCurRecvBlock->curPtr(), mCurRecvBlock->remain(),
-                    0);
-        else
-            nr = 0;
+        if (mRaBuf && mRaLen >= size)
+        {
+            rvec->setBase(mRaBuf + mRaPos);
+            rvec->setAllocType(IoVec::USER_ALLOC);
+            rvec->setXferred(size);
+            mRaPos += size;
+            mRaLen -= size;
+        }
+        else if (mRaBuf == NULL || size > (size_t)gReadAheadSize)
+        {
+            rvec->setBase(IoVec::allocBase(size));
+            rvec->setAllocType(IoVec::POOL_ALLOC);
+            if (rvec->getBase() == NULL)
+            {
+                LOG_ERROR("No memory to receive %llu bytes", (u64_t)size);
+                nr = -1;
+                errno = ENOMEM;
+            }
+        }
+    }
 
-        if (nr > 0)
-            mCurRecvBlock->incXferred(nr); // Increment with the receive chunk size
+    while (toRecv && rvec->getBase() && !rvec->done())
+    {
+        if (mRaLen > 0)
+        {
+            size_t len = rvec->remain();
+            if (len > mRaLen)
+            {
+                len = mRaLen;
+            }
+            memcpy(rvec->curPtr(), mRaBuf + mRaPos, len);
+            rvec->incXferred(len);
+            mRaPos += len;
+            mRaLen -= len;
+            continue;
+        }
+
+        if (mRaBuf == NULL || rvec->remain() >= (size_t)gReadAheadSize)
+        {
+            // Large payload, read into its own buffer directly
+            nr = ::recv(mSock, rvec->curPtr(), rvec->remain(), 0);
+            if (nr > 0)
+                rvec->incXferred(nr); // Increment with the receive chunk size
+        }
         else
+        {
+            nr = readAhead(1);
+        }
+
+        if (nr < 0 && errno == EINTR)
+            continue;
+        if (nr <= 0)
             break;
     }
 
-    if (mCurRecvBlock->done())
+    if ((rvec->getBase() || toFile) && toRecv && rvec->done())
     {
         rc = SUCCESS;
         vs = IoVec::DONE;
@@ -684,7 +1198,6 @@ Conn::status_t Conn::recvvecProgress()
 
     if (rc != CONN_ERR_UNAVAIL)
     {
-        IoVec *rvec = mCurRecvBlock;
         // !! It is important to set mCurRecvBlock = 0 before the callback
         // clean up current vector, it's given to the callback
         mCurRecvBlock = 0;
@@ -796,75 +1309,40 @@ void Conn::setSock(int sock)
     //should never enter
     LOG_WARN("Change sock");
 
-    int rv = MUTEX_LOCK(&mMutex);
     mSock = sock;
-    if (rv == 0)
-    {
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread fail to  release mutex");
-    }
     return ;
 }
 
 bool Conn::connected()
 {
-    int rv = MUTEX_LOCK(&mMutex);
-    bool connflag = (mSock != Sock::DISCONNECTED);
-    if (rv == 0)
-    {
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread fail to  release mutex");
-    }
-    return connflag;
+    return (mSock != Sock::DISCONNECTED);
 }
 
+// The state words are single aligned words, a full barrier before the
+// store makes everything written before the transition visible to the
+// thread which reads the new state
+
 void Conn::setState(Conn::status_t state)
 {
-    int rv = MUTEX_LOCK(&mMutex);
+    __sync_synchronize();
     mConnState = state;
-    if (rv == 0)
-    {
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread fail to  release mutex");
-    }
 }
 
 Conn::status_t Conn::getState()
 {
-    int rv = MUTEX_LOCK(&mMutex);
-    Conn::status_t state = mConnState;
-    if (rv == 0)
-    {
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread fail to  release mutex");
-    }
-
-    return state;
+    return mConnState;
 }
 
 void Conn::setNextRecv(nextrecv_t nr)
 {
-    int rv = MUTEX_LOCK(&mMutex);
+    __sync_synchronize();
     mNextRecvPart = nr;
-    if (rv == 0)
-    {
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread fail to  release mutex");
-    }
     LOG_DEBUG("Connection next recv stage :%d", (int)nr);
 }
 
 Conn::nextrecv_t Conn::getNextRecv()
 {
-    int rv = MUTEX_LOCK(&mMutex);
-    nextrecv_t nr = mNextRecvPart;
-    if (rv == 0)
-    {
-        rv = MUTEX_UNLOCK(&mMutex);
-        ASSERT((rv == 0), "thread fail to  release mutex");
-    }
-
-    return nr;
+    return mNextRecvPart;
 }
 
 void Conn::messageOut()
@@ -944,6 +1422,36 @@ int Conn::getMaxBlockSize()
     return gMaxBlockSize;
 }
 
+void Conn::setReadAheadSize(int size)
+{
+    gReadAheadSize = size;
+}
+
+int Conn::getReadAheadSize()
+{
+    return gReadAheadSize;
+}
+
+void Conn::setRecvFileSync(s64_t sync)
+{
+    gRecvFileSync = sync;
+}
+
+s64_t Conn::getRecvFileSync()
+{
+    return gRecvFileSync;
+}
+
+void Conn::setRecvFileSplice(bool splice)
+{
+    gRecvFileSplice = splice;
+}
+
+bool Conn::getRecvFileSplice()
+{
+    return gRecvFileSplice;
+}
+
 void Conn::setSocketProperty(std::map<std::string, std::string> &section)
 {
     std::map<std::string, std::string>::iterator it;
@@ -1054,6 +1562,96 @@ void Conn::setSocketProperty(std::map<std::string, std::string> &section)
                 Conn::getMaxBlockSize());
     }
 
+    key = "recv_readahead_size";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        int recv_readahead_size = 65536;
+        CLstring::strToVal(it->second, recv_readahead_size);
+        if (recv_readahead_size < 0)
+        {
+            recv_readahead_size = 0;
+        }
+
+        Conn::setReadAheadSize(recv_readahead_size);
+    }
+    LOG_INFO("Setting receive read-ahead buffer size as %d",
+            Conn::getReadAheadSize());
+
+    key = "recv_file_sync";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        s64_t recv_file_sync = 0;
+        if (it->second == "end")
+        {
+            recv_file_sync = -1;
+        }
+        else if (it->second != "none")
+        {
+            CLstring::strToVal(it->second, recv_file_sync);
+            if (recv_file_sync < 0)
+            {
+                recv_file_sync = 0;
+            }
+        }
+
+        Conn::setRecvFileSync(recv_file_sync);
+    }
+    LOG_INFO("Setting received file sync as %lld", Conn::getRecvFileSync());
+
+    key = "recv_file_splice";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        Conn::setRecvFileSplice(it->second != "false");
+    }
+    LOG_INFO("Setting received file splice as %s",
+            Conn::getRecvFileSplice() ? "true" : "false");
+
+    CLbufpool *bufPool = theBufPool();
+
+    key = "buffer_pool_max_size";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        u64_t buffer_pool_max_size = 0;
+        CLstring::strToVal(it->second, buffer_pool_max_size);
+
+        bufPool->setMaxSize(buffer_pool_max_size);
+    }
+    LOG_INFO("Setting buffer pool max size as %llu", bufPool->getMaxSize());
+
+    key = "buffer_pool_thread_cache_size";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        u64_t buffer_pool_thread_cache_size = CLBUFPOOL_DEFAULT_TC_SIZE;
+        CLstring::strToVal(it->second, buffer_pool_thread_cache_size);
+
+        bufPool->setThreadCacheSize(buffer_pool_thread_cache_size);
+    }
+    LOG_INFO("Setting buffer pool thread cache size as %llu",
+            bufPool->getThreadCacheSize());
+
+    key = "buffer_pool_hugepage";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        bufPool->setHugePage(it->second == "true");
+    }
+    LOG_INFO("Setting buffer pool huge page as %s",
+            bufPool->getHugePage() ? "true" : "false");
+
+    key = "buffer_pool_numa_local";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        bufPool->setNumaLocal(it->second == "true");
+    }
+    LOG_INFO("Setting buffer pool NUMA local as %s",
+            bufPool->getNumaLocal() ? "true" : "false");
+
     return;
 }
 
@@ -1134,6 +1732,7 @@ void Conn::addEventEntry(u32_t msgId, CommEvent *event)
     int rv = MUTEX_LOCK(&mEventMapMutex);
 
     mSendEventMap.insert(std::pair<u32_t, CommEvent *>(msgId, event));
+    mInflight = mSendEventMap.size();
 
     if (rv == 0)
     {
@@ -1148,6 +1747,7 @@ void Conn::removeEventEntry(u32_t msgId)
     int rv = MUTEX_LOCK(&mEventMapMutex);
 
     mSendEventMap.erase(msgId);
+    mInflight = mSendEventMap.size();
 
     if (rv == 0)
     {
@@ -1166,6 +1766,7 @@ CommEvent* Conn::getAndRmEvent(u32_t msgId)
     {
         ret = it->second;
         mSendEventMap.erase(it);
+        mInflight = mSendEventMap.size();
     }
 
     if (rv == 0)
@@ -17,6 +17,9 @@
  *      Author: Longda Feng
  */
 
+#include <fcntl.h>
+#include <errno.h>
+
 #include "io/io.h"
 #include "time/datetime.h"
 #include "net/conn.h"
@@ -77,6 +80,7 @@ int Conn::connCallback(Conn::conn_t state)
             cev->completeEvent(CommEvent::CONN_FAILURE);
         }
         mSendEventMap.clear();
+        mInflight = 0;
         rv = MUTEX_UNLOCK(&mEventMapMutex);
         ASSERT((rv == 0), "thread failed to release mutex");
 
@@ -107,11 +111,7 @@ int Conn::recvErrCb(IoVec *iov, cb_param_t* cbp, IoVec::state_t state, bool free
     LOG_TRACE("enter");
     if (freeIov)
     {
-        if (iov->getAllocType() == IoVec::SYS_ALLOC)
-        {
-            delete (char *)iov->getBase();
-            iov->setBase(NULL);
-        }
+        iov->releaseBase();
 
         delete iov;
     }
@@ -171,16 +171,17 @@ IoVec** Conn::allocIoVecs(const size_t baseLen, IoVec *iov, int &blockNum)
     int i = 0;
     for (; i < blockCount - 1; i++)
     {
-        char *base = new char[gMaxBlockSize];
+        char *base = (char *)IoVec::allocBase(gMaxBlockSize);
         if (base == NULL)
         {
             success = false;
             break;
         }
-        iovs[i] = new IoVec(base, gMaxBlockSize, Conn::recvCallback, NULL);
+        iovs[i] = new IoVec(base, gMaxBlockSize, Conn::recvCallback, NULL,
+                IoVec::POOL_ALLOC);
         if (iovs[i] == NULL)
         {
-            delete base;
+            IoVec::freeBase(base, IoVec::POOL_ALLOC);
             success = false;
             break;
         }
@@ -193,7 +194,7 @@ IoVec** Conn::allocIoVecs(const size_t baseLen, IoVec *iov, int &blockNum)
     }
 
     // set  the last one
-    base = new char[baseLen % gMaxBlockSize];
+    base = (char *)IoVec::allocBase(baseLen % gMaxBlockSize);
     if (base == NULL)
     {
         goto cleanupIovs;
@@ -204,12 +205,14 @@ IoVec** Conn::allocIoVecs(const size_t baseLen, IoVec *iov, int &blockNum)
         iov->reset();
         iov->setBase(base);
         iov->setSize(baseLen);
+        iov->setAllocType(IoVec::POOL_ALLOC);
 
         // the last one maybe exist callback/cbp
     }
     else
     {
-        iov = new IoVec(base, baseLen % gMaxBlockSize, Conn::recvCallback, NULL);
+        iov = new IoVec(base, baseLen % gMaxBlockSize, Conn::recvCallback, NULL,
+                IoVec::POOL_ALLOC);
     }
 
 
@@ -229,9 +232,7 @@ cleanupIovs:
 
 int Conn::repostIoVecs(Conn* conn, IoVec* iov, const size_t baseLen)
 {
-    char *base = static_cast<char *>(iov->getBase());
-    if(base && iov->getAllocType() == IoVec::SYS_ALLOC)
-        delete [] base;
+    iov->releaseBase();
 
     int blockNum = 0;
     IoVec** iovs = allocIoVecs(baseLen, iov, blockNum);
@@ -248,21 +249,13 @@ int Conn::repostIoVecs(Conn* conn, IoVec* iov, const size_t baseLen)
 
 int Conn::repostIoVec(Conn* conn, IoVec* iov, size_t baseLen)
 {
-    char *base = static_cast<char *>(iov->getBase());
-    if(base && iov->getAllocType() == IoVec::SYS_ALLOC)
-        delete [] base;
-
-    // set  the last one
-    base = new char[baseLen];
-    if (base == NULL)
-    {
-        LOG_ERROR("Failed to alloc %llu memory ", (u64_t)baseLen);
-        return Conn::CONN_ERR_NOMEM;
-    }
+    iov->releaseBase();
 
+    // Leave the base empty, recvvecProgress lends it from the connection's
+    // read-ahead buffer or allocates it when the data arrives
     iov->reset();
-    iov->setBase(base);
     iov->setSize(baseLen);
+    iov->setAllocType(IoVec::POOL_ALLOC);
 
     conn->postRecv(iov);
 
@@ -279,12 +272,10 @@ int Conn::repostReusedIoVec(const size_t baseLen, IoVec *iov, cb_param_t* cbp)
         blockSize = baseLen;
     }
 
-    char *base = static_cast<char *>(iov->getBase());
-    if (base && iov->getAllocType() == IoVec::SYS_ALLOC)
-        delete[] base;
+    iov->releaseBase();
 
     // set  the last one
-    base = new char[blockSize];
+    char *base = (char *)IoVec::allocBase(blockSize);
     if (base == NULL)
     {
         LOG_ERROR("Failed to alloc %llu memory ", (u64_t)baseLen);
@@ -294,6 +285,7 @@ int Conn::repostReusedIoVec(const size_t baseLen, IoVec *iov, cb_param_t* cbp)
     iov->reset();
     iov->setBase(base);
     iov->setSize(blockSize);
+    iov->setAllocType(IoVec::POOL_ALLOC);
 
     cbp->conn->postRecv(iov);
 
@@ -345,8 +337,6 @@ int Conn::recvHeaderCb(IoVec *iov, cb_param_t* cbp, IoVec::state_t state)
         return Conn::CONN_ERR_MISMATCH;
     }
 
-    ASSERT((iov->getAllocType() == IoVec::SYS_ALLOC), "bad alloc");
-
     //set next stage
     conn->setNextRecv(Conn::MESSAGE);
 
@@ -442,7 +432,7 @@ void Conn::cleanMdAttach(MsgDesc &md)
 {
     for (int i = 0; i < (int)md.attachMems.size(); i++)
     {
-        delete (char *)md.attachMems[i]->base;
+        IoVec::freeBase(md.attachMems[i]->base, md.attachMems[i]->alloc);
         delete md.attachMems[i];
     }
     md.attachMems.clear();
@@ -454,7 +444,7 @@ int Conn::allocAttachIoVecs(MsgDesc &md, const size_t baseLen)
 
     for (int i = 0; i < blockCount - 1; i++)
     {
-        char *base = new char[gMaxBlockSize];
+        char *base = (char *)IoVec::allocBase(gMaxBlockSize);
         if (base == NULL)
         {
             LOG_ERROR("No memory for IoVec::vec_t->base %d", (gMaxBlockSize));
@@ -466,20 +456,21 @@ int Conn::allocAttachIoVecs(MsgDesc &md, const size_t baseLen)
         {
             LOG_ERROR("No memory for IoVec::vec_t");
 
-            delete base;
+            IoVec::freeBase(base, IoVec::POOL_ALLOC);
 
             cleanMdAttach(md);
             return Conn::CONN_ERR_NOMEM;
         }
         iov->base = base;
         iov->size =  gMaxBlockSize;
+        iov->alloc = IoVec::POOL_ALLOC;
 
         md.attachMems.push_back(iov);
     }
 
     // set  the last one
     int lastSize = baseLen - ((blockCount - 1) * gMaxBlockSize);
-    char *base = new char[lastSize];
+    char *base = (char *)IoVec::allocBase(lastSize);
     if (base == NULL)
     {
         LOG_ERROR("No memory for IoVec::vec_t->base %d", (baseLen % gMaxBlockSize));
@@ -492,13 +483,14 @@ int Conn::allocAttachIoVecs(MsgDesc &md, const size_t baseLen)
     if (iov == NULL)
     {
         LOG_ERROR("No memory for IoVec::vec_t");
-        delete base;
+        IoVec::freeBase(base, IoVec::POOL_ALLOC);
 
         cleanMdAttach(md);
         return Conn::CONN_ERR_NOMEM;
     }
     iov->base = base;
     iov->size = lastSize;
+    iov->alloc = IoVec::POOL_ALLOC;
 
     md.attachMems.push_back(iov);
 
@@ -507,29 +499,18 @@ int Conn::allocAttachIoVecs(MsgDesc &md, const size_t baseLen)
 
 int Conn::recvPrepareFileIov(cb_param_t* cbp, Conn *conn)
 {
-    u32_t blockSize = gMaxBlockSize;
-
     cbp->fileOffset = 0;
-    if (cbp->fileLen <= blockSize)
-    {
-        blockSize = cbp->fileLen;
-    }
 
-    char *base = new char[blockSize];
-    if (base == NULL)
-    {
-        LOG_ERROR("No memory for file download buffer %u", blockSize);
-
-        return Conn::CONN_ERR_NOMEM;
-    }
-
-    IoVec * iov = new IoVec(base, blockSize, recvCallback, cbp);
+    // The vector has no buffer, Conn::recvFileProgress moves the file
+    // data from the socket to disk directly
+    IoVec * iov = new IoVec(NULL, cbp->fileLen, recvCallback, cbp,
+            IoVec::USER_ALLOC);
     if (iov == NULL)
     {
         LOG_ERROR("No memory for iovec");
         return Conn::CONN_ERR_NOMEM;
     }
-    cbp->remainVecs = (cbp->fileLen + gMaxBlockSize - 1)/gMaxBlockSize;
+    cbp->remainVecs = 1;
 
     conn->setNextRecv(Conn::ATTACHFILE);
     conn->postRecv(iov);
@@ -714,10 +695,7 @@ void Conn::checkEventReady(bool eventReady, Conn *conn, IoVec *iov, cb_param_t *
     else
     {
         // free the iov
-        if (iov->getAllocType() == IoVec::SYS_ALLOC)
-        {
-            delete (char *)iov->getBase();
-        }
+        iov->releaseBase();
         delete iov;
     }
 
@@ -839,9 +817,16 @@ void Conn::eventDone(CommEvent *cev, Conn *conn)
 
         CompletionCallback* cb = new CompletionCallback(gCommStage, NULL);
 
+        // sending the response only queues it on the connection, so
+        // the stage completing the request may do it on its own thread
+        cb->setInline(true);
         cev->pushCallback(cb);
 
-        ((CommStage *)gCommStage)->getNextStage()->addEvent(cev);
+        if (((CommStage *)gCommStage)->getNextStage()->addEvent(cev) == false)
+        {
+            // the stage is overloaded, fail the request at once
+            cev->shed();
+        }
     }
     else
     {
@@ -957,58 +942,45 @@ void Conn::generateRcvFileName(std::string &fileName, CommEvent *cev)
     return ;
 }
 
-int Conn::recvFile(IoVec *iov, cb_param_t* cbp, Conn *conn)
+int Conn::recvOpenFile(cb_param_t* cbp)
 {
-    LOG_TRACE("enter");
-
-    u32_t blockCount = (cbp->fileLen + gMaxBlockSize - 1)/gMaxBlockSize;
-    if (cbp->remainVecs == blockCount)
-    {
-        // this is the first time to receive the file data
-
-        CommEvent *cev = cbp->cev;
-
-        std::string fileName;
-        generateRcvFileName(fileName, cev);
-
-        MsgDesc    *md = NULL;
-        if (cev->isServerGen())
-        {
-            md = &cev->getRequest();
-        }
-        else
-        {
-            md = &cev->getResponse();
-        }
+    CommEvent *cev = cbp->cev;
 
-        md->attachFilePath = fileName;
+    std::string fileName;
+    generateRcvFileName(fileName, cev);
 
-        int rc = writeToFile(fileName, (char *)iov->getBase(), (u32_t)iov->getSize(), "w+");
-        if (rc)
-        {
-            LOG_ERROR("Failed to write data to file");
-            return CONN_ERR_WRITEFILE;
-        }
-        strncpy(cbp->filePath, fileName.c_str(), sizeof(cbp->filePath) - 1);
+    MsgDesc    *md = NULL;
+    if (cev->isServerGen())
+    {
+        md = &cev->getRequest();
     }
     else
     {
-        std::string fileName = cbp->filePath;
-        int rc = writeToFile(fileName, (char *)iov->getBase(), (u32_t)iov->getSize(), "a");
-        if (rc)
-        {
-            LOG_ERROR("Failed to write data to file");
-            return CONN_ERR_WRITEFILE;
-        }
+        md = &cev->getResponse();
     }
 
-    cbp->remainVecs--;
+    md->attachFilePath = fileName;
+    strncpy(cbp->filePath, fileName.c_str(), sizeof(cbp->filePath) - 1);
 
-    if (cbp->remainVecs == 0)
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
     {
-        checkEventReady(true, conn, iov, cbp);
+        LOG_ERROR("Failed to open %s, %d:%s",
+                fileName.c_str(), errno, strerror(errno));
     }
 
+    return fd;
+}
+
+int Conn::recvFile(IoVec *iov, cb_param_t* cbp, Conn *conn)
+{
+    LOG_TRACE("enter");
+
+    // The whole file is on disk by now
+    cbp->remainVecs = 0;
+
+    checkEventReady(true, conn, iov, cbp);
+
     LOG_TRACE("exit");
     return SUCCESS;
 
@@ -1116,7 +1088,7 @@ int Conn::recvCallback(IoVec *iov, void *param, IoVec::state_t state)
             LOG_TRACE("exit");
             return Conn::CONN_ERR_MISMATCH;
         }
-        else if (dynamic_cast<Request *>(msg))
+        else if (msg->typeTag().isA(Request::classTag()))
         {
 #if CHECK_CONNCB_PERFORMANCE
             SedaStats       sedaStats(SedaStats::NET_LATENCY_CAT, SedaStats::RPC_MSG_REQ_STAT);
@@ -1132,7 +1104,7 @@ int Conn::recvCallback(IoVec *iov, void *param, IoVec::state_t state)
             return rc;
 
         }
-        else if (dynamic_cast<Response *>(msg))
+        else if (msg->typeTag().isA(Response::classTag()))
         {
 #if CHECK_CONNCB_PERFORMANCE
             SedaStats       sedaStats(SedaStats::NET_LATENCY_CAT, SedaStats::RPC_MSG_RSP_STAT);
@@ -1183,10 +1155,7 @@ int Conn::recvCallback(IoVec *iov, void *param, IoVec::state_t state)
         }
         else
         {
-            if (iov->getAllocType() == IoVec::SYS_ALLOC)
-            {
-                delete (char *)iov->getBase();
-            }
+            iov->releaseBase();
             delete iov;
 
             LOG_TRACE("exit");
@@ -1311,12 +1280,10 @@ int Conn::sendCallback(IoVec *iov, void *param, IoVec::state_t state)
 {
     LOG_TRACE("enter");
 
-    char *base = static_cast<char *>(iov->getBase());
     cb_param_t* cbp = static_cast<cb_param_t*>(param);
 
-    // Free the iovec base if it was system allocated
-    if (iov->getAllocType() == IoVec::SYS_ALLOC)
-        delete[] base;
+    // Free the iovec base unless it was user allocated
+    iov->releaseBase();
     delete iov;
 
     if (!cbp) // Nothing to do here
@@ -1326,19 +1293,8 @@ int Conn::sendCallback(IoVec *iov, void *param, IoVec::state_t state)
     }
 
 
-    //check whether send file
-    if (state == IoVec::DONE && cbp->fileLen != 0)
-    {
-        s64_t sendCount = 0;
-        Conn *conn = cbp->conn;
-        Sock::sendfile(conn->getSocket(), cbp->filePath,
-                cbp->fileOffset, cbp->fileLen, &sendCount);
-        if ( sendCount != (s64_t)cbp->fileLen)
-        {
-            LOG_ERROR("Failed to send ");
-            state = IoVec::ERROR;
-        }
-    }
+    // An attach file has been sent by Conn::sendFileProgress before the
+    // vector is completed with DONE
 
     CommEvent *cev = cbp->cev;
     if (cev->isServerGen())
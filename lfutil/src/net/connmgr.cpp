@@ -12,7 +12,9 @@
 #include <unistd.h>
 #include <iostream>
 #include <map>
+#include <vector>
 #include <errno.h>
+#include <string.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -34,19 +36,192 @@
  * the connection is removed from the map. Lookup methods for finding 
  * connection by sock file decriptors and end point specifiers are provided.
  *
- * ConnMgr methods for inserting, removing, and looking up connections
- * are not internally protcted by a mutex lock. The caller is responsible
- * for locking/unlocking the ConnMgr internal lock by invoking the
- * lock(), unlock(), and trylock() methods.
+ * ConnMgr methods for inserting, removing, and looking up connections by
+ * end point are not internally protcted by a mutex lock. The caller is
+ * responsible for locking/unlocking the ConnMgr internal lock by invoking
+ * the lock(), unlock(), and trylock() methods. Looking up a connection by
+ * socket is lock free.
  */
 
 // number of inactive connections removed each time run out of fd
 static size_t NUM_REMOVE_INACTIVE = 64;
 
+#define CONNMGR_MAX_SOCK    (CONNMGR_CHUNK_NUM * CONNMGR_CHUNK_SIZE)
+
+//! Read section state of one thread
+typedef struct _EpochSlot
+{
+    volatile u64_t      epoch;  //!< global epoch at entry, 0 when outside
+    int                 nest;   //!< nested readLock() calls
+    volatile int        inUse;  //!< owned by a live thread
+    struct _EpochSlot  *next;
+} EpochSlot;
+
+//! A cleaned up connection waiting for the readers to move on
+typedef struct _Retired
+{
+    u64_t  epoch;
+    Conn  *conn;
+} Retired;
+
+static EpochSlot * volatile gEpochSlots = NULL;
+static volatile u64_t       gEpoch = 1;
+static volatile u64_t       gRetiredCount = 0;
+static pthread_key_t        gEpochKey;
+static pthread_once_t       gEpochOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t      gRetireMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static std::vector<Retired>& theRetired()
+{
+    static std::vector<Retired> *retired = new std::vector<Retired>();
+
+    return *retired;
+}
+
+static void freeEpochSlot(void *arg)
+{
+    EpochSlot *slot = (EpochSlot *)arg;
+
+    // slots are never freed, a new thread reuses this one
+    slot->nest  = 0;
+    slot->epoch = 0;
+    __sync_synchronize();
+    slot->inUse = 0;
+}
+
+static void initEpochKey()
+{
+    pthread_key_create(&gEpochKey, freeEpochSlot);
+}
+
+static EpochSlot *getEpochSlot()
+{
+    pthread_once(&gEpochOnce, initEpochKey);
+
+    EpochSlot *slot = (EpochSlot *)pthread_getspecific(gEpochKey);
+    if (slot)
+    {
+        return slot;
+    }
+
+    for (slot = gEpochSlots; slot; slot = slot->next)
+    {
+        if (slot->inUse == 0 &&
+            __sync_bool_compare_and_swap(&slot->inUse, 0, 1))
+        {
+            break;
+        }
+    }
+
+    if (slot == NULL)
+    {
+        slot = new EpochSlot;
+        memset(slot, 0, sizeof(*slot));
+        slot->inUse = 1;
+        do
+        {
+            slot->next = gEpochSlots;
+        } while (__sync_bool_compare_and_swap(&gEpochSlots, slot->next,
+                slot) == false);
+    }
+
+    pthread_setspecific(gEpochKey, slot);
+
+    return slot;
+}
+
+void ConnMgr::readLock()
+{
+    EpochSlot *slot = getEpochSlot();
+
+    if (slot->nest++ == 0)
+    {
+        // publish the epoch before loading any connection pointer,
+        // pairs with the barrier in reclaim()
+        slot->epoch = gEpoch;
+        __sync_synchronize();
+    }
+}
+
+void ConnMgr::readUnlock()
+{
+    EpochSlot *slot = getEpochSlot();
+
+    ASSERT((slot->nest > 0), "read section isn't locked");
+
+    if (--slot->nest == 0)
+    {
+        __sync_synchronize();
+        slot->epoch = 0;
+    }
+}
+
+void ConnMgr::retire(Conn* conn)
+{
+    Retired retired;
+    retired.conn  = conn;
+    retired.epoch = __sync_fetch_and_add(&gEpoch, 1);
+
+    MUTEX_LOCK(&gRetireMutex);
+    theRetired().push_back(retired);
+    __sync_add_and_fetch(&gRetiredCount, 1);
+    MUTEX_UNLOCK(&gRetireMutex);
+
+    reclaim();
+}
+
+void ConnMgr::reclaim()
+{
+    if (gRetiredCount == 0)
+    {
+        return;
+    }
+
+    // readers entering after this point can't see the retired connections
+    __sync_synchronize();
+
+    u64_t minEpoch = (u64_t)-1;
+    for (EpochSlot *slot = gEpochSlots; slot; slot = slot->next)
+    {
+        u64_t epoch = slot->epoch;
+        if (epoch && epoch < minEpoch)
+        {
+            minEpoch = epoch;
+        }
+    }
+
+    std::vector<Conn *> freed;
+
+    MUTEX_LOCK(&gRetireMutex);
+    std::vector<Retired> &retired = theRetired();
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++)
+    {
+        if (retired[i].epoch < minEpoch)
+        {
+            freed.push_back(retired[i].conn);
+        }
+        else
+        {
+            retired[kept++] = retired[i];
+        }
+    }
+    retired.resize(kept);
+    gRetiredCount = kept;
+    MUTEX_UNLOCK(&gRetireMutex);
+
+    for (size_t i = 0; i < freed.size(); i++)
+    {
+        delete freed[i];
+    }
+}
+
 ConnMgr::ConnMgr() :
-        sockConnMap(), epSockMap(), connPool()
+        epSockMap(), connPool()
 {
     LOG_TRACE("enter");
+    memset((void *)mChunks, 0, sizeof(mChunks));
+
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
@@ -63,33 +238,82 @@ ConnMgr::~ConnMgr()
     MUTEX_LOCK(&mapMutex);
     epSockMap.clear();
 
-    std::map<int, Conn*>::iterator ci;
-    for (ci = sockConnMap.begin(); ci != sockConnMap.end(); ++ci)
+    for (int i = 0; i < CONNMGR_CHUNK_NUM; i++)
     {
-        Conn* conn = ci->second;
-        conn->cleanup(Conn::ON_CLEANUP);
+        ConnSlot *chunk = mChunks[i];
+        if (chunk == NULL)
+        {
+            continue;
+        }
+
+        for (int j = 0; j < CONNMGR_CHUNK_SIZE; j++)
+        {
+            Conn* conn = chunk[j];
+            if (conn)
+            {
+                chunk[j] = NULL;
+                conn->cleanup(Conn::ON_CLEANUP);
+            }
+        }
+
+        mChunks[i] = NULL;
+        delete[] chunk;
     }
-    sockConnMap.clear();
 
     MUTEX_UNLOCK(&mapMutex);
     pthread_mutex_destroy(&mapMutex);
 
+    reclaim();
+
     LOG_TRACE("exit");
 }
 
+ConnMgr::ConnSlot*
+ConnMgr::slotOf(int sock, bool alloc)
+{
+    if (sock < 0 || sock >= CONNMGR_MAX_SOCK)
+    {
+        return NULL;
+    }
+
+    int       index = sock >> CONNMGR_CHUNK_SHIFT;
+    ConnSlot *chunk = mChunks[index];
+    if (chunk == NULL)
+    {
+        if (alloc == false)
+        {
+            return NULL;
+        }
+
+        // writers hold mapMutex, readers may see the chunk right away
+        chunk = new ConnSlot[CONNMGR_CHUNK_SIZE];
+        memset((void *)chunk, 0, sizeof(ConnSlot) * CONNMGR_CHUNK_SIZE);
+        __sync_synchronize();
+        mChunks[index] = chunk;
+    }
+
+    return &chunk[sock & (CONNMGR_CHUNK_SIZE - 1)];
+}
+
 Conn*
 ConnMgr::find(const int& sock)
 {
     Conn *conn = 0;
-    std::map<int, Conn*>::iterator p = sockConnMap.find(sock);
-    if (p != sockConnMap.end())
+
+    readLock();
+    ConnSlot *slot = slotOf(sock, false);
+    if (slot)
     {
-        conn = p->second;
-        /**
-         * FIXME, why here increase the counter?
-         */
-        conn->acquire();
+        conn = *slot;
+        // the caller owns a reference, a connection being cleaned up
+        // is treated as already removed
+        if (conn && conn->tryAcquire() == false)
+        {
+            conn = 0;
+        }
     }
+    readUnlock();
+
     return conn;
 }
 
@@ -107,19 +331,170 @@ ConnMgr::find(EndPoint& ep)
     return find(socket);
 }
 
+Conn*
+ConnMgr::peek(int sock)
+{
+    ConnSlot *slot = slotOf(sock, false);
+
+    return slot ? *slot : NULL;
+}
+
+static bool isLessLoaded(Conn* conn, Conn* other)
+{
+    if (conn->isDraining() != other->isDraining())
+    {
+        return other->isDraining();
+    }
+
+    u32_t inflight      = conn->getInflight();
+    u32_t otherInflight = other->getInflight();
+    if (inflight != otherInflight)
+    {
+        return inflight < otherInflight;
+    }
+
+    return conn->getPendingBytes() < other->getPendingBytes();
+}
+
+Conn*
+ConnMgr::findLeastLoaded(EndPoint& ep, size_t& poolSize, u32_t& poolInflight)
+{
+    poolSize     = 0;
+    poolInflight = 0;
+
+    std::string keyStr;
+    ep.toHostPortStr(keyStr);
+    EpSockMap::iterator p = epSockMap.find(keyStr);
+    if (p == epSockMap.end())
+        return NULL;
+
+    // Only the chosen connection is acquired, the others are just read
+    readLock();
+    Conn *best = NULL;
+    std::set<int> &sockSet = p->second;
+    for (std::set<int>::iterator it = sockSet.begin(); it != sockSet.end();
+            ++it)
+    {
+        Conn *conn = peek(*it);
+        if (conn == NULL)
+            continue;
+
+        poolSize++;
+        poolInflight += conn->getInflight();
+        if (best == NULL || isLessLoaded(conn, best))
+            best = conn;
+    }
+
+    if (best && best->tryAcquire() == false)
+    {
+        best = NULL;
+    }
+    readUnlock();
+
+    return best;
+}
+
+Conn*
+ConnMgr::findDrained(EndPoint& ep, Conn* except, time_t now, time_t interval)
+{
+    std::string keyStr;
+    ep.toHostPortStr(keyStr);
+    EpSockMap::iterator p = epSockMap.find(keyStr);
+    if (p == epSockMap.end())
+        return NULL;
+
+    // Drain state is only touched under mapMutex, activity of the data
+    // threads is seen through the activity serial number
+    readLock();
+    Conn *draining = NULL;
+    Conn *candidate = NULL;
+    std::set<int> &sockSet = p->second;
+    for (std::set<int>::reverse_iterator it = sockSet.rbegin();
+            it != sockSet.rend(); ++it)
+    {
+        Conn *conn = peek(*it);
+        if (conn == NULL || conn == except)
+            continue;
+
+        if (conn->isDraining())
+        {
+            draining = conn;
+            break;
+        }
+        if (candidate == NULL)
+            candidate = conn;
+    }
+
+    Conn *drained = NULL;
+    if (draining == NULL)
+    {
+        if (candidate)
+            candidate->startDrain(now);
+    }
+    else if (draining->isDrainQuiet() == false ||
+             draining->getInflight() || draining->getPendingBytes())
+    {
+        // still in use, wait for a whole quiet interval again
+        draining->startDrain(now);
+    }
+    else if (now - draining->getDrainTime() >= interval &&
+             draining->isIdle() && draining->tryAcquire())
+    {
+        drained = draining;
+    }
+    readUnlock();
+
+    return drained;
+}
+
+bool ConnMgr::stopDrain(EndPoint& ep)
+{
+    std::string keyStr;
+    ep.toHostPortStr(keyStr);
+    EpSockMap::iterator p = epSockMap.find(keyStr);
+    if (p == epSockMap.end())
+        return false;
+
+    bool stopped = false;
+    readLock();
+    std::set<int> &sockSet = p->second;
+    for (std::set<int>::iterator it = sockSet.begin(); it != sockSet.end();
+            ++it)
+    {
+        Conn *conn = peek(*it);
+        if (conn && conn->isDraining())
+        {
+            conn->stopDrain();
+            stopped = true;
+        }
+    }
+    readUnlock();
+
+    return stopped;
+}
+
 ConnMgr::status_t ConnMgr::insert(EndPoint& ep, const int sock,
         Conn* conn)
 {
     LOG_TRACE( "%s", "enter");
 
+    ConnSlot *slot = slotOf(sock, true);
+    if (slot == NULL)
+    {
+        LOG_ERROR("socket %d is beyond the connection table", sock);
+        return ERR_NO_SLOT;
+    }
+
     // Make sure there is no old connection for the same socket
-    std::map<int, Conn*>::iterator c = sockConnMap.find(sock);
-    if (c != sockConnMap.end())
+    if (*slot)
     {
         LOG_ERROR( "%s", "connection already inserted");
         return ERR_AINSERTED;
     }
-    sockConnMap.insert(std::pair<int, Conn*>(sock, conn));
+
+    // the connection is fully set up before readers can find it
+    __sync_synchronize();
+    *slot = conn;
 
     // Make a string out of ep.host and ep.port
     std::string keyStr;
@@ -176,12 +551,14 @@ ConnMgr::status_t ConnMgr::remove(const int& sock)
 
     // This method is called only when there is an erroneous condition. 
     // Normal connection cleanup is done in ConnMgr's destructor
-    std::map<int, Conn*>::iterator ci = sockConnMap.find(sock);
-    if (ci != sockConnMap.end())
+    // Clear the slot first, the socket can only be reused once the
+    // connection has closed it
+    ConnSlot *slot = slotOf(sock, false);
+    Conn     *conn = slot ? *slot : NULL;
+    if (conn)
     {
-        Conn* conn = ci->second;
+        *slot = NULL;
         conn->cleanup(Conn::ON_ERROR);
-        sockConnMap.erase(ci);
     }
     else
         rc = ERR_NOT_FOUND;
@@ -196,27 +573,33 @@ size_t ConnMgr::removeInactive()
     // activity sn -- socket map
     std::map<u64_t, int> sortedMap;
 
-    std::map<int, Conn*>::iterator ci;
-    for (ci = sockConnMap.begin(); ci != sockConnMap.end(); ++ci)
+    for (int sock = 0; sock < CONNMGR_MAX_SOCK; sock++)
     {
+        if (mChunks[sock >> CONNMGR_CHUNK_SHIFT] == NULL)
+        {
+            sock |= CONNMGR_CHUNK_SIZE - 1;
+            continue;
+        }
+
+        Conn *conn = *slotOf(sock, false);
+
         // skip connections in use
-        if (!ci->second->isIdle())
+        if (conn == NULL || !conn->isIdle())
             continue;
 
         if (sortedMap.size() < NUM_REMOVE_INACTIVE)
         {
-            sortedMap.insert(std::make_pair(ci->second->getActSn(), ci->first));
+            sortedMap.insert(std::make_pair(conn->getActSn(), sock));
         }
         else
         {
             // have collected NUM_REMOVE_INACTIVE connections in map,
             // check if should replace one in map with this
             std::map<u64_t, int>::iterator last = --sortedMap.end();
-            if (ci->second->getActSn() < last->first)
+            if (conn->getActSn() < last->first)
             {
                 sortedMap.erase(last);
-                sortedMap.insert(
-                        std::make_pair(ci->second->getActSn(), ci->first));
+                sortedMap.insert(std::make_pair(conn->getActSn(), sock));
             }
         }
     }
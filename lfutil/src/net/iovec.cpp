@@ -10,6 +10,7 @@
 // __CR__
 
 #include "net/iovec.h"
+#include "mm/lbufpool.h"
 
 //! Implementaion of IoVec
 /**
@@ -52,10 +53,9 @@ IoVec::~IoVec()
 
 void IoVec::cleanup()
 {
-    if (base && alloc == SYS_ALLOC)
+    if (alloc != USER_ALLOC)
     {
-        delete (char *)base;
-        base = 0;
+        releaseBase();
     }
 
     if (cbParam)
@@ -65,6 +65,35 @@ void IoVec::cleanup()
     }
 }
 
+void IoVec::releaseBase()
+{
+    freeBase(base, alloc);
+    base = 0;
+}
+
+void *
+IoVec::allocBase(size_t size)
+{
+    return theBufPool()->get(size);
+}
+
+void IoVec::freeBase(void *base, alloc_t alloc)
+{
+    if (base == NULL)
+    {
+        return;
+    }
+
+    if (alloc == SYS_ALLOC)
+    {
+        delete[] (char *)base;
+    }
+    else if (alloc == POOL_ALLOC)
+    {
+        theBufPool()->put(base);
+    }
+}
+
 void IoVec::setBase(void *base)
 {
     this->base = base;
@@ -140,7 +169,7 @@ size_t IoVec::getXferred()
 IoVec::vec_t IoVec::getVec()
 {
     vec_t vec =
-    { this->base, this->size };
+    { this->base, (int)this->size, this->alloc };
     return vec;
 }
 
@@ -19,8 +19,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/eventfd.h>
 
 #include "trace/log.h"
 #include "os/mutex.h"
@@ -44,9 +46,23 @@
  * 
  */
 
-#define INFORM_WITH_SIGNAL  0
 #define DEBUG_HANDLING_DATA 0
 
+#define DEFAULT_NET_SPIN_COUNT  2000
+#define DEFAULT_NET_THREAD_NUM  8
+#define DEFAULT_CONN_POOL_SIZE  1
+#define DEFAULT_CONN_POOL_LOAD  16
+#define CONN_POOL_SHRINK_DELAY  10      // seconds after the last growth
+
+static inline void cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
 typedef struct _DataThreadInputParam
 {
     Net             *netInstance;
@@ -54,6 +70,10 @@ typedef struct _DataThreadInputParam
 } DataThreadInputParam;
 
 Net::Net(Stage *commStage) :
+        mSpinCount(DEFAULT_NET_SPIN_COUNT),
+        mNetThreadCount(DEFAULT_NET_THREAD_NUM), mReactorMode(false),
+        mConnPoolSize(DEFAULT_CONN_POOL_SIZE),
+        mConnPoolLoad(DEFAULT_CONN_POOL_LOAD), mConnPoolGrowTime(0),
         initFlag(false), shutdownFlag(false), connMgr(), mCommStage(commStage)
 
 {
@@ -74,10 +94,81 @@ Net::~Net()
     LOG_TRACE("exit");
 }
 
+void Net::loadConfig()
+{
+    std::string key = "NetThreadCount";
+    std::string netThreadStr = theGlobalProperties()->get(key, "8", "Default");
+    CLstring::strToVal(netThreadStr, mNetThreadCount);
+    if (mNetThreadCount <= 0)
+    {
+        LOG_WARN("Invalid %s %d, use default %d", key.c_str(),
+                mNetThreadCount, DEFAULT_NET_THREAD_NUM);
+        mNetThreadCount = DEFAULT_NET_THREAD_NUM;
+    }
+
+    key = "NetSpinCount";
+    std::string spinStr = theGlobalProperties()->get(key, "", "Default");
+    if (spinStr.empty() == false)
+    {
+        CLstring::strToVal(spinStr, mSpinCount);
+    }
+
+    key = "NetReactorMode";
+    std::string reactorStr = theGlobalProperties()->get(key, "false", "Default");
+    mReactorMode = (reactorStr.compare("true") == 0);
+
+    key = "NetConnPoolSize";
+    std::string poolStr = theGlobalProperties()->get(key, "", "Default");
+    if (poolStr.empty() == false)
+    {
+        CLstring::strToVal(poolStr, mConnPoolSize);
+    }
+    if (mConnPoolSize == 0)
+    {
+        mConnPoolSize = DEFAULT_CONN_POOL_SIZE;
+    }
+
+    key = "NetConnPoolLoad";
+    std::string loadStr = theGlobalProperties()->get(key, "", "Default");
+    if (loadStr.empty() == false)
+    {
+        CLstring::strToVal(loadStr, mConnPoolLoad);
+    }
+    if (mConnPoolLoad == 0)
+    {
+        mConnPoolLoad = DEFAULT_CONN_POOL_LOAD;
+    }
+
+    // the epoll, data and reactor threads run on these CPUs
+    std::string cpuStr = theGlobalProperties()->get("NetCpus", "", "Default");
+    std::string nodeStr = theGlobalProperties()->get("NetNumaNode", "",
+            "Default");
+    if (mCpus.configure(cpuStr, nodeStr) == false)
+    {
+        LOG_WARN("Invalid NetCpus %s on NetNumaNode %s, net threads not "
+                "pinned", cpuStr.c_str(), nodeStr.c_str());
+        mCpus = CLcpuset();
+    }
+    else if (mCpus.empty() == false)
+    {
+        LOG_INFO("Net threads pinned to cpus %s", mCpus.toString().c_str());
+    }
+
+    LOG_INFO("Net mode:%s, thread count:%d, conn pool size:%u, load:%u",
+            mReactorMode ? "reactor" : "pipeline", mNetThreadCount,
+            mConnPoolSize, mConnPoolLoad);
+}
+
 int Net::setupSelectors()
 {
     int rc;
 
+    loadConfig();
+    if (mReactorMode)
+    {
+        return setupReactors();
+    }
+
     // Create notification pipe for receiver thread
     rc = pipe(recvPfd);
     if (rc < 0)
@@ -116,6 +207,24 @@ int Net::setupSelectors()
     return 0;
 }
 
+int Net::createThread(pthread_t *tid, void *(*func)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    int rc = mCpus.apply(&attr);
+    if (rc)
+    {
+        LOG_WARN("Failed to pin net thread to cpus %s, %d:%s",
+                mCpus.toString().c_str(), rc, strerror(rc));
+    }
+
+    rc = pthread_create(tid, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+
+    return rc;
+}
+
 int Net::startDataThread(int threadIndex, bool isSend)
 {
     DataThreadParam *dataTParam = new DataThreadParam();
@@ -138,7 +247,7 @@ int Net::startDataThread(int threadIndex, bool isSend)
     if (isSend)
     {
         sendDataThreads.push_back(dataTParam);
-        int rc = pthread_create(&dataTParam->tid, NULL, SendThread, threadParam);
+        int rc = createThread(&dataTParam->tid, SendThread, threadParam);
         if (rc)
         {
             LOG_ERROR("Failed to create send data thread, %d:%s",
@@ -156,14 +265,14 @@ int Net::startDataThread(int threadIndex, bool isSend)
     else
     {
         recvDataThreads.push_back(dataTParam);
-        int rc = pthread_create(&dataTParam->tid, NULL, RecvThread, threadParam);
+        int rc = createThread(&dataTParam->tid, RecvThread, threadParam);
         if (rc)
         {
             LOG_ERROR("Failed to create recv data thread, %d:%s",
                     rc, strerror(rc));
             delete threadParam;
             delete dataTParam;
-            sendDataThreads.pop_back();
+            recvDataThreads.pop_back();
             return rc;
         }
 
@@ -177,25 +286,26 @@ int Net::startDataThread(int threadIndex, bool isSend)
 int Net::startThreads()
 {
     int rc;
-    rc = pthread_create(&recvThreadId, NULL, RecvEPollThread, this);
+
+    if (mReactorMode)
+    {
+        return startReactors();
+    }
+
+    rc = createThread(&recvThreadId, RecvEPollThread, this);
     if (rc != 0)
     {
         LOG_ERROR("create recv epoll thread failed, %d:%s", rc, strerror(rc));
         return rc;
     }
-    rc = pthread_create(&sendThreadId, NULL, SendEPollThread, this);
+    rc = createThread(&sendThreadId, SendEPollThread, this);
     if (rc != 0)
     {
         LOG_ERROR("create send thread epoll failed, %d:%s", rc, strerror(rc));
         return rc;
     }
 
-    std::string key = "NetThreadCount";
-    std::string netThreadStr = theGlobalProperties()->get(key, "8", "Default");
-    int         netThreadCount;
-    CLstring::strToVal(netThreadStr, netThreadCount);
-
-    for (int i = 0; i < netThreadCount; i++)
+    for (int i = 0; i < mNetThreadCount; i++)
     {
         rc = startDataThread(i, true);
         if (rc)
@@ -269,6 +379,19 @@ int Net::shutdown()
         return -EINVAL;
     }
 
+    if (mReactorMode)
+    {
+        cleanupReactors();
+
+        shutdownFlag = true;
+        initFlag = false;
+
+        MUTEX_UNLOCK(&netMutex);
+
+        LOG_INFO("Successfully shutdown net");
+        return 0;
+    }
+
     cleanupThreads();
 
     char thInfo[THREAD_INFO_LEN] =
@@ -305,24 +428,14 @@ void Net::cleanupThreads()
     {
         DataThreadParam *dataParam = sendDataThreads[i];
 
-        MUTEX_LOCK(&dataParam->mutex);
-        dataParam->sockQ.push_back(-1);
-#if INFORM_WITH_SIGNAL
-        COND_SIGNAL(&dataParam->cond);
-#endif
-        MUTEX_UNLOCK(&dataParam->mutex);
+        pushSock(dataParam, -1);
     }
 
     for(u32_t i = 0; i < recvDataThreads.size(); i++)
     {
         DataThreadParam *dataParam = recvDataThreads[i];
 
-        MUTEX_LOCK(&dataParam->mutex);
-        dataParam->sockQ.push_back(-1);
-#if INFORM_WITH_SIGNAL
-        COND_SIGNAL(&dataParam->cond);
-#endif
-        MUTEX_UNLOCK(&dataParam->mutex);
+        pushSock(dataParam, -1);
     }
 
     for(u32_t i = 0; i < sendDataThreads.size(); i++)
@@ -353,14 +466,7 @@ void Net::sendData(int sock)
 {
     LOG_TRACE("enter");
 
-    /**
-     * @@@ Testing code
-     */
-    //connMgr.lock();
-    MUTEX_LOCK(&connMgr.mapMutex);
     Conn* conn = connMgr.find(sock);
-    //connMgr.unlock();
-    MUTEX_UNLOCK(&connMgr.mapMutex);
     if (conn == NULL)
     {
         LOG_INFO("conn has been removed");
@@ -368,6 +474,15 @@ void Net::sendData(int sock)
         return;
     }
 
+    sendData(conn);
+
+    LOG_TRACE("exit");
+}
+
+void Net::sendData(Conn *conn)
+{
+    LOG_TRACE("enter");
+
     bool  exception = false;
     try{
         conn->sendProgress();
@@ -377,16 +492,17 @@ void Net::sendData(int sock)
         LOG_ERROR("Occur exception");
     }
 
-    //conn has already been acquire in Net::SendThread
-    conn->release();
-
     if (exception)
     {
+        // the reference keeps the socket from being reused meanwhile
         MUTEX_LOCK(&connMgr.mapMutex);
-        removeConn(sock);
+        removeConn(conn->getSocket());
         MUTEX_UNLOCK(&connMgr.mapMutex);
     }
 
+    //conn has already been acquired by the caller
+    conn->release();
+
     LOG_TRACE("exit");
     return;
 }
@@ -399,15 +515,23 @@ void Net::prepareSend(int sock, Conn *conn)
         conn->setReadyToSend(true);
     }
 
+    if (mReactorMode)
+    {
+        pushReactor(sock, true);
+        LOG_TRACE("Exit");
+        return;
+    }
+
+    if (sendDataThreads.empty())
+    {
+        LOG_WARN("Net has been shutdown, skip sending %d", sock);
+        return;
+    }
+
     int threadIndex = sock % sendDataThreads.size();
     DataThreadParam *dataParam = sendDataThreads[threadIndex];
 
-    MUTEX_LOCK(&dataParam->mutex);
-    dataParam->sockQ.push_back(sock);
-#if INFORM_WITH_SIGNAL
-    COND_SIGNAL(&dataParam->cond);
-#endif
-    MUTEX_UNLOCK(&dataParam->mutex);
+    pushSock(dataParam, sock);
 
     LOG_TRACE("Exit");
 }
@@ -419,7 +543,6 @@ Net::SendEPollThread(void *arg)
 
     int epfd = net->sendEpfd;
     int notifyFd = net->sendPfd[0];
-    ConnMgr* cm = &net->connMgr;
 
     int nfds, fd, i;
     bool exitCmd;
@@ -430,7 +553,9 @@ Net::SendEPollThread(void *arg)
 
     while (true)
     {
-        nfds = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+        // the Conn of an event stays valid until the batch is handled
+        ConnMgr::readLock();
+        nfds = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, EPOLL_QUIESCE_MS);
 
         exitCmd = false;
 
@@ -438,8 +563,7 @@ Net::SendEPollThread(void *arg)
         // always from event[0] allows for potential starvation.
         for (i = 0; i < nfds; i++)
         {
-            fd = events[i].data.fd;
-            if (fd == notifyFd)
+            if (events[i].data.ptr == NULL)
             {
                 char info[THREAD_INFO_LEN];
                 int nread;
@@ -454,34 +578,23 @@ Net::SendEPollThread(void *arg)
                 continue;
             }
 
-            /**
-             * @@@ testing code
-             */
-            //cm->lock();
-            MUTEX_LOCK(&cm->mapMutex);
-            Conn* conn = cm->find(fd);
-            if (conn == NULL)
-            {
-                LOG_INFO("conn has been removed");
-
-                net->delSendSelector(fd);
-                //cm->unlock();
-                MUTEX_UNLOCK(&cm->mapMutex);
-                continue;
-            }
+            Conn* conn = (Conn *)events[i].data.ptr;
 
             // Check for error events
             if (events[i].events & (EPOLLHUP | EPOLLERR))
             {
                 // Error on socket - remove the corresponding conn
-                LOG_ERROR("detected broken inet socket %s:%d - removing conn",
-                        conn->getPeerEp().getHostName(), conn->getPeerEp().getPort());
+                net->brokenConn(conn);
+                continue;
+            }
 
-                conn->release();
-                net->removeConn(fd);
-                MUTEX_UNLOCK(&cm->mapMutex);
+            if (conn->tryAcquire() == false)
+            {
+                // cleanup removes the socket from the selectors
+                LOG_INFO("conn has been removed");
                 continue;
             }
+            fd = conn->getSocket();
 
             // check connect result
             if (conn->getState() == Conn::CONN_CONNECTING)
@@ -494,10 +607,10 @@ Net::SendEPollThread(void *arg)
                 {
                     LOG_ERROR("detect connect error, removing conn, socket error:%d",
                             error);
-                    conn->release();
+                    MUTEX_LOCK(&net->connMgr.mapMutex);
                     net->removeConn(fd);
-                    //cm->unlock();
-                    MUTEX_UNLOCK(&cm->mapMutex);
+                    MUTEX_UNLOCK(&net->connMgr.mapMutex);
+                    conn->release();
                     continue;
                 }
 
@@ -508,10 +621,9 @@ Net::SendEPollThread(void *arg)
             net->prepareSend(fd, conn);
 
             conn->release();
-            //cm->unlock();
-            MUTEX_UNLOCK(&cm->mapMutex);
-
         }
+        ConnMgr::readUnlock();
+        ConnMgr::reclaim();
 
         // Check whether the thread has received exit notification
         if (exitCmd)
@@ -525,13 +637,25 @@ Net::SendEPollThread(void *arg)
     pthread_exit(0);
 }
 
+void Net::pushSock(DataThreadParam *dataParam, int sock)
+{
+    MUTEX_LOCK(&dataParam->mutex);
+    dataParam->sockQ.push_back(sock);
+    dataParam->pending = dataParam->sockQ.size();
+    if (dataParam->parked)
+    {
+        COND_SIGNAL(&dataParam->cond);
+    }
+    MUTEX_UNLOCK(&dataParam->mutex);
+}
+
 void Net::handlingData(int threadIndex, bool isSending)
 {
     DataThreadParam * dataTParam = NULL;
+    std::deque<int>   localQ;
 
 #if DEBUG_HANDLING_DATA
-    bool              hasHandled = false;
-    int               counter    = 0;
+    u32_t             parkCounter = 0;
 #endif
 
     if (isSending)
@@ -545,82 +669,36 @@ void Net::handlingData(int threadIndex, bool isSending)
         dataTParam = recvDataThreads[threadIndex];
     }
 
-#if INFORM_WITH_SIGNAL
-    MUTEX_LOCK(&dataTParam->mutex);
-
-    while(true)
+    while (true)
     {
-
-        COND_WAIT(&dataTParam->cond, &dataTParam->mutex);
-        if (dataTParam->sockQ.empty())
+        // Spin a little before parking, the next socket usually arrives
+        // within a few microseconds under load
+        for (u32_t spin = 0; spin < mSpinCount && dataTParam->pending == 0;
+                spin++)
         {
-            continue;
+            cpuRelax();
         }
 
-        while(dataTParam->sockQ.empty() == false)
+        MUTEX_LOCK(&dataTParam->mutex);
+        while (dataTParam->sockQ.empty())
         {
-            int sock = dataTParam->sockQ.front();
-            dataTParam->sockQ.pop_front();
-            MUTEX_UNLOCK(&dataTParam->mutex);
-
-            if (sock < 0)
-            {
-                LOG_INFO("%d thread receive quit signal", threadIndex);
-                return ;
-            }
-
-            int nextSock = dataTParam->sockQ.front();
-            while(dataTParam->sockQ.empty() == false && nextSock == sock)
-            {
-                dataTParam->sockQ.pop_front();
-                nextSock = dataTParam->sockQ.front();
-            }
-
-            if (isSending)
-            {
-                sendData(sock);
-            }
-            else
-            {
-                recvData(sock);
-            }
-            MUTEX_LOCK(&dataTParam->mutex);
-        }
-
-    }
-#else
-
-    while (true)
-    {
-        if (dataTParam->sockQ.empty())
-        {
-            usleep(100000);
+            dataTParam->parked = true;
+            COND_WAIT(&dataTParam->cond, &dataTParam->mutex);
+            dataTParam->parked = false;
 #if DEBUG_HANDLING_DATA
-            if (hasHandled)
-            {
-                counter++;
-                if (counter > 100)
-                {
-
-                    if (isSending)
-                    {
-                        LOG_INFO("Long time  %d no send data", counter);
-                    }
-                    else
-                    {
-                        LOG_INFO("Long time  %d no recv data", counter);
-                    }
-                    counter = 0;
-                }
-            }
+            parkCounter++;
 #endif
-            continue;
         }
 
-        while (dataTParam->sockQ.empty() == false)
+        // Drain the whole queue with one lock acquisition
+        localQ.swap(dataTParam->sockQ);
+        dataTParam->pending = 0;
+        MUTEX_UNLOCK(&dataTParam->mutex);
+
+        while (localQ.empty() == false)
         {
-            int sock = dataTParam->sockQ.front();
-            dataTParam->sockQ.pop_front();
+            int sock = localQ.front();
+            localQ.pop_front();
 
             if (sock < 0)
             {
@@ -628,15 +706,9 @@ void Net::handlingData(int threadIndex, bool isSending)
                 return ;
             }
 
-            int nextSock = 0;
-            while(dataTParam->sockQ.empty() == false )
+            while (localQ.empty() == false && localQ.front() == sock)
             {
-                nextSock = dataTParam->sockQ.front();
-                if (sock != nextSock)
-                {
-                    break;
-                }
-                dataTParam->sockQ.pop_front();
+                localQ.pop_front();
             }
 
             if (isSending)
@@ -650,22 +722,10 @@ void Net::handlingData(int threadIndex, bool isSending)
         }
 
 #if DEBUG_HANDLING_DATA
-        hasHandled = true;
-        counter    = 0;
-
-
-        if (isSending)
-        {
-            LOG_INFO("Finish one send loop");
-        }
-        else
-        {
-            LOG_INFO("Finish one recv loop");
-        }
+        LOG_INFO("Finish one %s loop, parked %u times",
+                isSending ? "send" : "recv", parkCounter);
 #endif
-
     }
-#endif
 
 }
 
@@ -689,17 +749,7 @@ void Net::recvData(int sock)
     LOG_TRACE("enter");
 
     // Read from socket
-    ConnMgr* cm = &getConnMgr();
-    Conn *conn = NULL;
-
-    /**
-     * @@@ testing code
-     */
-    //cm->lock();
-    MUTEX_LOCK(&cm->mapMutex);
-    conn = cm->find(sock);
-    MUTEX_UNLOCK(&cm->mapMutex);
-    //cm->unlock();
+    Conn *conn = connMgr.find(sock);
     if (NULL == conn)
     {
         LOG_ERROR("No connection with socket %d", sock);
@@ -707,6 +757,19 @@ void Net::recvData(int sock)
         return;
     }
 
+    recvData(conn);
+
+    LOG_TRACE("exit");
+}
+
+void Net::recvData(Conn *conn)
+{
+    LOG_TRACE("enter");
+
+    // conn has already been acquired by the caller, which keeps its
+    // socket from being closed and reused
+    int sock = conn->getSocket();
+
     Conn::status_t crc = Conn::CONN_ERR_UNAVAIL;
     try{
         crc = conn->recvProgress(true);
@@ -730,9 +793,18 @@ void Net::recvData(int sock)
 
         //here just add it to epoll
 
-        conn->release();
+        if (mReactorMode)
+        {
+            // the socket is already in the reactor's epoll set, let the
+            // reactor come back to it after the current batch
+            prepareRecv(sock);
+        }
+        else
+        {
+            addToRecvSelector(sock, conn);
+        }
 
-        addToRecvSelector(sock);
+        conn->release();
 
         LOG_TRACE("CONN_READY exit");
         return;
@@ -741,10 +813,10 @@ void Net::recvData(int sock)
     {
         LOG_WARN("removing broken conn");
 
-        conn->release();
-        MUTEX_LOCK(&cm->mapMutex);
+        MUTEX_LOCK(&connMgr.mapMutex);
         removeConn(sock);
-        MUTEX_UNLOCK(&cm->mapMutex);
+        MUTEX_UNLOCK(&connMgr.mapMutex);
+        conn->release();
 
 
         LOG_TRACE("exit");
@@ -780,15 +852,23 @@ void Net::prepareRecv(int sock)
 {
     LOG_TRACE("Enter");
 
+    if (mReactorMode)
+    {
+        pushReactor(sock, false);
+        LOG_TRACE("Exit");
+        return;
+    }
+
+    if (recvDataThreads.empty())
+    {
+        LOG_WARN("Net has been shutdown, skip recving %d", sock);
+        return;
+    }
+
     int threadIndex = sock % recvDataThreads.size();
     DataThreadParam *dataParam = recvDataThreads[threadIndex];
 
-    MUTEX_LOCK(&dataParam->mutex);
-    dataParam->sockQ.push_back(sock);
-#if INFORM_WITH_SIGNAL
-    COND_SIGNAL(&dataParam->cond);
-#endif
-    MUTEX_UNLOCK(&dataParam->mutex);
+    pushSock(dataParam, sock);
 
     LOG_TRACE("Exit");
 }
@@ -801,34 +881,28 @@ Net::RecvEPollThread(void *arg)
     int epfd = net->recvEpfd;
     int notifyFd = net->recvPfd[0];
 
-    ConnMgr* cm = &net->connMgr;
-
-    int listenSock = Sock::DISCONNECTED;
-
-    // The following parameters are of interest only to servers
-    if (NetServer *netsrv = dynamic_cast<NetServer*>(net))
-    {
-        listenSock = netsrv->getListenSock();
-    }
+    // the listen socket of a server carries the Net in its events
+    void *listenTag = net;
 
     int nfds, i;
-    Conn *conn;
     bool exitCmd;
 
     LOG_INFO("Start net receive epoll thread");
 
-    ASSERT((epfd && (notifyFd >= 0) && cm), "incorrect arguments");
+    ASSERT((epfd && (notifyFd >= 0)), "incorrect arguments");
 
     struct epoll_event* events = new struct epoll_event[MAX_EPOLL_EVENTS];
     while (true)
     {
-        nfds = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+        // the Conn of an event stays valid until the batch is handled
+        ConnMgr::readLock();
+        nfds = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, EPOLL_QUIESCE_MS);
         exitCmd = false;
 
         for (i = 0; i < nfds; i++)
         {
-            int fd = events[i].data.fd;
-            if (fd == notifyFd)
+            void *tag = events[i].data.ptr;
+            if (tag == NULL)
             {
                 char info[THREAD_INFO_LEN];
                 int nr;
@@ -842,12 +916,11 @@ Net::RecvEPollThread(void *arg)
                 continue;
             }
 
-            // Get Conn from ConnMgr
             if (events[i].events & (EPOLLHUP | EPOLLERR))
             {
                 LOG_INFO("RecvThread - poll hung up or poll error"
-                " event:%d, socket:%d", events[i].events, fd);
-                if (fd == listenSock)
+                " event:%d", events[i].events);
+                if (tag == listenTag)
                 {
                     // Check if fd with error is listenSock. If yes, need to
                     // re-establish listenSock
@@ -855,39 +928,26 @@ Net::RecvEPollThread(void *arg)
                 else
                 {
                     LOG_INFO("broken socket");
-                    /**
-                     * @@@ testing code
-                     */
-                    MUTEX_LOCK(&cm->mapMutex);
-                    //cm->lock();
-                    conn = cm->find(fd);
-                    //cm->unlock();
-
-                    if (conn)
-                    {
-                        LOG_INFO("conn found - removing");
-                        conn->release();
-                        net->removeConn(fd);
-                    }
-                    else
-                    {
-
-                        LOG_INFO("conn has already been removed");
-                        net->delRecvSelector(fd);
-                    }
-                    MUTEX_UNLOCK(&cm->mapMutex);
+                    net->brokenConn((Conn *)tag);
                 }
                 continue;
             }
 
-            if (fd == listenSock)
+            if (tag == listenTag)
             {
                 net->acceptConns();
                 continue;
             }
 
-            net->prepareRecv(fd);
+            // a connection being cleaned up has no socket any more
+            int fd = ((Conn *)tag)->getSocket();
+            if (fd != Sock::DISCONNECTED)
+            {
+                net->prepareRecv(fd);
+            }
         }
+        ConnMgr::readUnlock();
+        ConnMgr::reclaim();
 
         // Check whether the thread has received exit notification
         if (exitCmd)
@@ -904,11 +964,6 @@ Conn* Net::getConn(EndPoint& ep, bool serverSide, int sock)
 {
     LOG_TRACE("enter");
 
-    /**
-     * @@@ testing code
-     */
-    //connMgr.lock();
-    MUTEX_LOCK(&connMgr.mapMutex);
     Conn* conn = NULL;
 
     if (sock != -1)
@@ -917,106 +972,125 @@ Conn* Net::getConn(EndPoint& ep, bool serverSide, int sock)
     }
     else
     {
-        conn = connMgr.find(ep);
+        // The server side never opens connections, any one will do
+        MUTEX_LOCK(&connMgr.mapMutex);
+        conn = serverSide ? connMgr.find(ep) : pickConn(ep);
+        MUTEX_UNLOCK(&connMgr.mapMutex);
     }
 
     if (conn)
     {
         LOG_DEBUG("getConn - socket of conn:%d", conn->getSocket());
+
+        LOG_TRACE("exit");
+        return conn;
     }
 
-    if (!conn && !serverSide)
+    if (serverSide)
     {
-        LOG_INFO("make conn to: %s:%d", ep.getHostName(), ep.getPort());
-
-        conn = new Conn();
-        if (!conn)
-        {
-            //connMgr.unlock();
-            MUTEX_UNLOCK(&connMgr.mapMutex);
-            LOG_ERROR("Failed to new conn");
-            throw NetEx(NET_ERR_CONN_NOTFOUND, "Failed to new conn");
+        MUTEX_LOCK(&connMgr.mapMutex);
+        connMgr.list();
+        MUTEX_UNLOCK(&connMgr.mapMutex);
+        LOG_WARN("client at %s:%d has already closed the connection",
+                ep.getHostName(), ep.getPort());
 
-        }
 
-        int sock = Sock::DISCONNECTED; // initialize to disconnected state
-        Conn::status_t crc = conn->connect(ep, sock);
-        if (crc == Conn::CONN_ERR_CONNECT)
-        {
-            //connMgr.unlock();
-            MUTEX_UNLOCK(&connMgr.mapMutex);
-            conn->cleanup(Conn::ON_ERROR);
+        throw NetEx(NET_ERR_CONN_NOTFOUND, "conn already removed");
+    }
 
-            std::string hostPort;
-            ep.toHostPortStr(hostPort);
+    LOG_INFO("make conn to: %s:%d", ep.getHostName(), ep.getPort());
 
-            std::string msg = "can't connect to server: " + hostPort;
-            throw NetEx(NET_ERR_CONNECT, msg);
-        }
+    // Connect without mapMutex, lookups of other end points go on meanwhile
+    conn = new Conn();
+    if (!conn)
+    {
+        LOG_ERROR("Failed to new conn");
+        throw NetEx(NET_ERR_CONN_NOTFOUND, "Failed to new conn");
 
-        conn->setState(crc);
+    }
 
-        int connStatus = conn->connCallback(Conn::ON_CONNECT);
-        if (connStatus)
-        {
-            MUTEX_UNLOCK(&connMgr.mapMutex);
-            conn->cleanup(Conn::ON_ERROR);
-            //connMgr.unlock();
+    sock = Sock::DISCONNECTED; // initialize to disconnected state
+    Conn::status_t crc = conn->connect(ep, sock);
+    if (crc == Conn::CONN_ERR_CONNECT)
+    {
+        conn->cleanup(Conn::ON_ERROR);
 
-            std::string msg = "conn callback failed";
-            throw NetEx(NET_ERR_CONNECT, msg);
-        }
+        std::string hostPort;
+        ep.toHostPortStr(hostPort);
 
-        // Insert new connection in ConnMgr map. This has to be done before
-        // adding the socket to the send and receive selectors
-        connMgr.insert(ep, sock, conn);
-        conn->setPeerEp(ep);
+        std::string msg = "can't connect to server: " + hostPort;
+        throw NetEx(NET_ERR_CONNECT, msg);
+    }
 
+    conn->setState(crc);
 
-        // Add the socket to the send selector
-        // We are safe to add sock here even the connection is finished before.
-        // During adding, the status of the sock will be checked, if it is
-        // ready when being added, it will be put on a ready list.
-        // Next time when we call epoll_wait(), this socket will be returned
-        // even if we are using the edge-triggered mode.
-        Net::status_t rc = addToSendSelector(sock);
-        if (rc != SUCCESS)
-        {
-            //conn->cleanup will be done in connMgr.remove
-            removeConn(sock);
-            //connMgr.unlock();
-            MUTEX_UNLOCK(&connMgr.mapMutex);
+    int connStatus = conn->connCallback(Conn::ON_CONNECT);
+    if (connStatus)
+    {
+        conn->cleanup(Conn::ON_ERROR);
 
-            throw NetEx(NET_ERR_EPOLL, "cannot add socket to send selector");
-        }
+        std::string msg = "conn callback failed";
+        throw NetEx(NET_ERR_CONNECT, msg);
+    }
 
-        // Add the socket to the recv selector
-        rc = addToRecvSelector(sock);
-        if (rc != SUCCESS)
-        {
-            //conn->cleanup will be done in connMgr.remove
+    MUTEX_LOCK(&connMgr.mapMutex);
 
-            removeConn(sock);
-            MUTEX_UNLOCK(&connMgr.mapMutex);
-            //connMgr.unlock();
-            throw NetEx(NET_ERR_EPOLL, "cannot add socket to recv selector");
-        }
+    // Other threads may have filled the pool to the end point meanwhile
+    size_t poolSize = 0;
+    u32_t  poolInflight = 0;
+    Conn*  other = connMgr.findLeastLoaded(ep, poolSize, poolInflight);
+    if (other && poolSize >= mConnPoolSize)
+    {
+        MUTEX_UNLOCK(&connMgr.mapMutex);
+        conn->cleanup(Conn::ON_ERROR);
 
-        conn->acquire();
+        LOG_TRACE("exit");
+        return other;
     }
-    else if (!conn && serverSide)
+    if (other)
+    {
+        other->release();
+    }
+
+    // The reference returned to the caller also keeps the connection
+    // alive while it is added to the selectors
+    conn->acquire();
+    conn->setPeerEp(ep);
+
+    // Insert new connection in ConnMgr map. This has to be done before
+    // adding the socket to the send and receive selectors
+    if (connMgr.insert(ep, sock, conn) != ConnMgr::SUCCESS)
     {
-        connMgr.list();
-        //connMgr.unlock();
         MUTEX_UNLOCK(&connMgr.mapMutex);
-        LOG_WARN("client at %s:%d has already closed the connection",
-                ep.getHostName(), ep.getPort());
+        conn->release();
+        conn->cleanup(Conn::ON_ERROR);
 
+        throw NetEx(NET_ERR_CONNECT, "cannot insert conn to connMgr");
+    }
 
-        throw NetEx(NET_ERR_CONN_NOTFOUND, "conn already removed");
+    // Add the socket to the send selector
+    // We are safe to add sock here even the connection is finished before.
+    // During adding, the status of the sock will be checked, if it is
+    // ready when being added, it will be put on a ready list.
+    // Next time when we call epoll_wait(), this socket will be returned
+    // even if we are using the edge-triggered mode.
+    Net::status_t rc = addToSendSelector(sock, conn);
+    if (rc == SUCCESS)
+    {
+        // Add the socket to the recv selector
+        rc = addToRecvSelector(sock, conn);
+    }
+
+    if (rc != SUCCESS)
+    {
+        //conn->cleanup will be done in connMgr.remove
+        removeConn(sock);
+        MUTEX_UNLOCK(&connMgr.mapMutex);
+        conn->release();
+
+        throw NetEx(NET_ERR_EPOLL, "cannot add socket to selectors");
     }
 
-    //connMgr.unlock();
     MUTEX_UNLOCK(&connMgr.mapMutex);
 
     LOG_TRACE("exit");
@@ -1024,21 +1098,71 @@ Conn* Net::getConn(EndPoint& ep, bool serverSide, int sock)
     return conn;
 }
 
+Conn* Net::pickConn(EndPoint& ep)
+{
+    size_t poolSize = 0;
+    u32_t  poolInflight = 0;
+
+    Conn* conn = connMgr.findLeastLoaded(ep, poolSize, poolInflight);
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+
+    // Even the least loaded connection is busy, take back the one being
+    // drained or open one more
+    if (conn->getInflight() >= mConnPoolLoad && connMgr.stopDrain(ep))
+    {
+        LOG_INFO("stop shrinking conn pool to %s:%d, size:%u, in flight:%u",
+                ep.getHostName(), ep.getPort(), (u32_t)poolSize,
+                poolInflight);
+        mConnPoolGrowTime = time(NULL);
+    }
+    else if (poolSize < mConnPoolSize && conn->getInflight() >= mConnPoolLoad)
+    {
+        LOG_INFO("grow conn pool to %s:%d, size:%u, in flight:%u",
+                ep.getHostName(), ep.getPort(), (u32_t)poolSize + 1,
+                poolInflight);
+        mConnPoolGrowTime = time(NULL);
+        conn->release();
+        return NULL;
+    }
+
+    // Shrink when one connection less would still be at most half loaded,
+    // and not right after a growth, requests in flight come and go in
+    // bursts and the pool would flap. Data threads may be receiving on any
+    // connection, one is drained first and closed only after it has been
+    // quiet for as long again
+    time_t now = time(NULL);
+    if (poolSize > 1 &&
+        (u64_t)poolInflight * 2 < (u64_t)(poolSize - 1) * mConnPoolLoad &&
+        now - mConnPoolGrowTime >= CONN_POOL_SHRINK_DELAY)
+    {
+        Conn* drained = connMgr.findDrained(ep, conn, now,
+                CONN_POOL_SHRINK_DELAY);
+        if (drained)
+        {
+            LOG_INFO("shrink conn pool to %s:%d, size:%u, in flight:%u",
+                    ep.getHostName(), ep.getPort(), (u32_t)poolSize - 1,
+                    poolInflight);
+            removeConn(drained->getSocket());
+            drained->release();
+        }
+    }
+
+    return conn;
+}
+
 void Net::addConn(Conn* conn, EndPoint& ep, int sock)
 {
     LOG_TRACE("enter: adding conn to: %s:%d", ep.getHostName(), ep.getPort());
 
     // Conn is allocated by caller
-    /**
-     * @@@ testing code
-     */
-    //connMgr.lock();
     MUTEX_LOCK(&connMgr.mapMutex);
     Conn* tconn = connMgr.find(sock);
     if (tconn)
     {
         tconn->release();
-        //connMgr.unlock();
         MUTEX_UNLOCK(&connMgr.mapMutex);
 
         // Cleanup the connection before return
@@ -1052,31 +1176,45 @@ void Net::addConn(Conn* conn, EndPoint& ep, int sock)
     conn->setState(Conn::CONN_READY);
     conn->setPeerEp(ep);
 
+    // Hold the connection while it is added to the selectors, events on
+    // the receive selector may already remove it
+    conn->acquire();
+
     // Insert connection in ConnMgr map and add connection socket
     // to send and receive selectors. It is important to keep the order
     // of these operations: inserting the connection should precede addition
     // to the selectors.
-    connMgr.insert(ep, sock, conn);
-    status_t rc = addToRecvSelector(sock);
+    if (connMgr.insert(ep, sock, conn) != ConnMgr::SUCCESS)
+    {
+        MUTEX_UNLOCK(&connMgr.mapMutex);
+        conn->release();
+        conn->cleanup(Conn::ON_ERROR);
+
+        throw NetEx(NET_ERR_CONN_EXISTS, "Cannot insert conn to connMgr");
+    }
+
+    status_t rc = addToRecvSelector(sock, conn);
     if (rc != SUCCESS)
     {
 
         removeConn(sock);
         MUTEX_UNLOCK(&connMgr.mapMutex);
+        conn->release();
         throw NetEx(NET_ERR_EPOLL, "Cannot add socket to receive selector");
     }
-    rc = addToSendSelector(sock);
+    rc = addToSendSelector(sock, conn);
     if (rc != SUCCESS)
     {
 
         removeConn(sock);
-        //connMgr.unlock();
         MUTEX_UNLOCK(&connMgr.mapMutex);
+        conn->release();
         throw NetEx(NET_ERR_EPOLL, "Cannot add socket to send selector");
     }
-    //connMgr.unlock();
     MUTEX_UNLOCK(&connMgr.mapMutex);
 
+    conn->release();
+
     LOG_TRACE("exit");
 }
 
@@ -1095,9 +1233,9 @@ Net::status_t Net::delConn(EndPoint& ep)
         return NET_ERR_CONN_NOTFOUND;
     }
     // remove from ConnMgr and disconnect
-    conn->release();
     removeConn(conn->getSocket());
     MUTEX_UNLOCK(&connMgr.mapMutex);
+    conn->release();
 
     LOG_TRACE("exit");
 
@@ -1123,9 +1261,16 @@ bool Net::finalized()
     return flag;
 }
 
-Net::status_t Net::addToSendSelector(int sock)
+Net::status_t Net::addToSendSelector(int sock, Conn *conn)
 {
-    Sock::status_t rc = Sock::addToSelector(sock, Sock::DIR_OUT, sendEpfd);
+    if (mReactorMode)
+    {
+        // reactor registers both directions in addToRecvSelector
+        return SUCCESS;
+    }
+
+    Sock::status_t rc = Sock::addToSelector(sock, Sock::DIR_OUT, sendEpfd,
+            conn);
     if (rc != Sock::SUCCESS)
     {
         char errbuf[ERR_BUF_SIZE], *errptr;
@@ -1140,6 +1285,12 @@ Net::status_t Net::addToSendSelector(int sock)
 
 void Net::delSendSelector(int sock)
 {
+    if (mReactorMode)
+    {
+        delRecvSelector(sock);
+        return;
+    }
+
     Sock::status_t rc = Sock::rmFromSelector(sock, sendEpfd);
     if (rc != Sock::SUCCESS)
     {
@@ -1151,9 +1302,23 @@ void Net::delSendSelector(int sock)
     }
 }
 
-Net::status_t Net::addToRecvSelector(int sock)
+Net::status_t Net::addToRecvSelector(int sock, Conn *conn)
 {
-    Sock::status_t rc = Sock::addToSelector(sock, Sock::DIR_IN, recvEpfd);
+    Sock::status_t rc;
+    if (mReactorMode)
+    {
+        ReactorParam *reactor = getReactor(sock);
+        if (reactor == NULL)
+        {
+            LOG_ERROR("Net has been shutdown, can't add %d", sock);
+            return NET_ERR_EPOLL;
+        }
+        rc = Sock::addToSelector(sock, Sock::DIR_INOUT, reactor->epfd, conn);
+    }
+    else
+    {
+        rc = Sock::addToSelector(sock, Sock::DIR_IN, recvEpfd, conn);
+    }
     if (rc != Sock::SUCCESS)
     {
         char errbuf[ERR_BUF_SIZE], *errptr;
@@ -1168,7 +1333,17 @@ Net::status_t Net::addToRecvSelector(int sock)
 
 void Net::delRecvSelector(int sock)
 {
-    Sock::status_t rc = Sock::rmFromSelector(sock, recvEpfd);
+    int epfd = recvEpfd;
+    if (mReactorMode)
+    {
+        ReactorParam *reactor = getReactor(sock);
+        if (reactor == NULL)
+        {
+            return;
+        }
+        epfd = reactor->epfd;
+    }
+    Sock::status_t rc = Sock::rmFromSelector(sock, epfd);
     if (rc != Sock::SUCCESS)
     {
         LOG_ERROR("Failed to close %d recv epoll", sock);
@@ -1192,16 +1367,16 @@ void Net::acceptConns()
     return;
 }
 
+int Net::getListenSock() const
+{
+    return Sock::DISCONNECTED;
+}
+
 size_t Net::removeInactive()
 {
-    /**
-     * @@@ TESTING CODE
-     */
-    //connMgr.lock();
     MUTEX_LOCK(&connMgr.mapMutex);
     size_t ret = connMgr.removeInactive();
     MUTEX_UNLOCK(&connMgr.mapMutex);
-    //connMgr.unlock();
 
     return ret;
 }
@@ -1215,3 +1390,324 @@ Stage *Net::getCommStage()
 {
     return mCommStage;
 }
+
+int Net::getListenEpfd()
+{
+    if (mReactorMode)
+    {
+        // the first reactor accepts new connections, addConn then hands
+        // each socket to its owner reactor
+        return mReactors[0]->epfd;
+    }
+
+    return recvEpfd;
+}
+
+int Net::setupReactors()
+{
+    for (int i = 0; i < mNetThreadCount; i++)
+    {
+        ReactorParam *reactor = new ReactorParam();
+        if (reactor == NULL)
+        {
+            LOG_ERROR("Failed to new ReactorParam");
+            return -1;
+        }
+        mReactors.push_back(reactor);
+
+        reactor->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactor->evfd < 0)
+        {
+            LOG_ERROR("reactor %d eventfd failed, %d:%s",
+                    i, errno, strerror(errno));
+            return -1;
+        }
+
+        int rc = Sock::createSelector(reactor->evfd, reactor->epfd);
+        if (rc != Sock::SUCCESS)
+        {
+            LOG_ERROR("reactor %d selector creation failed", i);
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+int Net::startReactors()
+{
+    for (u32_t i = 0; i < mReactors.size(); i++)
+    {
+        DataThreadInputParam *threadParam = new DataThreadInputParam();
+        if (threadParam == NULL)
+        {
+            LOG_ERROR("Failed to new DataThreadInputParam");
+            return -1;
+        }
+        threadParam->netInstance = this;
+        threadParam->threadIndex = i;
+
+        int rc = createThread(&mReactors[i]->tid, ReactorThread,
+                threadParam);
+        if (rc)
+        {
+            LOG_ERROR("Failed to create reactor thread %u, %d:%s",
+                    i, rc, strerror(rc));
+            delete threadParam;
+            return rc;
+        }
+    }
+
+    LOG_INFO("Successfully start %u reactor threads", (u32_t)mReactors.size());
+    return 0;
+}
+
+void Net::cleanupReactors()
+{
+    u64_t one = 1;
+
+    for (u32_t i = 0; i < mReactors.size(); i++)
+    {
+        ReactorParam *reactor = mReactors[i];
+
+        MUTEX_LOCK(&reactor->mutex);
+        reactor->exitFlag = true;
+        MUTEX_UNLOCK(&reactor->mutex);
+
+        ssize_t s = write(reactor->evfd, &one, sizeof(one));
+        (void)s;
+    }
+
+    for (u32_t i = 0; i < mReactors.size(); i++)
+    {
+        ReactorParam *reactor = mReactors[i];
+
+        pthread_join(reactor->tid, NULL);
+
+        close(reactor->epfd);
+        close(reactor->evfd);
+        delete reactor;
+    }
+    mReactors.clear();
+}
+
+ReactorParam *Net::getReactor(int sock)
+{
+    if (mReactors.empty())
+    {
+        return NULL;
+    }
+
+    return mReactors[sock % mReactors.size()];
+}
+
+void Net::pushReactor(int sock, bool isSend)
+{
+    ReactorParam *reactor = getReactor(sock);
+    bool          notify  = false;
+
+    if (reactor == NULL)
+    {
+        LOG_WARN("Net has been shutdown, skip socket %d", sock);
+        return;
+    }
+
+    MUTEX_LOCK(&reactor->mutex);
+    if (isSend)
+    {
+        reactor->sendQ.push_back(sock);
+    }
+    else
+    {
+        reactor->recvQ.push_back(sock);
+    }
+
+    // the reactor drains its queues after every epoll batch, so it only
+    // needs a wakeup when it may be blocked in epoll_wait
+    if (reactor->notified == false &&
+        pthread_equal(reactor->tid, pthread_self()) == 0)
+    {
+        reactor->notified = true;
+        notify = true;
+    }
+    MUTEX_UNLOCK(&reactor->mutex);
+
+    if (notify)
+    {
+        u64_t one = 1;
+        ssize_t s = write(reactor->evfd, &one, sizeof(one));
+        (void)s;
+    }
+}
+
+void Net::brokenConn(Conn *conn)
+{
+    if (conn->tryAcquire() == false)
+    {
+        LOG_INFO("conn has already been removed");
+        return;
+    }
+
+    LOG_ERROR("detected broken inet socket %s:%d - removing conn",
+            conn->getPeerEp().getHostName(), conn->getPeerEp().getPort());
+
+    // the reference keeps the socket from being reused before the removal
+    MUTEX_LOCK(&connMgr.mapMutex);
+    removeConn(conn->getSocket());
+    MUTEX_UNLOCK(&connMgr.mapMutex);
+
+    conn->release();
+}
+
+void Net::reactorSendReady(Conn *conn)
+{
+    if (conn->tryAcquire() == false)
+    {
+        LOG_INFO("conn has been removed");
+        return;
+    }
+
+    // check connect result
+    if (conn->getState() == Conn::CONN_CONNECTING)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        int sock = conn->getSocket();
+
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error)
+        {
+            LOG_ERROR("detect connect error, removing conn, socket error:%d",
+                    error);
+            MUTEX_LOCK(&connMgr.mapMutex);
+            removeConn(sock);
+            MUTEX_UNLOCK(&connMgr.mapMutex);
+            conn->release();
+            return;
+        }
+
+        LOG_INFO("connecting is finished OK...");
+        conn->setState(Conn::CONN_READY);
+    }
+
+    conn->setReadyToSend(true);
+
+    sendData(conn);
+}
+
+void* Net::ReactorThread(void *arg)
+{
+    DataThreadInputParam *dataParam = static_cast<DataThreadInputParam *>(arg);
+
+    Net* net = dataParam->netInstance;
+    int  reactorIndex = dataParam->threadIndex;
+
+    delete dataParam;
+
+    net->reactorLoop(reactorIndex);
+
+    LOG_INFO("%d reactor exit", reactorIndex);
+    pthread_exit(0);
+}
+
+void Net::reactorLoop(int reactorIndex)
+{
+    ReactorParam *reactor = mReactors[reactorIndex];
+
+    // the listen socket of a server carries the Net in its events
+    void *listenTag = this;
+
+    std::deque<int> sendQ;
+    std::deque<int> recvQ;
+    bool            hasPending = false;
+    bool            exitCmd    = false;
+
+    LOG_INFO("Start net reactor %d", reactorIndex);
+
+    struct epoll_event* events = new struct epoll_event[MAX_EPOLL_EVENTS];
+    while (exitCmd == false)
+    {
+        // don't block when the previous round left sockets to be handled,
+        // the Conn of an event stays valid until the batch is handled
+        ConnMgr::readLock();
+        int nfds = epoll_wait(reactor->epfd, events, MAX_EPOLL_EVENTS,
+                hasPending ? 0 : EPOLL_QUIESCE_MS);
+
+        for (int i = 0; i < nfds; i++)
+        {
+            void *tag = events[i].data.ptr;
+            u32_t ev = events[i].events;
+
+            if (tag == NULL)
+            {
+                u64_t counter;
+                ssize_t s = read(reactor->evfd, &counter, sizeof(counter));
+                (void)s;
+                continue;
+            }
+
+            if (tag == listenTag)
+            {
+                acceptConns();
+                continue;
+            }
+
+            Conn *conn = (Conn *)tag;
+
+            if (ev & (EPOLLHUP | EPOLLERR))
+            {
+                brokenConn(conn);
+                continue;
+            }
+
+            if ((ev & EPOLLIN) && conn->tryAcquire())
+            {
+                recvData(conn);
+            }
+
+            if (ev & EPOLLOUT)
+            {
+                reactorSendReady(conn);
+            }
+        }
+        ConnMgr::readUnlock();
+
+        MUTEX_LOCK(&reactor->mutex);
+        sendQ.swap(reactor->sendQ);
+        recvQ.swap(reactor->recvQ);
+        reactor->notified = false;
+        exitCmd = reactor->exitFlag;
+        MUTEX_UNLOCK(&reactor->mutex);
+
+        while (recvQ.empty() == false)
+        {
+            int sock = recvQ.front();
+            recvQ.pop_front();
+            while (recvQ.empty() == false && recvQ.front() == sock)
+            {
+                recvQ.pop_front();
+            }
+            recvData(sock);
+        }
+
+        while (sendQ.empty() == false)
+        {
+            int sock = sendQ.front();
+            sendQ.pop_front();
+            while (sendQ.empty() == false && sendQ.front() == sock)
+            {
+                sendQ.pop_front();
+            }
+            sendData(sock);
+        }
+
+        // sockets pushed by this reactor itself didn't write evfd
+        MUTEX_LOCK(&reactor->mutex);
+        hasPending = !(reactor->sendQ.empty() && reactor->recvQ.empty());
+        MUTEX_UNLOCK(&reactor->mutex);
+
+        ConnMgr::reclaim();
+    }
+
+    delete[] events;
+}
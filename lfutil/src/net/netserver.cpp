@@ -110,7 +110,8 @@ int NetServer::setup()
 
     Sock::setNonBlocking(mListenSock);
 
-    rc = Sock::addToSelector(mListenSock, Sock::DIR_IN, recvEpfd);
+    rc = Sock::addToSelector(mListenSock, Sock::DIR_IN, getListenEpfd(),
+            static_cast<Net *>(this));
     if (rc != Sock::SUCCESS)
     {
         MUTEX_UNLOCK(&netMutex);
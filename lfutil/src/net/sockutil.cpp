@@ -292,7 +292,7 @@ Sock::createSelector(int notifyFd, int& epfd)
     // Using the default level triggering (EPOLLET is Edge Triggering
     memset(&ev, 0, sizeof(struct epoll_event));
     ev.events = EPOLLIN;
-    ev.data.fd = notifyFd;
+    ev.data.ptr = NULL;
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, notifyFd, &ev) < 0) {
 
         LOG_ERROR("Sock::createSelector:can't add notifyFd socket, rc:%d:%s\n",
@@ -304,7 +304,7 @@ Sock::createSelector(int notifyFd, int& epfd)
 }
 
 Sock::status_t
-Sock::addToSelector(int sock, dir_t dir, int epfd) 
+Sock::addToSelector(int sock, dir_t dir, int epfd, void *data)
 {
     struct epoll_event ev;
     
@@ -312,9 +312,11 @@ Sock::addToSelector(int sock, dir_t dir, int epfd)
     ev.events = EPOLLET;    // Edge triggering for async comm
     if(dir == DIR_IN)
         ev.events |= EPOLLIN;
-    else
+    else if(dir == DIR_OUT)
         ev.events |= EPOLLOUT;
-    ev.data.fd = sock;
+    else
+        ev.events |= EPOLLIN | EPOLLOUT;
+    ev.data.ptr = data;
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
         LOG_ERROR("Failed to add sock to epoll, rc :%d:%s", errno, strerror(errno));
         return ERR_EPOLL_ADD;
@@ -553,7 +555,7 @@ int Sock::sendfile(int sock, const char *filename, const unsigned long long offs
 
     while (remain > 0)
     {
-        u64_t sended = 0;
+        ssize_t sended = 0;
         if (remain > ONE_GIGA)
         {
             sended = ::sendfile(sock, fd, &sendOffset, ONE_GIGA);
@@ -562,7 +564,7 @@ int Sock::sendfile(int sock, const char *filename, const unsigned long long offs
         {
             sended = ::sendfile(sock, fd, &sendOffset, remain);
         }
-        if (sendCount <= 0)
+        if (sended <= 0)
         {
             result = errno != 0 ? errno : EIO;
             break;
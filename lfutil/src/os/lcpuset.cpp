@@ -0,0 +1,344 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+
+/*
+ * lcpuset.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: Longda Feng
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+
+#include "lang/lstring.h"
+#include "os/lcpuset.h"
+#include "trace/log.h"
+
+// libnuma isn't linked, the memory policy is set by the system call
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED      1
+#endif
+
+#define CLCPUSET_NODE_DIR   "/sys/devices/system/node"
+#define CLCPUSET_MAX_NODES  64      // nodes looked for in sysfs
+
+static pthread_once_t      sTopologyOnce = PTHREAD_ONCE_INIT;
+static int                 sNodeCount = 1;
+static std::vector<int>    sCpuNode;        // node of each CPU
+
+//! Parse a CPU list as found in sysfs, "0-3,8,10-11"
+static bool parseCpuList(const std::string &list, cpu_set_t &cpus)
+{
+    CPU_ZERO(&cpus);
+
+    std::vector<std::string> ranges;
+    CLstring::splitString(list, ",", ranges);
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        std::string range = ranges[i];
+        CLstring::strip(range);
+        if (range.empty())
+        {
+            continue;
+        }
+
+        char *end = NULL;
+        long first = strtol(range.c_str(), &end, 10);
+        long last = first;
+        if (end == range.c_str())
+        {
+            return false;
+        }
+        if (*end == '-')
+        {
+            const char *lastStr = end + 1;
+            last = strtol(lastStr, &end, 10);
+            if (end == lastStr)
+            {
+                return false;
+            }
+        }
+        if (*end != '\0' || first < 0 || last < first ||
+                last >= CPU_SETSIZE)
+        {
+            return false;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+
+    return true;
+}
+
+//! Read the CPUs of a NUMA node from sysfs
+static bool readNodeCpus(int node, cpu_set_t &cpus)
+{
+    char path[128];
+    snprintf(path, sizeof(path), CLCPUSET_NODE_DIR "/node%d/cpulist", node);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    char line[4096];
+    bool ok = (fgets(line, sizeof(line), file) != NULL);
+    fclose(file);
+
+    return ok && parseCpuList(line, cpus);
+}
+
+//! Map every CPU to its node once
+static void loadTopology()
+{
+    for (int node = 0; node < CLCPUSET_MAX_NODES; node++)
+    {
+        cpu_set_t cpus;
+        if (readNodeCpus(node, cpus) == false)
+        {
+            continue;
+        }
+
+        sNodeCount = node + 1;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &cpus) == 0)
+            {
+                continue;
+            }
+            if ((int)sCpuNode.size() <= cpu)
+            {
+                sCpuNode.resize(cpu + 1, 0);
+            }
+            sCpuNode[cpu] = node;
+        }
+    }
+}
+
+CLcpuset::CLcpuset()
+{
+    CPU_ZERO(&mCpus);
+}
+
+bool CLcpuset::configure(const std::string &cpus, const std::string &node)
+{
+    CPU_ZERO(&mCpus);
+
+    if (cpus.empty() == false && parse(cpus) == false)
+    {
+        return false;
+    }
+
+    if (node.empty() == false)
+    {
+        int nodeId = CLCPUSET_NO_NODE;
+        CLstring::strToVal(node, nodeId);
+        if (nodeId < 0 || setNode(nodeId) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool CLcpuset::parse(const std::string &list)
+{
+    cpu_set_t cpus;
+    if (parseCpuList(list, cpus) == false || CPU_COUNT(&cpus) == 0)
+    {
+        return false;
+    }
+
+    mCpus = cpus;
+    return true;
+}
+
+bool CLcpuset::setNode(int node)
+{
+    cpu_set_t nodeCpus;
+    if (node < 0 || readNodeCpus(node, nodeCpus) == false)
+    {
+        // a machine without NUMA has no node entries at all
+        if (node != 0 || access(CLCPUSET_NODE_DIR, F_OK) == 0)
+        {
+            return false;
+        }
+        CPU_ZERO(&nodeCpus);
+        for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF); cpu++)
+        {
+            CPU_SET(cpu, &nodeCpus);
+        }
+    }
+
+    if (empty() == false)
+    {
+        CPU_AND(&nodeCpus, &nodeCpus, &mCpus);
+    }
+    if (CPU_COUNT(&nodeCpus) == 0)
+    {
+        return false;
+    }
+
+    mCpus = nodeCpus;
+    return true;
+}
+
+bool CLcpuset::empty() const
+{
+    return CPU_COUNT(&mCpus) == 0;
+}
+
+int CLcpuset::count() const
+{
+    return CPU_COUNT(&mCpus);
+}
+
+int CLcpuset::getCpu(int index) const
+{
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &mCpus) && index-- == 0)
+        {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
+int CLcpuset::getNode() const
+{
+    int node = CLCPUSET_NO_NODE;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &mCpus) == 0)
+        {
+            continue;
+        }
+        int cpuNode = nodeOfCpu(cpu);
+        if (node != CLCPUSET_NO_NODE && node != cpuNode)
+        {
+            return CLCPUSET_NO_NODE;
+        }
+        node = cpuNode;
+    }
+
+    return node;
+}
+
+int CLcpuset::apply(pthread_attr_t *attr) const
+{
+    if (empty())
+    {
+        return 0;
+    }
+
+    return pthread_attr_setaffinity_np(attr, sizeof(mCpus), &mCpus);
+}
+
+int CLcpuset::apply() const
+{
+    if (empty())
+    {
+        return 0;
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(mCpus), &mCpus);
+}
+
+std::string CLcpuset::toString() const
+{
+    std::string list;
+    char range[32];
+
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE)
+    {
+        if (CPU_ISSET(cpu, &mCpus) == 0)
+        {
+            cpu++;
+            continue;
+        }
+
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &mCpus))
+        {
+            last++;
+        }
+
+        if (last == cpu)
+        {
+            snprintf(range, sizeof(range), "%s%d",
+                    list.empty() ? "" : ",", cpu);
+        }
+        else
+        {
+            snprintf(range, sizeof(range), "%s%d-%d",
+                    list.empty() ? "" : ",", cpu, last);
+        }
+        list += range;
+        cpu = last + 1;
+    }
+
+    return list;
+}
+
+int CLcpuset::nodeCount()
+{
+    pthread_once(&sTopologyOnce, loadTopology);
+    return sNodeCount;
+}
+
+int CLcpuset::nodeOfCpu(int cpu)
+{
+    pthread_once(&sTopologyOnce, loadTopology);
+    if (cpu < 0 || cpu >= (int)sCpuNode.size())
+    {
+        return 0;
+    }
+
+    return sCpuNode[cpu];
+}
+
+int CLcpuset::currentNode()
+{
+    return nodeOfCpu(sched_getcpu());
+}
+
+int CLcpuset::bindMemory(void *addr, size_t len, int node)
+{
+    if (node < 0 || node >= (int)(sizeof(unsigned long) * 8))
+    {
+        return EINVAL;
+    }
+
+    // the kernel reads one bit less than maxnode
+    unsigned long mask = 1UL << node;
+    unsigned long maxNode = sizeof(mask) * 8 + 1;
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, maxNode, 0) != 0)
+    {
+        return errno;
+    }
+
+    return 0;
+}
@@ -18,6 +18,7 @@
 #include "seda/callback.h"
 #include "seda/stageevent.h"
 #include "seda/stage.h"
+#include "seda/threadpool.h"
 
 
 extern bool& theEventHistoryFlag();
@@ -30,12 +31,16 @@ extern bool& theEventHistoryFlag();
  */
 
 
+CLOBJPOOL_DEFINE(CompletionCallback, "Callback")
+
+
 //! Constructor
 CompletionCallback::CompletionCallback(Stage* trgt, CallbackContext* ctx) :
     targetStage(trgt),
     context(ctx),
     nextCb(NULL),
-    evHistFlag(theEventHistoryFlag())
+    evHistFlag(theEventHistoryFlag()),
+    inlineFlag(false)
 { 
 }
 
@@ -89,7 +94,18 @@ CompletionCallback::eventDone(StageEvent* ev)
 void
 CompletionCallback::eventReschedule(StageEvent* ev)
 {
-    targetStage->addEvent(ev);
+    // callbacks are queued whatever the overload policy of the stage
+    bool queued = targetStage->addEvent(ev);
+    ASSERT(queued, "callback rejected by stage %s", targetStage->getName());
+}
+
+
+//! Run callback on the calling thread if allowed
+bool
+CompletionCallback::eventInline(StageEvent* ev)
+{
+    // on success the event has deleted this callback
+    return inlineFlag && Threadpool::runCallback(targetStage, ev);
 }
 
 void
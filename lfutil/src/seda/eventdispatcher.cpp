@@ -66,7 +66,9 @@ EventDispatcher::handleEvent(StageEvent* event)
     pthread_mutex_lock(&eventLock);
     stat = dispatchEvent(event, ctx, hash);
     if (stat == SEND_EVENT) {
-        nextStage->addEvent(event);
+        if (nextStage->addEvent(event) == false) {
+            event->shed();
+        }
     }
     else if (stat == STORE_EVENT) {
         StoredEvent se(event, ctx);
@@ -149,7 +151,9 @@ EventDispatcher::wakeupEvent(std::string hashkey)
                                       targetEv.second,
                                       hashkey);
         if (stat == SEND_EVENT) {
-            nextStage->addEvent(targetEv.first);
+            if (nextStage->addEvent(targetEv.first) == false) {
+                targetEv.first->shed();
+            }
             sent = true;
         }
         else if (stat == STORE_EVENT) {
@@ -0,0 +1,132 @@
+// __CR__
+// Copyright (c) 2008-2010 Longda Corporation
+// All Rights Reserved
+//
+// This software contains the intellectual property of Longda Corporation
+// or is licensed to Longda Corporation from third parties.  Use of this
+// software and the intellectual property contained therein is expressly
+// limited to the terms and conditions of the License Agreement under which
+// it is provided by or on behalf of Longda.
+// __CR__
+
+
+// Include Files
+#include <sched.h>
+
+#include "os/mutex.h"
+#include "seda/stageevent.h"
+#include "seda/eventqueue.h"
+
+
+/**
+ * @author Longda
+ * @date   10/17/26
+ *
+ * Implementation of EventQueue class.
+ */
+
+
+EventQueue::EventQueue() :
+    head(&stub),
+    qSize(0),
+    tail(&stub),
+    stub()
+{
+    MUTEX_INIT(&popMutex, NULL);
+}
+
+EventQueue::~EventQueue()
+{
+    MUTEX_DESTROY(&popMutex);
+}
+
+//! Append the links from first to last, already linked to each other
+void
+EventQueue::pushChain(EventQueueLink* first, EventQueueLink* last)
+{
+    last->qNext = NULL;
+
+    // the events have to be complete before the consumer can reach them
+    __sync_synchronize();
+    EventQueueLink* prev = __sync_lock_test_and_set(&head, last);
+
+    // until this store the consumer sees the queue end at prev
+    prev->qNext = first;
+}
+
+void
+EventQueue::push(StageEvent* event)
+{
+    // counted first, so the queue never looks empty to the pool thread
+    // which is scheduled for it
+    __sync_add_and_fetch(&qSize, 1);
+    pushLink(event);
+}
+
+void
+EventQueue::pushBatch(StageEvent** events, unsigned long count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    for (unsigned long i = 1; i < count; i++) {
+        events[i - 1]->qNext = events[i];
+    }
+
+    __sync_add_and_fetch(&qSize, count);
+    pushChain(events[0], events[count - 1]);
+}
+
+StageEvent*
+EventQueue::pop()
+{
+    MUTEX_LOCK(&popMutex);
+
+    while (true) {
+        EventQueueLink* first = tail;
+        EventQueueLink* next  = first->qNext;
+
+        if (first == &stub) {
+            if (next == NULL) {
+                if (head == &stub) {
+                    // really empty
+                    MUTEX_UNLOCK(&popMutex);
+                    return NULL;
+                }
+
+                // a producer has swapped the head but not linked it yet
+                sched_yield();
+                continue;
+            }
+
+            // skip the stub
+            tail  = next;
+            first = next;
+            next  = next->qNext;
+        }
+
+        if (next == NULL) {
+            if (first != head) {
+                // a producer is between the exchange and the link
+                sched_yield();
+                continue;
+            }
+
+            // first is the only event, queue the stub behind it so that
+            // first can be unlinked
+            pushLink(&stub);
+            next = first->qNext;
+            if (next == NULL) {
+                // another producer has come in between
+                continue;
+            }
+        }
+
+        tail = next;
+        MUTEX_UNLOCK(&popMutex);
+
+        __sync_sub_and_fetch(&qSize, 1);
+        return static_cast<StageEvent*>(first);
+    }
+}
@@ -0,0 +1,300 @@
+// __CR__
+// Copyright (c) 2008-2010 Longda Corporation
+// All Rights Reserved
+//
+// This software contains the intellectual property of Longda Corporation
+// or is licensed to Longda Corporation from third parties.  Use of this
+// software and the intellectual property contained therein is expressly
+// limited to the terms and conditions of the License Agreement under which
+// it is provided by or on behalf of Longda.
+// __CR__
+
+
+// Include Files
+#include <time.h>
+
+#include "trace/log.h"
+#include "os/mutex.h"
+#include "seda/stage.h"
+#include "seda/threadpool.h"
+#include "seda/poolcontroller.h"
+
+/**
+ * @author Longda
+ * @date   10/18/26
+ *
+ * Implementation of PoolController class.
+ */
+
+
+static u64_t
+monotonicUsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+PoolController::PoolController() :
+    pools(),
+    interval(POOLCONTROLLER_INTERVAL),
+    growSamples(POOLCONTROLLER_GROW_SAMPLES),
+    shrinkSamples(POOLCONTROLLER_SHRINK_SAMPLES),
+    gain(POOLCONTROLLER_GAIN),
+    running(false),
+    stopping(false)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    MUTEX_INIT(&mutex, NULL);
+    COND_INIT(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+
+PoolController::~PoolController()
+{
+    stop();
+    MUTEX_DESTROY(&mutex);
+    COND_DESTROY(&cond);
+}
+
+
+void
+PoolController::addPool(Threadpool* pool, unsigned int minThreads,
+                        unsigned int maxThreads, unsigned int growQueue)
+{
+    PoolState ps;
+    ps.pool        = pool;
+    ps.minThreads  = minThreads;
+    ps.maxThreads  = maxThreads;
+    ps.growQueue   = growQueue;
+    ps.ceiling     = 0;
+    ps.hot         = 0;
+    ps.cold        = 0;
+    ps.fewestIdle  = 0;
+    ps.lastHandled = 0;
+    ps.hotEvents   = 0;
+    ps.hotUsec     = 0;
+    ps.grownRate   = 0;
+    pools.push_back(ps);
+}
+
+
+void
+PoolController::addStage(Stage* stage)
+{
+    for (size_t i = 0; i < pools.size(); i++) {
+        if (pools[i].pool == stage->getPool()) {
+            pools[i].stages.push_back(stage);
+            return;
+        }
+    }
+}
+
+
+void
+PoolController::setSampling(u32_t msec, u32_t grow, u32_t shrink,
+                            u32_t percent)
+{
+    interval      = msec ? msec : 1;
+    growSamples   = grow ? grow : 1;
+    shrinkSamples = shrink ? shrink : 1;
+    gain          = percent;
+}
+
+
+bool
+PoolController::start()
+{
+    for (size_t i = 0; i < pools.size(); i++) {
+        pools[i].lastHandled = pools[i].pool->eventsHandled();
+    }
+
+    stopping = false;
+    if (pthread_create(&thread, NULL, runController, this) != 0) {
+        LOG_ERROR("Failed to create the thread pool controller");
+        return false;
+    }
+    running = true;
+
+    LOG_INFO("Thread pool controller samples %u pools every %u msec",
+             (unsigned int)pools.size(), interval);
+    return true;
+}
+
+
+void
+PoolController::stop()
+{
+    if (running == false) {
+        return;
+    }
+
+    MUTEX_LOCK(&mutex);
+    stopping = true;
+    COND_SIGNAL(&cond);
+    MUTEX_UNLOCK(&mutex);
+
+    pthread_join(thread, NULL);
+    running = false;
+}
+
+
+//! Control loop of the controller thread
+void*
+PoolController::runController(void* arg)
+{
+    PoolController* self = (PoolController*) arg;
+
+    u64_t last = monotonicUsec();
+    u64_t next = last + (u64_t)self->interval * 1000;
+
+    MUTEX_LOCK(&self->mutex);
+    while (self->stopping == false) {
+        struct timespec ts;
+        ts.tv_sec  = next / 1000000;
+        ts.tv_nsec = (next % 1000000) * 1000;
+        int rc = 0;
+        COND_WAIT_TIMEOUT(&self->cond, &self->mutex, &ts, rc);
+        (void) rc;
+        if (self->stopping) {
+            break;
+        }
+
+        u64_t now = monotonicUsec();
+        if (now < next) {
+            continue;
+        }
+
+        // resizing may wait for kill events, stop() waits for it
+        MUTEX_UNLOCK(&self->mutex);
+        for (size_t i = 0; i < self->pools.size(); i++) {
+            self->adjust(self->pools[i], now - last);
+        }
+        MUTEX_LOCK(&self->mutex);
+
+        last = now;
+        next = monotonicUsec() + (u64_t)self->interval * 1000;
+    }
+    MUTEX_UNLOCK(&self->mutex);
+
+    return NULL;
+}
+
+
+//! Sample a pool and resize it if due
+void
+PoolController::adjust(PoolState& ps, u64_t elapsed)
+{
+    Threadpool* pool = ps.pool;
+
+    unsigned int  threads = pool->numThreads();
+    unsigned int  idle    = pool->numIdle();
+    unsigned long handled = pool->eventsHandled();
+    unsigned long events  = handled - ps.lastHandled;
+    ps.lastHandled = handled;
+
+    unsigned long backlog = 0;
+    for (size_t i = 0; i < ps.stages.size(); i++) {
+        backlog += ps.stages[i]->qlen();
+    }
+
+    if (idle == 0 && backlog > (unsigned long)ps.growQueue * threads) {
+        // every thread is busy and events pile up
+        ps.cold = 0;
+        ps.hot++;
+        ps.hotEvents += events;
+        ps.hotUsec   += elapsed;
+        if (ps.hot >= growSamples) {
+            grow(ps, threads, backlog);
+        }
+    }
+    else if (idle > 0) {
+        // the pool keeps up, growth before was a past load's
+        ps.hot       = 0;
+        ps.hotEvents = 0;
+        ps.hotUsec   = 0;
+        ps.grownRate = 0;
+        if (ps.cold == 0 || idle < ps.fewestIdle) {
+            ps.fewestIdle = idle;
+        }
+        ps.cold++;
+        if (ps.cold >= shrinkSamples) {
+            shrink(ps, threads);
+        }
+    }
+    else {
+        // busy without a backlog, the size is right
+        ps.hot       = 0;
+        ps.cold      = 0;
+        ps.hotEvents = 0;
+        ps.hotUsec   = 0;
+    }
+}
+
+
+//! Add threads to a loaded pool, unless the last ones didn't help
+void
+PoolController::grow(PoolState& ps, unsigned int threads,
+                     unsigned long backlog)
+{
+    u64_t rate = ps.hotUsec ? ps.hotEvents * 1000000 / ps.hotUsec : 0;
+    ps.hot       = 0;
+    ps.hotEvents = 0;
+    ps.hotUsec   = 0;
+
+    unsigned int limit = ps.maxThreads;
+    if (ps.ceiling && ps.ceiling < limit) {
+        limit = ps.ceiling;
+    }
+    if (threads >= limit) {
+        return;
+    }
+
+    const char* name = ps.pool->getName().c_str();
+    if (ps.grownRate && rate * 100 < ps.grownRate * (100 + gain)) {
+        ps.ceiling = threads;
+        LOG_INFO("Thread pool %s handles %llu events/s with %u threads, "
+                 "%llu before growing, keeps its size", name,
+                 (unsigned long long)rate, threads,
+                 (unsigned long long)ps.grownRate);
+        return;
+    }
+
+    // a quarter more at a time, a load swing is followed in a few steps
+    unsigned int step = (threads + 3) / 4;
+    if (step > limit - threads) {
+        step = limit - threads;
+    }
+
+    unsigned int added = ps.pool->addThreads(step);
+    ps.grownRate = rate;
+    LOG_INFO("Thread pool %s grows from %u to %u threads, %lu events "
+             "queued, %llu events/s", name, threads,
+             threads + added, backlog, (unsigned long long)rate);
+}
+
+
+//! Kill half of the threads a pool has kept idle
+void
+PoolController::shrink(PoolState& ps, unsigned int threads)
+{
+    ps.cold    = 0;
+    ps.ceiling = 0;
+
+    unsigned int kill = (ps.fewestIdle + 1) / 2;
+    if (kill + ps.minThreads > threads) {
+        kill = (threads > ps.minThreads) ? threads - ps.minThreads : 0;
+    }
+    if (kill == 0) {
+        return;
+    }
+
+    unsigned int killed = ps.pool->killThreads(kill);
+    LOG_INFO("Thread pool %s shrinks from %u to %u threads, %u idle",
+             ps.pool->getName().c_str(), threads, threads - killed,
+             ps.fewestIdle);
+}
@@ -44,7 +44,8 @@ SedaConfig::SedaConfig()
   : mCfgFile(),
     mCfgStr(),
     mThreadPools(),
-    mStages()      
+    mStages(),
+    mController(NULL)
 {
     return;
 }
@@ -144,6 +145,19 @@ SedaConfig::start()
         iter++;
     }
 
+    // the controller samples the queues of the connected stages
+    if (stat == SUCCESS && mController != NULL) {
+        for (iter = mStages.begin(); iter != end; iter++) {
+            if (iter->second != NULL) {
+                mController->addStage(iter->second);
+            }
+        }
+        if (mController->start() == false) {
+            cleanup();
+            stat = INITFAIL;
+        }
+    }
+
     return stat;
 }
 
@@ -180,6 +194,12 @@ SedaConfig::init()
 void
 SedaConfig::cleanup()
 {
+    // stop resizing the pools before they go
+    if (mController != NULL) {
+        delete mController;
+        mController = NULL;
+    }
+
     // first disconnect all mStages
     if (mStages.empty() == false) {
         std::map<std::string, Stage*>::iterator iter = mStages.begin();
@@ -200,6 +220,33 @@ SedaConfig::cleanup()
     clearconfig();
 }
 
+//! Parse the OverloadPolicy of a stage
+static bool
+parseOverloadPolicy(const std::string& value, Stage::OverloadPolicy& policy)
+{
+    if (value == "block")
+    {
+        policy = Stage::OVERLOAD_BLOCK;
+    }
+    else if (value == "reject")
+    {
+        policy = Stage::OVERLOAD_REJECT;
+    }
+    else if (value == "drop_oldest")
+    {
+        policy = Stage::OVERLOAD_DROP_OLDEST;
+    }
+    else if (value == "shed")
+    {
+        policy = Stage::OVERLOAD_SHED;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
 void
 SedaConfig::initEventHistory()
 {
@@ -232,8 +279,24 @@ SedaConfig::initEventHistory()
     }
     theMaxEventHops() = maxEventHops;
 
-    LOG_INFO("Successfully initEventHistory, EventHistory:%d, MaxEventHops:%u",
-            (int)evHist, maxEventHops);
+    //set hops kept in the history of an event, at most the compiled size
+    u32_t histSize = STAGE_EVENT_HIST_SIZE;
+    key = "EventHistorySize";
+    it = baseSection.find(key);
+    if (it != baseSection.end())
+    {
+        CLstring::strToVal(it->second, histSize);
+        if (histSize == 0 || histSize > STAGE_EVENT_HIST_SIZE)
+        {
+            LOG_WARN("EventHistorySize %u out of 1..%u", histSize,
+                    STAGE_EVENT_HIST_SIZE);
+            histSize = STAGE_EVENT_HIST_SIZE;
+        }
+    }
+    theEventHistorySize() = histSize;
+
+    LOG_INFO("Successfully initEventHistory, EventHistory:%d, MaxEventHops:%u, "
+            "EventHistorySize:%u", (int)evHist, maxEventHops, histSize);
     return ;
 }
 
@@ -280,12 +343,54 @@ SedaConfig::initThreadPool()
                 return INITFAIL;
             }
 
-            mThreadPools[threadName] = new Threadpool(threadCount, threadName);
+            // CPUs the threads are pinned to, a list and/or a NUMA node
+            std::string cpuStr = theGlobalProperties()->get("cpus", "",
+                    threadName);
+            std::string nodeStr = theGlobalProperties()->get("numa_node", "",
+                    threadName);
+            CLcpuset cpus;
+            if (cpus.configure(cpuStr, nodeStr) == false)
+            {
+                LOG_ERROR( "Wrong SedaConfig file, threadpools %s has no "
+                    "cpus %s on numa_node %s", threadName.c_str(),
+                    cpuStr.c_str(), nodeStr.c_str());
+                clearconfig();
+                return INITFAIL;
+            }
+            if (cpus.empty() == false)
+            {
+                LOG_INFO("Threadpool %s pinned to cpus %s",
+                        threadName.c_str(), cpus.toString().c_str());
+            }
+
+            mThreadPools[threadName] = new Threadpool(threadCount, threadName,
+                    cpus);
             if (mThreadPools[threadName] == NULL)
             {
                 LOG_ERROR( "Failed to new %s threadpool\n", threadName.c_str());
                 return INITFAIL;
             }
+
+            // stages run in a row on a thread without being queued
+            key = "InlineDepth";
+            std::string depthStr = theGlobalProperties()->get(key, "",
+                    threadName);
+            if (depthStr.empty() == false)
+            {
+                unsigned int depth = THREADPOOL_INLINE_DEPTH;
+                CLstring::strToVal(depthStr, depth);
+                mThreadPools[threadName]->setInlineDepth(depth);
+            }
+
+            // callbacks run nested on a thread instead of rescheduled
+            key = "CallbackDepth";
+            depthStr = theGlobalProperties()->get(key, "", threadName);
+            if (depthStr.empty() == false)
+            {
+                unsigned int depth = THREADPOOL_CALLBACK_DEPTH;
+                CLstring::strToVal(depthStr, depth);
+                mThreadPools[threadName]->setCallbackDepth(depth);
+            }
         }
         
     }
@@ -306,6 +411,104 @@ SedaConfig::initThreadPool()
     return SUCCESS;
 }
 
+SedaConfig::status_t
+SedaConfig::initPoolController()
+{
+    std::map<std::string, std::string> baseSection =
+            theGlobalProperties()->get(SEDA_BASE_NAME);
+    std::map<std::string, std::string>::iterator it;
+
+    PoolController* controller = new PoolController();
+
+    for (std::map<std::string, Threadpool *>::iterator pit =
+            mThreadPools.begin(); pit != mThreadPools.end(); pit++)
+    {
+        const std::string &threadName = pit->first;
+        Threadpool *pool = pit->second;
+
+        // the pool keeps between MinCount and MaxCount threads, both
+        // default to count, which leaves the pool as it is
+        unsigned int count = pool->numThreads();
+        unsigned int minCount = count;
+        unsigned int maxCount = count;
+        unsigned int growQueue = POOLCONTROLLER_GROW_QUEUE;
+        std::string valStr = theGlobalProperties()->get("MinCount", "",
+                threadName);
+        if (valStr.empty() == false)
+        {
+            CLstring::strToVal(valStr, minCount);
+        }
+        valStr = theGlobalProperties()->get("MaxCount", "", threadName);
+        if (valStr.empty() == false)
+        {
+            CLstring::strToVal(valStr, maxCount);
+        }
+        valStr = theGlobalProperties()->get("GrowThreshold", "", threadName);
+        if (valStr.empty() == false)
+        {
+            CLstring::strToVal(valStr, growQueue);
+        }
+
+        if (minCount < 1 || minCount > count || maxCount < count)
+        {
+            LOG_ERROR("Wrong SedaConfig file, threadpools %s needs "
+                    "1 <= MinCount <= count <= MaxCount", threadName.c_str());
+            delete controller;
+            clearconfig();
+            return INITFAIL;
+        }
+        if (maxCount > THREADPOOL_MAX_WORKERS)
+        {
+            maxCount = THREADPOOL_MAX_WORKERS;
+        }
+        if (minCount == maxCount)
+        {
+            continue;
+        }
+
+        controller->addPool(pool, minCount, maxCount, growQueue);
+        LOG_INFO("Threadpool %s resized between %u and %u threads, grows "
+                "beyond %u events queued per thread", threadName.c_str(),
+                minCount, maxCount, growQueue);
+    }
+
+    if (controller->empty())
+    {
+        delete controller;
+        return SUCCESS;
+    }
+
+    // how often and how long the load is sampled before a resize
+    u32_t msec = POOLCONTROLLER_INTERVAL;
+    u32_t growSamples = POOLCONTROLLER_GROW_SAMPLES;
+    u32_t shrinkSamples = POOLCONTROLLER_SHRINK_SAMPLES;
+    u32_t gain = POOLCONTROLLER_GAIN;
+    it = baseSection.find("ControllerInterval");
+    if (it != baseSection.end())
+    {
+        CLstring::strToVal(it->second, msec);
+    }
+    it = baseSection.find("ControllerGrowSamples");
+    if (it != baseSection.end())
+    {
+        CLstring::strToVal(it->second, growSamples);
+    }
+    it = baseSection.find("ControllerShrinkSamples");
+    if (it != baseSection.end())
+    {
+        CLstring::strToVal(it->second, shrinkSamples);
+    }
+    it = baseSection.find("ControllerGain");
+    if (it != baseSection.end())
+    {
+        CLstring::strToVal(it->second, gain);
+    }
+    controller->setSampling(msec, growSamples, shrinkSamples, gain);
+
+    mController = controller;
+    return SUCCESS;
+}
+
 SedaConfig::status_t
 SedaConfig::initStages()
 {
@@ -330,10 +533,10 @@ SedaConfig::initStages()
         splitTag.assign(1, CIni::CFG_DELIMIT_TAG);
         CLstring::splitString(it->second, splitTag, mStageNames);
 
-        for (std::vector<std::string>::iterator it = mStageNames.begin();
-                it != mStageNames.end(); it++)
+        for (std::vector<std::string>::iterator nameIt = mStageNames.begin();
+                nameIt != mStageNames.end(); nameIt++)
         {
-            std::string stageName(*it);
+            std::string stageName(*nameIt);
 
             // Get thread pool
             std::map<std::string, std::string> stageSection =
@@ -370,6 +573,50 @@ SedaConfig::initStages()
             mStages[stageName] = stage;
             stage->setPool(t);
 
+            // Events handled per activation, 1 schedules every event
+            u32_t quantum = 1;
+            u32_t usec    = 0;
+            it = stageSection.find("BatchQuantum");
+            if (it != stageSection.end())
+            {
+                CLstring::strToVal(it->second, quantum);
+            }
+            it = stageSection.find("BatchTime");
+            if (it != stageSection.end())
+            {
+                CLstring::strToVal(it->second, usec);
+            }
+            stage->setBatch(quantum, usec);
+            if (quantum > 1)
+            {
+                LOG_INFO("Stage %s handles up to %u events in %u usec "
+                        "per activation", stageName.c_str(), quantum, usec);
+            }
+
+            // Events queued at most, and what happens to the ones beyond
+            u32_t capacity = 0;
+            it = stageSection.find("QueueCapacity");
+            if (it != stageSection.end())
+            {
+                CLstring::strToVal(it->second, capacity);
+            }
+            Stage::OverloadPolicy policy = Stage::OVERLOAD_BLOCK;
+            it = stageSection.find("OverloadPolicy");
+            if (it != stageSection.end() &&
+                    parseOverloadPolicy(it->second, policy) == false)
+            {
+                LOG_ERROR("Unknown OverloadPolicy %s of %s",
+                        it->second.c_str(), stageName.c_str());
+                clearconfig();
+                return INITFAIL;
+            }
+            stage->setCapacity(capacity, policy);
+            if (capacity)
+            {
+                LOG_INFO("Stage %s queues up to %u events, overload policy %d",
+                        stageName.c_str(), capacity, (int)policy);
+            }
+
         } //end for stage
 
     } catch (std::exception &e)
@@ -393,11 +640,11 @@ SedaConfig::genNextStages()
 {
     try
     {
-        for (std::vector<std::string>::iterator it = mStageNames.begin();
-                it != mStageNames.end(); it++)
+        for (std::vector<std::string>::iterator nameIt = mStageNames.begin();
+                nameIt != mStageNames.end(); nameIt++)
         {
 
-            std::string stageName(*it);
+            std::string stageName(*nameIt);
             Stage *stage = mStages[stageName];
 
             std::map<std::string, std::string> stageSection =
@@ -450,6 +697,13 @@ SedaConfig::instantiate()
         return status;
     }
 
+    status = initPoolController();
+    if (status)
+    {
+        LOG_ERROR( "Failed to init thread pool controller\n");
+        return status;
+    }
+
     status = initStages();
     if (status)
     {
@@ -473,6 +727,11 @@ SedaConfig::instantiate()
 void
 SedaConfig::clearconfig()
 {
+    if (mController != NULL) {
+        delete mController;
+        mController = NULL;
+    }
+
     // delete mStages
     std::map<std::string, Stage*>::iterator s_iter = mStages.begin();
     std::map<std::string, Stage*>::iterator s_end  = mStages.end();
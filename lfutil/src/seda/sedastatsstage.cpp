@@ -760,7 +760,10 @@ SedaStatsStage::addStatsEvent(StageEvent *event)
 
     MUTEX_LOCK(&sedaStageLock);
 
-    theStatsCollectionStage()->addEvent(event);
+    if (theStatsCollectionStage()->addEvent(event) == false)
+    {
+        event->shed();
+    }
 
     MUTEX_UNLOCK(&sedaStageLock);
 }
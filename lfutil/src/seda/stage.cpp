@@ -41,15 +41,24 @@
  */
 Stage::Stage(const char* tag) :
     eventList(),
-    connected(false),
-    eventRef(0),
+    drained(false),
+    eventRef(STAGE_DISCONNECTED),
+    batchQuantum(1),
+    batchTime(0),
+    activations(0),
+    capacity(0),
+    overloadPolicy(OVERLOAD_BLOCK),
+    overloads(0),
+    blockedProducers(0),
     nextStageList()
 {
     LOG_TRACE( "%s", "enter");
     assert(tag != NULL);
 
-    MUTEX_INIT(&listMutex, NULL);
+    MUTEX_INIT(&disconnectMutex, NULL);
     COND_INIT(&disconnectCond, NULL);
+    MUTEX_INIT(&overloadMutex, NULL);
+    COND_INIT(&overloadCond, NULL);
     stageName = new char[strlen(tag) + 1];
     strcpy (stageName, tag);
     LOG_TRACE( "%s", "exit");
@@ -64,17 +73,17 @@ Stage::Stage(const char* tag) :
 Stage::~Stage()
 {
     LOG_TRACE( "%s", "enter");
-    assert(!connected);
-    MUTEX_LOCK(&listMutex);
-    while (eventList.size() > 0) {
-        delete *(eventList.begin());
-        eventList.pop_front();
+    assert(!isConnected());
+    StageEvent* event = NULL;
+    while ((event = eventList.pop()) != NULL) {
+        delete event;
     }
-    MUTEX_UNLOCK(&listMutex);
     nextStageList.clear();
 
-    MUTEX_DESTROY(&listMutex);
+    MUTEX_DESTROY(&disconnectMutex);
     COND_DESTROY(&disconnectCond);
+    MUTEX_DESTROY(&overloadMutex);
+    COND_DESTROY(&overloadCond);
     delete [] stageName;
     LOG_TRACE( "%s", "exit");
 }
@@ -100,7 +109,7 @@ bool
 Stage::connect()
 {
     LOG_TRACE( "%s%s", "enter", stageName);
-    assert(!connected);
+    assert(!isConnected());
     assert(thPool != NULL);
 
     bool         success = false;
@@ -108,22 +117,23 @@ Stage::connect()
 
     success = initialize();
     if (success) {
-        MUTEX_LOCK(&listMutex);
+        // addEvent() queues under the mutex while the stage is disconnected
+        MUTEX_LOCK(&disconnectMutex);
         backlog = eventList.size();
-        eventRef = backlog;
-        connected = true;
-        MUTEX_UNLOCK(&listMutex);
+        __sync_add_and_fetch(&eventRef, backlog);
+        __sync_and_and_fetch(&eventRef, ~STAGE_DISCONNECTED);
+        MUTEX_UNLOCK(&disconnectMutex);
     }
 
     // if connection succeeded, schedule all the events in the queue
-    if (connected) {
+    if (success) {
         while (backlog > 0) {
             thPool->schedule(this);
             backlog--;
         }
     }
 
-    LOG_TRACE( "%s%s%d", "exit", stageName, connected);
+    LOG_TRACE( "%s%s%d", "exit", stageName, success);
     return success;
 }
 
@@ -143,19 +153,36 @@ Stage::connect()
 void
 Stage::disconnect()
 {
-    assert(connected == true);
+    assert(isConnected());
 
     LOG_TRACE( "%s%s", "enter", stageName);
-    MUTEX_LOCK(&listMutex);
+    MUTEX_LOCK(&disconnectMutex);
     disconnectPrepare();
-    connected = false;
-    while (eventRef > 0) {
-        COND_WAIT(&disconnectCond, &listMutex);
+
+    // Events taking a reference from now on see the stage disconnected.
+    // If references are left, the thread dropping the last one signals,
+    // and it still uses the stage until then, so wait for its signal
+    // rather than for the count.
+    drained = false;
+    unsigned long refs = __sync_or_and_fetch(&eventRef, STAGE_DISCONNECTED);
+
+    // producers waiting for room queue their events for the next connect
+    MUTEX_LOCK(&overloadMutex);
+    COND_BRAODCAST(&overloadCond);
+    MUTEX_UNLOCK(&overloadMutex);
+
+    if (refs != STAGE_DISCONNECTED) {
+        while (!drained) {
+            COND_WAIT(&disconnectCond, &disconnectMutex);
+        }
     }
     thPool = NULL;
     nextStageList.clear();
+    MUTEX_UNLOCK(&disconnectMutex);
+
+    // not under the mutex, cleanup() may wait for threads which are still
+    // adding events to the stage or releasing their references
     cleanup();
-    MUTEX_UNLOCK(&listMutex);
     LOG_TRACE( "%s%s", "exit", stageName);
 }
 
@@ -165,29 +192,164 @@ Stage::disconnect()
  * @param[in] event Event to add to queue.
  * 
  * @pre  event non-null
- * @post event added to the end of event queue
+ * @post event added to the end of event queue, or shed
  * @post event must not be de-referenced by caller after return
+ *       unless it is rejected
+ * @return false if the event is rejected
  */
-void 
+bool 
 Stage::addEvent(StageEvent* event)
 {
     assert(event != NULL);
 
-    MUTEX_LOCK(&listMutex);
-
-    // add event to back of queue
-    eventList.push_back(event);
+    // callbacks complete work already done, they are always taken
+    if (capacity && eventList.size() >= capacity && !event->isCallback() &&
+        isConnected()) {
+        int rc = overload(event);
+        if (rc <= 0) {
+            return rc == 0;
+        }
+    }
 
-    if (connected) {
+    // the reference tells whether the stage is connected
+    if ((__sync_add_and_fetch(&eventRef, 1) & STAGE_DISCONNECTED) == 0) {
         assert(thPool != NULL);
 
-        eventRef++;
-        MUTEX_UNLOCK(&listMutex);
+        // add event to back of queue
+        eventList.push(event);
+        thPool->schedule(this);
+        return true;
+    }
+    releaseEvent();
+
+    // connect() counts the backlog under the mutex, so the event is either
+    // in its backlog or added after the stage is connected
+    MUTEX_LOCK(&disconnectMutex);
+    eventList.push(event);
+    if (isConnected()) {
+        __sync_add_and_fetch(&eventRef, 1);
+        MUTEX_UNLOCK(&disconnectMutex);
         thPool->schedule(this);
     }
     else {
-        MUTEX_UNLOCK(&listMutex);
+        MUTEX_UNLOCK(&disconnectMutex);
     }
+    return true;
+}
+
+
+//! Add events the stage has to take, in one pass
+/**
+ * The capacity and the overload policy are not applied, see stage.h.
+ */
+void
+Stage::addEvents(StageEvent** events, unsigned int count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    if ((__sync_add_and_fetch(&eventRef, count) & STAGE_DISCONNECTED) == 0) {
+        assert(thPool != NULL);
+
+        eventList.pushBatch(events, count);
+        thPool->schedule(this, count);
+        return;
+    }
+
+    // not connected, the events go to the backlog one by one
+    for (unsigned int i = 0; i < count; i++) {
+        releaseEvent();
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        addEvent(events[i]);
+    }
+}
+
+
+//! Apply the overload policy to an event for a full queue
+/**
+ * @return 1 if addEvent() is to queue the event, 0 if it has been taken
+ *         care of, -1 if it is rejected
+ */
+int
+Stage::overload(StageEvent* event)
+{
+    __sync_add_and_fetch(&overloads, 1);
+
+    switch (overloadPolicy) {
+    case OVERLOAD_REJECT:
+        return -1;
+
+    case OVERLOAD_SHED:
+        event->shed();
+        return 0;
+
+    case OVERLOAD_DROP_OLDEST:
+        return replaceOldest(event) ? 0 : 1;
+
+    case OVERLOAD_BLOCK:
+    default:
+        break;
+    }
+
+    // the threads of the pool may be the ones to make room
+    if (Threadpool::current() == thPool) {
+        return 1;
+    }
+
+    // wakeProducers() runs after an event is removed, whoever removes it
+    // either sees the count here or the length is seen below shorter
+    MUTEX_LOCK(&overloadMutex);
+    __sync_add_and_fetch(&blockedProducers, 1);
+    while (eventList.size() >= capacity && isConnected()) {
+        COND_WAIT(&overloadCond, &overloadMutex);
+    }
+    __sync_sub_and_fetch(&blockedProducers, 1);
+    MUTEX_UNLOCK(&overloadMutex);
+
+    return 1;
+}
+
+
+//! Queue event in place of the oldest one, which is shed
+/**
+ * The new event takes over the reference and the run queue entry of the
+ * shed one, so the number of queued events doesn't change.
+ *
+ * @return false if the stage isn't connected, nothing is done then
+ */
+bool
+Stage::replaceOldest(StageEvent* event)
+{
+    if (__sync_add_and_fetch(&eventRef, 1) & STAGE_DISCONNECTED) {
+        releaseEvent();
+        return false;
+    }
+
+    // push first so that the events already scheduled are all there when
+    // their threads come for them
+    eventList.push(event);
+    StageEvent* oldest = eventList.pop();
+
+    if (oldest == event) {
+        // the queue has drained meanwhile, the event is queued as usual
+        eventList.push(event);
+        thPool->schedule(this);
+        return true;
+    }
+
+    if (oldest) {
+        releaseEvent();
+        oldest->shed();
+    }
+    // else a batching thread took both, it has the reference of event
+
+    if (batchQuantum > 1) {
+        // make sure an activation sees the event
+        thPool->schedule(this);
+    }
+    return true;
 }
 
 
@@ -198,12 +360,7 @@ Stage::addEvent(StageEvent* event)
 unsigned long
 Stage::qlen() const
 {
-    unsigned long res;
-
-    MUTEX_LOCK(&listMutex);
-    res = eventList.size();
-    MUTEX_UNLOCK(&listMutex);
-    return res;
+    return eventList.size();
 }
 
 
@@ -214,12 +371,7 @@ Stage::qlen() const
 bool
 Stage::qempty() const
 {
-    bool empty = false;
-
-    MUTEX_LOCK(&listMutex);
-    empty = eventList.empty();
-    MUTEX_UNLOCK(&listMutex);
-    return empty;
+    return eventList.empty();
 }
 
 
@@ -234,14 +386,10 @@ Stage::qempty() const
 StageEvent*
 Stage::removeEvent()
 {
-    MUTEX_LOCK(&listMutex);
-
-    assert(! eventList.empty());
+    StageEvent* se = eventList.pop();
+    assert(se != NULL);
+    wakeProducers();
 
-    StageEvent* se = *(eventList.begin());
-    eventList.pop_front();
-    MUTEX_UNLOCK(&listMutex);
-    
     return se;
 }
 
@@ -255,10 +403,10 @@ Stage::removeEvent()
 void
 Stage::releaseEvent()
 {
-    MUTEX_LOCK(&listMutex);
-    eventRef--;
-    if (!connected && eventRef == 0) {
+    if (__sync_sub_and_fetch(&eventRef, 1) == STAGE_DISCONNECTED) {
+        MUTEX_LOCK(&disconnectMutex);
+        drained = true;
         COND_SIGNAL(&disconnectCond);
+        MUTEX_UNLOCK(&disconnectMutex);
     }
-    MUTEX_UNLOCK(&listMutex);
 }
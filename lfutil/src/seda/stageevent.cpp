@@ -13,6 +13,7 @@
 // Include Files
 #include <assert.h>
 #include <stdlib.h>
+#include <sstream>
 
 #include "defs.h"
 #include "linit.h"
@@ -21,6 +22,8 @@
 
 #include "seda/stageevent.h"
 #include "seda/callback.h"
+#include "seda/stage.h"
+#include "time/datetime.h"
 #include "time/timeoutinfo.h"
 
 
@@ -32,12 +35,14 @@
  */
 
 
+CLOBJPOOL_DEFINE(StageEvent, "Event")
+
 //! Constructor
 StageEvent::StageEvent() : 
     compCB(NULL),
     ud(NULL),
     cbFlag(false),
-    history(NULL),
+    histNext(0),
     stageHops(0),
     tmInfo(NULL)
 {
@@ -55,12 +60,6 @@ StageEvent::~StageEvent()
         delete top;
     }
 
-    // delete the history if present
-    if (history) {
-        history->clear();
-        delete history;
-    }
-
     if (tmInfo) {
         tmInfo->detach();
         tmInfo = NULL;
@@ -76,6 +75,9 @@ StageEvent::done()
 
     if (compCB) {
         top = compCB;
+        if (top->eventInline(this)) {
+            return;
+        }
         markCallback();
         top->eventReschedule(this);
     } else {
@@ -84,6 +86,20 @@ StageEvent::done()
 }
 
 
+//! Processing for this event is done; callbacks to be added by caller
+Stage*
+StageEvent::doneTarget()
+{
+    if (compCB == NULL) {
+        delete this;
+        return NULL;
+    }
+
+    markCallback();
+    return compCB->getTargetStage();
+}
+
+
 //! Processing for this event is done; callbacks executed immediately
 void
 StageEvent::doneImmediate()
@@ -117,6 +133,13 @@ StageEvent::doneTimeout()
     }
 }
 
+//! A stage has no room for this event
+void
+StageEvent::shed()
+{
+    done();
+}
+
 //! Push the completion callback onto the stack
 void
 StageEvent::pushCallback(CompletionCallback* cb)
@@ -140,18 +163,66 @@ StageEvent::getUserData()
 }
 
 
-//! Add stage to list of stages which have handled this event
+//! Add stage to the history of stages which have handled this event
 void
 StageEvent::saveStage(Stage* stg, HistType type)
 {
-    if (!history) {
-        history = new std::list<HistEntry>;
+    // the oldest entry is overwritten once the ring is full
+    HistEntry& entry = history[histNext];
+    entry.stage = stg;
+    entry.type = type;
+    entry.usec = Now::usec();
+
+    if (++histNext >= theEventHistorySize()) {
+        histNext = 0;
+    }
+    // a looping event is reported once with the stages it went through,
+    // events which legitimately circulate keep going
+    if (++stageHops == theMaxEventHops()) {
+        std::string info;
+        dumpHistory(info);
+        LOG_WARN("Event reached max hops, %s", info.c_str());
     }
-    if (history) {
-        history->push_back(std::make_pair(stg, type));
-        stageHops++;
-        ASSERT(stageHops <= theMaxEventHops(), "Event exceeded max hops");
+}
+
+u32_t
+StageEvent::getHistoryCount() const
+{
+    u32_t size = theEventHistorySize();
+    return stageHops < size ? stageHops : size;
+}
+
+const StageEvent::HistEntry&
+StageEvent::getHistory(u32_t i) const
+{
+    u32_t size = theEventHistorySize();
+    u32_t oldest = stageHops < size ? 0 : histNext;
+    return history[(oldest + i) % size];
+}
+
+const char*
+StageEvent::histTypeName(HistType type)
+{
+    static const char* typeNames[] = {"handle", "callback", "timeout"};
+
+    return typeNames[type];
+}
+
+void
+StageEvent::dumpHistory(std::string& info) const
+{
+    std::ostringstream os;
+    os << "hops:" << stageHops;
+
+    u32_t count = getHistoryCount();
+    for (u32_t i = 0; i < count; i++) {
+        const HistEntry& entry = getHistory(i);
+        s64_t delta = i ? entry.usec - getHistory(i - 1).usec : 0;
+        os << " " << entry.stage->getName() << ":" << histTypeName(entry.type)
+           << ":+" << delta;
     }
+
+    info = os.str();
 }
 
 void
@@ -206,3 +277,11 @@ theEventHistoryFlag()
     static bool eventHistoryFlag = false;
     return eventHistoryFlag;
 }
+
+//! Accessor function which wraps value for hops kept in event histories
+u32_t&
+theEventHistorySize()
+{
+    static u32_t eventHistorySize = STAGE_EVENT_HIST_SIZE;
+    return eventHistorySize;
+}
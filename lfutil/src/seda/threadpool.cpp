@@ -12,9 +12,12 @@
 
 // Include Files
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "trace/log.h"
 #include "os/mutex.h"
+#include "time/datetime.h"
 
 #include "seda/threadpool.h"
 #include "seda/stage.h"
@@ -32,24 +35,37 @@ extern bool& theEventHistoryFlag();
 //! Constructor
 /**
  * @param[in] threads The number of threads to create.
+ * @param[in] name    Name of the thread pool.
+ * @param[in] cpus    CPUs the threads are pinned to, empty for none
  *
  * @post thread pool has <i>threads</i> threads running
  */
  Threadpool::Threadpool(unsigned int threads,
-                        const std::string& name) :
-    runQueue(),
+                        const std::string& name,
+                        const CLcpuset& cpus) :
+    nWorkers(0),
+    nextWorker(0),
     eventhist(theEventHistoryFlag()),
+    inlineDepth(THREADPOOL_INLINE_DEPTH),
+    callbackDepth(THREADPOOL_CALLBACK_DEPTH),
     nthreads(0),
     threadsToKill(0),
     nIdles(0),
     killer("KillThreads"),
-    name(name)
+    name(name),
+    cpus(cpus)
 {
     LOG_TRACE( "%s%d", "enter", threads);
     MUTEX_INIT(&runMutex, NULL);
     COND_INIT(&runCond, NULL);
     MUTEX_INIT(&threadMutex, NULL);
     COND_INIT(&threadCond, NULL);
+    for (unsigned int i = 0; i < THREADPOOL_MAX_WORKERS; i++) {
+        workers[i] = NULL;
+    }
+
+    // stages may be scheduled before any thread is added
+    addWorker();
     addThreads(threads);
     LOG_TRACE( "%s", "exit");
 }
@@ -66,7 +82,10 @@ Threadpool::~Threadpool()
     // kill all the remaining service threads
     killThreads(nthreads);
 
-    runQueue.clear();
+    for (unsigned int i = 0; i < nWorkers; i++) {
+        MUTEX_DESTROY(&workers[i]->mutex);
+        delete workers[i];
+    }
     MUTEX_DESTROY(&runMutex);
     COND_DESTROY(&runCond);
     MUTEX_DESTROY(&threadMutex);
@@ -89,6 +108,19 @@ Threadpool::numThreads()
 }
 
 
+//! Events handled by the threads of the pool so far
+unsigned long
+Threadpool::eventsHandled() const
+{
+    unsigned long total = 0;
+    unsigned int n = nWorkers;
+    for (unsigned int i = 0; i < n; i++) {
+        total += workers[i]->handled;
+    }
+    return total;
+}
+
+
 //! Add threads to the pool
 /**
  * @param[in] threads Number of threads to add to the pool.
@@ -108,22 +140,46 @@ Threadpool::addThreads(unsigned int threads)
     pthread_attr_init(&pThreadAttrs);
     pthread_attr_setdetachstate(&pThreadAttrs,
                                 PTHREAD_CREATE_DETACHED);
+    // threads start on their CPUs, their stacks are local to them
+    int rc = cpus.apply(&pThreadAttrs);
+    if (rc != 0) {
+        LOG_WARN("Failed to pin threads of %s to cpus %s, %d:%s",
+                 name.c_str(), cpus.toString().c_str(), rc, strerror(rc));
+    }
     
     MUTEX_LOCK(&threadMutex);
   
     // attempt to start the requested number of threads
+    unsigned int slot = 0;
     for (i=0; i < threads; i++) {
+        // reuse the run queue of a killed thread first
+        while (slot < nWorkers && workers[slot]->active) {
+            slot++;
+        }
+        if (slot == THREADPOOL_MAX_WORKERS) {
+            LOG_WARN("Thread pool %s reaches %d threads",
+                     name.c_str(), THREADPOOL_MAX_WORKERS);
+            break;
+        }
+        if (slot == nWorkers) {
+            addWorker();
+        }
+
+        Worker* worker = workers[slot];
+        worker->active = true;
         int stat = pthread_create(&pThread,
                                   &pThreadAttrs,
                                   Threadpool::runThread,
-                                  (void*) this);
+                                  (void*) worker);
         if (stat != 0) {
+            worker->active = false;
             LOG_WARN("Failed to create one thread\n");
             break;
         }
     }
     nthreads += i;
     MUTEX_UNLOCK(&threadMutex);
+    pthread_attr_destroy(&pThreadAttrs);
     LOG_TRACE( "%s%d", "adding threads exit", threads);
     return i;
 }
@@ -195,7 +251,55 @@ Threadpool::threadKill()
         COND_SIGNAL(&threadCond);
     }
 
+    // The run queue is left to the other threads to steal from, and to the
+    // next thread added. The exiting thread schedules as an outside thread.
+    Worker* self = getWorker();
+    assert(self != NULL && self->pool == this);
+    self->active = false;
+    setWorker(NULL);
+
     MUTEX_UNLOCK(&threadMutex);
+
+    if (self->handoff) {
+        Stage* handoff = self->handoff;
+        self->handoff = NULL;
+        enqueue(handoff);
+    }
+
+    // pairs with the check of outside threads in enqueue(), either they
+    // see the queue inactive or its stages are seen here
+    __sync_synchronize();
+    if (self->queued > 0) {
+        wakeIdle();
+    }
+}
+
+
+//! Allocate one more run queue
+/**
+ * @pre  thread mutex is locked, or no thread runs yet
+ * @pre  nWorkers < THREADPOOL_MAX_WORKERS
+ */
+void
+Threadpool::addWorker()
+{
+    unsigned int slot = nWorkers;
+
+    Worker* worker = new Worker;
+    worker->pool = this;
+    worker->queued = 0;
+    worker->active = false;
+    worker->seed = slot + 1;
+    worker->handoff = NULL;
+    worker->depth = 0;
+    worker->cbDepth = 0;
+    worker->handled = 0;
+    MUTEX_INIT(&worker->mutex, NULL);
+
+    // other threads read nWorkers without threadMutex
+    workers[slot] = worker;
+    __sync_synchronize();
+    nWorkers = slot + 1;
 }
 
 
@@ -241,24 +345,276 @@ Threadpool::genKillThreadEvents(unsigned int toKill)
  * @post stageP is scheduled on the run queue.
  */
 void
-Threadpool::schedule(Stage* stageP)
+Threadpool::schedule(Stage* stageP, unsigned int count)
 {
-    assert(! stageP->qempty());
+    if (stageP->batchQuantum > 1) {
+        // A batching stage is scheduled once per activation instead of
+        // once per event, at most one activation per thread so that the
+        // events of one stage are still handled in parallel
+        unsigned int limit = nthreads ? nthreads : 1;
+        unsigned int want = (count + stageP->batchQuantum - 1) /
+                            stageP->batchQuantum;
+        unsigned int active = stageP->activations;
+        do {
+            if (active >= limit) {
+                return;
+            }
+            count = (limit - active < want) ? limit - active : want;
+            unsigned int prev = __sync_val_compare_and_swap(
+                    &stageP->activations, active, active + count);
+            if (prev == active) {
+                break;
+            }
+            active = prev;
+        } while (1);
 
-    MUTEX_LOCK(&runMutex);
-    bool wasEmpty = runQueue.empty();
-    runQueue.push_back(stageP);
-    // let current thread continue to run the target stage if there is
-    // only one event and the target stage is in the same thread pool
-    if (wasEmpty == false || this != getThreadPoolPtr()) {
-        // wake up if there is idle thread
-        if (nIdles > 0) {
-            COND_SIGNAL(&runCond);
+        // the activation keeps the stage connected until it ends
+        __sync_add_and_fetch(&stageP->eventRef, count);
+    }
+    else {
+        assert(! stageP->qempty());
+    }
+
+    enqueue(stageP, count);
+}
+
+
+//! Put a stage on a run queue
+void
+Threadpool::enqueue(Stage* stageP, unsigned int count)
+{
+    Worker* self   = getWorker();
+    Worker* target = self;
+    if (self == NULL || self->pool != this) {
+        // skip the queues of killed threads, only steals drain them
+        unsigned int n = nWorkers;
+        self = NULL;
+        for (unsigned int i = 0; i < n; i++) {
+            target = workers[__sync_fetch_and_add(&nextWorker, 1) % n];
+            if (target->active) {
+                break;
+            }
         }
     }
+    else if (count == 1 && self->handoff == NULL && self->queued == 0 &&
+             self->depth < inlineDepth && stageP != &killer) {
+        // nothing else waits for this thread, run the stage right after
+        // the current handler instead of going through the run queue;
+        // kill events are left to whichever thread is free
+        self->handoff = stageP;
+        return;
+    }
+
+    // A thread going to sleep counts itself idle before it checks every
+    // run queue under its mutex, so either it sees the stage or nIdles is
+    // seen here
+    MUTEX_LOCK(&target->mutex);
+    bool wasEmpty = target->runQueue.empty();
+    target->runQueue.insert(target->runQueue.end(), count, stageP);
+    target->queued = target->runQueue.size();
+    bool idle = (nIdles > 0);
+    MUTEX_UNLOCK(&target->mutex);
+
+    // the thread of the queue may have been killed meanwhile, see
+    // threadKill()
+    if (self == NULL) {
+        __sync_synchronize();
+        idle = idle || (target->active == false);
+    }
+
+    // let current thread continue to run the target stage if there is
+    // only one event and the target stage is in the same thread pool,
+    // several go to idle threads which steal them from the target
+    if (idle && (wasEmpty == false || target != self ||
+                 self->handoff != NULL || count > 1)) {
+        wakeIdle(count);
+    }
+}
+
+
+//! Set how many stages a thread may run in a row by handoff
+void
+Threadpool::setInlineDepth(unsigned int depth)
+{
+    inlineDepth = depth;
+}
+
+
+//! Set how many callbacks may run nested on a thread of the pool
+void
+Threadpool::setCallbackDepth(unsigned int depth)
+{
+    callbackDepth = depth;
+}
+
+
+//! Run the completion callback of an event on the calling thread
+bool
+Threadpool::runCallback(Stage* stageP, StageEvent* event)
+{
+    Worker* self = getWorker();
+    if (self == NULL || self->cbDepth >= self->pool->callbackDepth) {
+        return false;
+    }
+
+    // the callback holds the stage connected like a queued event would
+    if (__sync_add_and_fetch(&stageP->eventRef, 1) & STAGE_DISCONNECTED) {
+        stageP->releaseEvent();
+        return false;
+    }
+    if (stageP->thPool != self->pool) {
+        stageP->releaseEvent();
+        return false;
+    }
+
+    self->cbDepth++;
+#ifdef ENABLE_STAGE_LEVEL_TIMEOUT
+    if (event->hasTimedOut()) {
+        event->doneTimeout();
+    } else {
+        event->doneImmediate();
+    }
+#else
+    event->doneImmediate();
+#endif
+    self->cbDepth--;
+
+    stageP->releaseEvent();
+    return true;
+}
+
+
+//! Pool of the calling thread
+Threadpool*
+Threadpool::current()
+{
+    Worker* self = getWorker();
+    return self ? self->pool : NULL;
+}
+
+
+//! Wake up to count sleeping threads
+void
+Threadpool::wakeIdle(unsigned int count)
+{
+    MUTEX_LOCK(&runMutex);
+    if (count > nIdles) {
+        count = nIdles;
+    }
+    do {
+        COND_SIGNAL(&runCond);
+    } while (count-- > 1);
     MUTEX_UNLOCK(&runMutex);
 }
 
+
+//! Whether any run queue has stages
+/**
+ * Each queue is checked under its mutex, see schedule()
+ */
+bool
+Threadpool::hasWork()
+{
+    unsigned int n = nWorkers;
+    for (unsigned int i = 0; i < n; i++) {
+        MUTEX_LOCK(&workers[i]->mutex);
+        bool empty = workers[i]->runQueue.empty();
+        MUTEX_UNLOCK(&workers[i]->mutex);
+
+        if (empty == false) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//! Take a stage from the queue of another thread
+/**
+ * Victims are visited from a random one on, the first non-empty queue
+ * gives up half of its stages, the newest ones.  One of them is returned
+ * and the rest go to the queue of the stealing thread.
+ */
+Stage*
+Threadpool::steal(Worker* self)
+{
+    unsigned int n = nWorkers;
+    if (n == 1) {
+        return NULL;
+    }
+
+    unsigned int start = rand_r(&self->seed) % n;
+
+    Stage* stolen[THREADPOOL_MAX_STEAL];
+    size_t taken = 0;
+    for (unsigned int i = 0; i < n && taken == 0; i++) {
+        Worker* victim = workers[(start + i) % n];
+        if (victim == self || victim->queued == 0) {
+            continue;
+        }
+
+        MUTEX_LOCK(&victim->mutex);
+        taken = (victim->runQueue.size() + 1) / 2;
+        if (taken > THREADPOOL_MAX_STEAL) {
+            taken = THREADPOOL_MAX_STEAL;
+        }
+        for (size_t j = taken; j > 0; j--) {
+            stolen[j - 1] = victim->runQueue.back();
+            victim->runQueue.pop_back();
+        }
+        victim->queued = victim->runQueue.size();
+        MUTEX_UNLOCK(&victim->mutex);
+    }
+
+    if (taken == 0) {
+        return NULL;
+    }
+
+    if (taken > 1) {
+        MUTEX_LOCK(&self->mutex);
+        self->runQueue.insert(self->runQueue.end(),
+                              stolen + 1, stolen + taken);
+        self->queued = self->runQueue.size();
+        MUTEX_UNLOCK(&self->mutex);
+    }
+
+    return stolen[0];
+}
+
+
+//! Take the next stage to run, sleeps until there is one
+Stage*
+Threadpool::takeWork(Worker* self)
+{
+    while (1) {
+        Stage* runStage = NULL;
+
+        MUTEX_LOCK(&self->mutex);
+        if (self->runQueue.empty() == false) {
+            runStage = self->runQueue.front();
+            self->runQueue.pop_front();
+            self->queued = self->runQueue.size();
+        }
+        MUTEX_UNLOCK(&self->mutex);
+
+        if (runStage == NULL) {
+            runStage = steal(self);
+        }
+        if (runStage) {
+            return runStage;
+        }
+
+        // wait for some stage to be scheduled
+        MUTEX_LOCK(&runMutex);
+        nIdles++;
+        if (hasWork() == false) {
+            COND_WAIT(&runCond, &runMutex);
+        }
+        nIdles--;
+        MUTEX_UNLOCK(&runMutex);
+    }
+}
+
 //! Get name of thread pool
 const std::string&
 Threadpool::getName()
@@ -272,75 +628,179 @@ Threadpool::getName()
  * Should not be called except when a thread is created.
  */
 void*
-Threadpool::runThread(void* poolPtr)
+Threadpool::runThread(void* workerPtr)
 {
-    Threadpool* poolP = (Threadpool*) poolPtr;
+    Worker*     worker = (Worker*) workerPtr;
+    Threadpool* poolP  = worker->pool;
 
-    // save thread pool pointer
-    setThreadPoolPtr(poolP);
+    // save the run queue of the thread
+    setWorker(worker);
 
     // this is not portable, but is easier to map to LWP
     pid_t threadid;
     threadid = gettid();
     LOG_INFO("threadid = %d, threadname = %s\n", threadid, poolP->getName().c_str());
 
-    LOG_TRACE("enter %p", poolPtr);
+    LOG_TRACE("enter %p", poolP);
     // enter a loop where we continuously look for events from Stages on
     // the runQueue and handle the event.
     while (1) {
-        MUTEX_LOCK(&(poolP->runMutex));
+        // a stage handed off by the last handler goes first
+        Stage* runStage = worker->handoff;
+        if (runStage) {
+            worker->handoff = NULL;
+            worker->depth++;
+        }
+        else {
+            runStage = poolP->takeWork(worker);
+            worker->depth = 0;
+        }
 
-        // wait for some stage to be scheduled
-        while (poolP->runQueue.empty()) {
-            (poolP->nIdles)++;
-            COND_WAIT(&(poolP->runCond), &(poolP->runMutex));
-            (poolP->nIdles)--;
+        if (runStage->batchQuantum > 1) {
+            worker->handled += poolP->runBatch(runStage);
+            continue;
         }
-        
-        assert(! poolP->runQueue.empty());
-        Stage* runStage = *(poolP->runQueue.begin());
-        poolP->runQueue.pop_front();
-        MUTEX_UNLOCK(&(poolP->runMutex));
 
         StageEvent* event = runStage->removeEvent();
+        poolP->runEvent(runStage, event);
+        runStage->releaseEvent();
+        worker->handled++;
+    }
+    LOG_TRACE("exit %p", poolP);
+    LOG_INFO("threadid = %d, threadname = %s",
+                 threadid, poolP->getName().c_str());
 
-        // need to check if this is a rescheduled callback
-        if (event->isCallback()) {
-#ifdef ENABLE_STAGE_LEVEL_TIMEOUT
-            // check if the event has timed out.
-            if (event->hasTimedOut()) {
-                event->doneTimeout();
-            } else {
-                event->doneImmediate();
+    // the dummy compiler need this
+    pthread_exit(NULL);
+}
+
+
+//! Drain events of a batching stage for one activation
+/**
+ * Handles up to the stage's quantum of events, or less when its time
+ * budget runs out, then puts the stage back on the run queue if it has
+ * more events.  Otherwise the activation ends; an event added meanwhile
+ * either sees it ended and activates the stage again, or is seen here.
+ * <p>
+ * The events are passed to handleEvents() in batches of at most
+ * THREADPOOL_MAX_BATCH, callbacks and timed out events are completed on
+ * their own.
+ */
+unsigned int
+Threadpool::runBatch(Stage* runStage)
+{
+    s64_t deadline = 0;
+    if (runStage->batchTime) {
+        deadline = Now::usec() + runStage->batchTime;
+    }
+
+    StageEvent*  batch[THREADPOOL_MAX_BATCH];
+    unsigned int taken = 0;
+    while (taken < runStage->batchQuantum) {
+        unsigned int want = runStage->batchQuantum - taken;
+        if (want > THREADPOOL_MAX_BATCH) {
+            want = THREADPOOL_MAX_BATCH;
+        }
+
+        // only pop what is queued, a pop finding the queue empty is wasted
+        unsigned long queued = runStage->qlen();
+        if (want > queued) {
+            want = (queued > 0) ? queued : 1;
+        }
+
+        size_t       n      = 0;
+        unsigned int popped = 0;
+        for (; popped < want; popped++) {
+            StageEvent* event = runStage->eventList.pop();
+            if (event == NULL) {
+                break;
+            }
+
+            if (prepareEvent(runStage, event)) {
+                batch[n++] = event;
+            }
+            else {
+                runStage->releaseEvent();
             }
-#else
-            event->doneImmediate();
-#endif
         }
-        else {
-            if (poolP->eventhist) { 
-                event->saveStage(runStage, StageEvent::HANDLE_EV); 
+        taken += popped;
+        if (popped > 0) {
+            runStage->wakeProducers();
+        }
+
+        if (n > 0) {
+            runStage->handleEvents(batch, n);
+            for (size_t i = 0; i < n; i++) {
+                runStage->releaseEvent();
             }
+        }
+
+        if (popped == 0 || (deadline && Now::usec() >= deadline)) {
+            break;
+        }
+    }
+
+    if (runStage->qempty() == false) {
+        enqueue(runStage);
+        return taken;
+    }
+
+    __sync_sub_and_fetch(&runStage->activations, 1);
+    if (runStage->qempty() == false) {
+        schedule(runStage);
+    }
+
+    // drop the activation's reference last, the stage may be disconnected
+    // and destroyed right after
+    runStage->releaseEvent();
+    return taken;
+}
+
 
+//! Handle one event of a stage
+void
+Threadpool::runEvent(Stage* runStage, StageEvent* event)
+{
+    if (prepareEvent(runStage, event)) {
+        runStage->handleEvent(event);
+    }
+}
+
+
+//! Complete callbacks and timed out events
+/**
+ * @return true if the event is left to be handled by the stage
+ */
+bool
+Threadpool::prepareEvent(Stage* runStage, StageEvent* event)
+{
+    // need to check if this is a rescheduled callback
+    if (event->isCallback()) {
 #ifdef ENABLE_STAGE_LEVEL_TIMEOUT
-            // check if the event has timed out
-            if (event->hasTimedOut()) {
-                event->done();
-            } else {
-                runStage->handleEvent(event);
-            }
+        // check if the event has timed out.
+        if (event->hasTimedOut()) {
+            event->doneTimeout();
+        } else {
+            event->doneImmediate();
+        }
 #else
-            runStage->handleEvent(event);
+        event->doneImmediate();
 #endif
-        }
-        runStage->releaseEvent();
+        return false;
     }
-    LOG_TRACE("exit %p", poolPtr);
-    LOG_INFO("threadid = %d, threadname = %s",
-                 threadid, poolP->getName().c_str());
 
-    // the dummy compiler need this
-    pthread_exit(NULL);
+    if (eventhist) { 
+        event->saveStage(runStage, StageEvent::HANDLE_EV); 
+    }
+
+#ifdef ENABLE_STAGE_LEVEL_TIMEOUT
+    // check if the event has timed out
+    if (event->hasTimedOut()) {
+        event->done();
+        return false;
+    }
+#endif
+    return true;
 }
 
 
@@ -361,13 +821,13 @@ Threadpool::delPoolKey()
 }
 
 void
-Threadpool::setThreadPoolPtr(const Threadpool* thdPool)
+Threadpool::setWorker(Worker* worker)
 {
-    pthread_setspecific(poolPtrKey, thdPool);
+    pthread_setspecific(poolPtrKey, worker);
 }
 
-const Threadpool*
-Threadpool::getThreadPoolPtr()
+Threadpool::Worker*
+Threadpool::getWorker()
 {
-    return (const Threadpool*)pthread_getspecific(poolPtrKey);
+    return (Worker*)pthread_getspecific(poolPtrKey);
 }
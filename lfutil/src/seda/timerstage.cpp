@@ -17,11 +17,21 @@
 #include <string.h>
 #include <time.h>
 #include <memory>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "os/mutex.h"
 #include "trace/log.h"
+#include "conf/ini.h"
+#include "lang/lstring.h"
 #include "seda/timerstage.h"
 
+#define DEFAULT_TIMER_RESOLUTION    100     // usec
+
 #define TIMEVAL_EQUAL(t1, t2) \
       ((t1.tv_sec == t2.tv_sec) && (t1.tv_usec == t2.tv_usec))
 #define TIMEVAL_LESS_THAN(t1, t2) \
@@ -94,28 +104,35 @@ TimerToken::TimerToken()
     struct timeval t;
     memset(&t, 0, sizeof(struct timeval));
     u64_t n = nextNonce();
-    set(t, n);
+    set(t, n, 0);
     return;
 }
 
 TimerToken::TimerToken(const struct timeval& t)
 {
     u64_t n = nextNonce();
-    set(t, n);
+    set(t, n, 0);
+    return;
+}
+
+TimerToken::TimerToken(const struct timeval& t, u64_t n, u32_t s)
+{
+    set(t, n, s);
     return;
 }
 
 TimerToken::TimerToken(const TimerToken& tt)
 {
-    set(tt.time, tt.nonce);
+    set(tt.time, tt.nonce, tt.shard);
     return;
 }
 
 void
-TimerToken::set(const struct timeval& t, u64_t n)
+TimerToken::set(const struct timeval& t, u64_t n, u32_t s)
 {
     memcpy(&time, &t, sizeof(struct timeval));
     nonce = n;
+    shard = s;
     return;
 }
 
@@ -131,20 +148,27 @@ TimerToken::getNonce() const
     return nonce;
 }
 
+u32_t
+TimerToken::getShard() const
+{
+    return shard;
+}
+
 bool
 TimerToken::operator<(const TimerToken& other) const
 {
     if (TIMEVAL_LESS_THAN(time, other.time))
         return true;
     if (TIMEVAL_EQUAL(time, other.time))
-        return (nonce < other.nonce);
+        return (nonce < other.nonce) ||
+               ((nonce == other.nonce) && (shard < other.shard));
     return false;
 }
 
 TimerToken&
 TimerToken::operator=(const TimerToken& src)
 {
-    set(src.time, src.nonce);
+    set(src.time, src.nonce, src.shard);
     return *this;
 }
 
@@ -153,7 +177,7 @@ TimerToken::toString() const
 {
     std::string s;
     std::ostringstream ss(s);
-    ss << time.tv_sec << ":" << time.tv_usec << "-" << nonce;
+    ss << time.tv_sec << ":" << time.tv_usec << "-" << shard << "." << nonce;
     return ss.str();
 }
 
@@ -261,34 +285,83 @@ TimerCancelEvent::getSuccess()
     return cancelled;
 }
 
+/**
+ *  \brief The timers armed by a thread, or by a few threads once there
+ *  are more than \c TIMER_MAX_SHARDS.
+ *
+ *  The lock is taken by the threads arming and cancelling timers of
+ *  the shard and by the timer thread, it is hardly ever contended.
+ */
+class TimerStage::TimerShard
+{
+public:
+    TimerShard(u32_t i, u32_t res, u64_t now) :
+        wheel(res, now),
+        index(i)
+    {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~TimerShard()
+    {
+        pthread_mutex_destroy(&mutex);
+    }
+
+    pthread_mutex_t mutex;
+    TimerWheel wheel;
+    u32_t index;
+};
+
 TimerStage::TimerStage(const char* tag) :
     Stage(tag),
-    timer_queue(&TimerStage::timerTokenLessThan),
+    shard_seq(0),
+    resolution(DEFAULT_TIMER_RESOLUTION),
+    sleep_until(TIMERWHEEL_NEVER),
+    timer_fd(-1),
+    wake_fd(-1),
+    epoll_fd(-1),
     shutdown(false),
     num_events(0),
     timer_thread_id(0)
 {
-    pthread_mutex_init(&timer_mutex, NULL);
-    pthread_condattr_t condattr;
-    pthread_condattr_init(&condattr);
-    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
-    pthread_cond_init(&timer_condv, &condattr);
-    pthread_condattr_destroy(&condattr);
+    for (int i = 0; i < TIMER_MAX_SHARDS; ++i)
+    {
+        shards[i] = NULL;
+    }
+    pthread_key_create(&shard_key, NULL);
+
+    dispatch_table.addHandler<TimerRegisterEvent,
+                              &TimerStage::registerTimer>();
+    dispatch_table.addHandler<TimerCancelEvent, &TimerStage::cancelTimer>();
     return;
 }
 
 TimerStage::~TimerStage()
 {
-    for (timer_queue_t::iterator i = timer_queue.begin();
-         i != timer_queue.end(); ++i)
+    std::vector<StageEvent*> pending;
+    for (int i = 0; i < TIMER_MAX_SHARDS; ++i)
+    {
+        if (shards[i] == NULL)
+            continue;
+
+        shards[i]->wheel.drain(pending);
+        delete shards[i];
+        shards[i] = NULL;
+    }
+    for (size_t i = 0; i < pending.size(); ++i)
     {
-        delete i->second;
+        delete pending[i];
     }
+    pthread_key_delete(shard_key);
     
     num_events = 0;
 
-    pthread_mutex_destroy(&timer_mutex);
-    pthread_cond_destroy(&timer_condv);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (wake_fd >= 0)
+        close(wake_fd);
+    if (timer_fd >= 0)
+        close(timer_fd);
 
     return;
 }
@@ -311,7 +384,19 @@ TimerStage::makeStage(const std::string& tag)
 bool
 TimerStage::setProperties()
 {
-    // No configuration is stored in the system properties.
+    std::string resStr =
+        theGlobalProperties()->get("TimerResolution", "", stageName);
+    if (resStr.empty() == false)
+    {
+        CLstring::strToVal(resStr, resolution);
+        if (resolution == 0)
+        {
+            LOG_ERROR("invalid TimerResolution: %s\n", resStr.c_str());
+            return false;
+        }
+    }
+    LOG_INFO("timer resolution %u usec\n", resolution);
+
     return true;
 }
 
@@ -321,6 +406,31 @@ TimerStage::initialize()
     // The TimerStage does not send messages to any other stage.
     ASSERT(nextStageList.size() == 0, "Invalid NextStages list.");
 
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd = epoll_create(2);
+    if (timer_fd < 0 || wake_fd < 0 || epoll_fd < 0)
+    {
+        LOG_ERROR("failed to create timer fds: %d:%s\n",
+                  errno, strerror(errno));
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd;
+    int rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    ev.data.fd = wake_fd;
+    if (rc == 0)
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    if (rc != 0)
+    {
+        LOG_ERROR("failed to add timer fds to epoll: %d:%s\n",
+                  errno, strerror(errno));
+        return false;
+    }
+
     // Start the thread to maintain the timer
     const pthread_attr_t* thread_attrs = NULL;
     void* thread_args = (void*) this;
@@ -342,10 +452,10 @@ void
 TimerStage::disconnectPrepare()
 {
     LOG_INFO("received signal to initiate shutdown.\n");
-    pthread_mutex_lock(&timer_mutex);
     shutdown = true;
-    pthread_cond_signal(&timer_condv);
-    pthread_mutex_unlock(&timer_mutex);
+    u64_t one = 1;
+    ssize_t n = write(wake_fd, &one, sizeof(one));
+    (void) n;
 
     LOG_TRACE("waiting for timer maintenance thread to terminate.\n");
     void** return_val_ptr = NULL;
@@ -359,28 +469,10 @@ TimerStage::disconnectPrepare()
 void
 TimerStage::handleEvent(StageEvent* event)
 {
-    TimerEvent* e = dynamic_cast<TimerEvent*>(event);
-    if (e == NULL)
+    if (dispatch_table.handle(this, event) == false)
     {
-        LOG_WARN("received event of unexpected type: typeid=%s\n",
-                     typeid(*event).name());
-        return; // !!! EARLY EXIT !!!
-    }
-
-    TimerRegisterEvent* register_ev =
-        dynamic_cast<TimerRegisterEvent*>(event);
-    if (register_ev != NULL)
-    {
-        registerTimer(*register_ev);
-        return; // !!! EARLY EXIT !!!
-    }
-
-    TimerCancelEvent* cancel_ev =
-        dynamic_cast<TimerCancelEvent*>(event);
-    if (cancel_ev != NULL)
-    {
-        cancelTimer(*cancel_ev);
-        return; // !!! EARLY EXIT !!!
+        LOG_WARN("received event of unexpected type: type=%s\n",
+                     event->typeTag().getName());
     }
 
     return;
@@ -393,73 +485,148 @@ TimerStage::callbackEvent(StageEvent* e, CallbackContext* ctx)
 }
 
 void
-TimerStage::registerTimer(TimerRegisterEvent& reg_ev)
+TimerStage::registerTimer(TimerRegisterEvent* reg_ev)
 {
-    const TimerToken tt(reg_ev.getTime());
+    const TimerToken tt = scheduleAt(reg_ev->adoptCallbackEvent(),
+                                     reg_ev->getTime());
 
-    LOG_TRACE("registering event: token=%s\n", tt.toString().c_str());
+    LOG_TRACE("registered event: token=%s\n", tt.toString().c_str());
 
-    bool check_timer = false;
-    pthread_mutex_lock(&timer_mutex);
+    reg_ev->setCancelToken(tt);
+    reg_ev->done();
 
-    // add the event to the timer queue
-    StageEvent* timer_cb = reg_ev.adoptCallbackEvent();
-    std::pair<timer_queue_t::iterator, bool> result =
-        timer_queue.insert(std::make_pair(tt, timer_cb));
-    ASSERT(result.second, "Internal error--"
-           "failed to register timer because token is not unique.");
-    ++num_events;
-
-    // if event was added to the head of queue, schedule a timer check
-    if (result.first == timer_queue.begin())
-        check_timer = true;
+    return;
+}
 
-    pthread_mutex_unlock(&timer_mutex);
+void
+TimerStage::cancelTimer(TimerCancelEvent* cancel_ev)
+{
+    bool success = cancel(cancel_ev->getToken());
 
-    reg_ev.setCancelToken(tt);
-    reg_ev.done();
+    LOG_DEBUG("cancelling event: token=%s, success=%d\n",
+                  cancel_ev->getToken().toString().c_str(), (int) success);
 
-    if (check_timer)
-        triggerTimerCheck();
+    cancel_ev->setSuccess(success);
+    cancel_ev->done();
 
     return;
 }
 
-void
-TimerStage::cancelTimer(TimerCancelEvent& cancel_ev)
+TimerToken
+TimerStage::schedule(StageEvent* cb, u64_t time_relative_usec)
 {
-    pthread_mutex_lock(&timer_mutex);
-    bool success = false;
-    timer_queue_t::iterator it = timer_queue.find(cancel_ev.getToken());
-    if (it != timer_queue.end())
-    {
-        success = true;
+    u64_t deadline = monotonicUsec() + time_relative_usec;
 
-        // delete the canceled timer event
-        delete it->second;
+    struct timeval when;
+    when.tv_sec = deadline / USEC_PER_SEC;
+    when.tv_usec = deadline % USEC_PER_SEC;
 
-        timer_queue.erase(it);
-        --num_events;
-    }
-    pthread_mutex_unlock(&timer_mutex);
+    return scheduleAt(cb, when);
+}
 
-    LOG_DEBUG("cancelling event: token=%s, success=%d\n",
-                  cancel_ev.getToken().toString().c_str(), (int) success);
+TimerToken
+TimerStage::schedule(StageEvent* cb, struct timeval& time_absolute)
+{
+    struct timeval when;
+    realtimeToMonotonic(&time_absolute, &when);
 
-    cancel_ev.setSuccess(success);
-    cancel_ev.done();
+    return scheduleAt(cb, when);
+}
 
-    return;
+bool
+TimerStage::cancel(const TimerToken& token)
+{
+    u32_t index = token.getShard();
+    TimerShard* shard = (index < TIMER_MAX_SHARDS) ? shards[index] : NULL;
+    if (shard == NULL)
+        return false;
+
+    pthread_mutex_lock(&shard->mutex);
+    StageEvent* timer_cb = shard->wheel.cancel(token.getNonce());
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (timer_cb == NULL)
+        return false;
+
+    // delete the canceled timer event
+    __sync_fetch_and_sub(&num_events, 1);
+    delete timer_cb;
+
+    return true;
 }
 
-void
-TimerStage::triggerTimerCheck()
+//! Add a timer to the shard of the calling thread, when is monotonic
+TimerToken
+TimerStage::scheduleAt(StageEvent* cb, const struct timeval& when)
 {
-    LOG_TRACE("signaling timer thread to complete timer check\n");
+    u64_t deadline = (u64_t)when.tv_sec * USEC_PER_SEC + when.tv_usec;
+    TimerShard* shard = threadShard();
 
-    pthread_mutex_lock(&timer_mutex);
-    pthread_cond_signal(&timer_condv);
-    pthread_mutex_unlock(&timer_mutex);
+    __sync_fetch_and_add(&num_events, 1);
+
+    pthread_mutex_lock(&shard->mutex);
+    u64_t id = shard->wheel.add(cb, deadline);
+    pthread_mutex_unlock(&shard->mutex);
+    ASSERT(id != 0, "Internal error--failed to register timer.");
+
+    // wake the timer thread if it sleeps past the new deadline, the
+    // shard lock orders the read after a sweep which missed the timer
+    if (deadline < sleep_until)
+        wakeTimer(deadline);
+
+    return TimerToken(when, id, shard->index);
+}
+
+TimerStage::TimerShard*
+TimerStage::threadShard()
+{
+    TimerShard* shard = (TimerShard*) pthread_getspecific(shard_key);
+    if (shard)
+        return shard;
+
+    u32_t seq = __sync_fetch_and_add(&shard_seq, 1);
+    u32_t index = seq % TIMER_MAX_SHARDS;
+    if (seq < TIMER_MAX_SHARDS)
+    {
+        shard = new TimerShard(index, resolution, monotonicUsec());
+        ASSERT(shard != NULL, "Failed to allocate timer shard.");
+        __sync_bool_compare_and_swap(&shards[index], (TimerShard*) NULL,
+                                     shard);
+        LOG_DEBUG("created timer shard %u\n", index);
+    }
+    else
+    {
+        // share a shard, it may be being published by its first thread
+        while ((shard = shards[index]) == NULL)
+            sched_yield();
+    }
+
+    pthread_setspecific(shard_key, shard);
+    return shard;
+}
+
+//! Let the timer thread sleep no later than deadline
+void
+TimerStage::wakeTimer(u64_t deadline)
+{
+    u64_t cur = sleep_until;
+    while (deadline < cur)
+    {
+        u64_t prev = __sync_val_compare_and_swap(&sleep_until, cur, deadline);
+        if (prev == cur)
+        {
+            // whoever lowers sleep_until wakes the thread to rearm
+            LOG_TRACE("signaling timer thread to complete timer check\n");
+            if (wake_fd >= 0)
+            {
+                u64_t one = 1;
+                ssize_t n = write(wake_fd, &one, sizeof(one));
+                (void) n;
+            }
+            return;
+        }
+        cur = prev;
+    }
 
     return;
 }
@@ -473,89 +640,162 @@ TimerStage::startTimerThread(void* arg)
     return NULL;
 }
 
+u64_t
+TimerStage::monotonicUsec()
+{
+    struct timespec ts_now;
+    clock_gettime(CLOCK_MONOTONIC, &ts_now);
+    return (u64_t)ts_now.tv_sec * USEC_PER_SEC + ts_now.tv_nsec / NSEC_PER_USEC;
+}
+
 void
 TimerStage::checkTimer()
 {
-    pthread_mutex_lock(&timer_mutex);    
+    std::vector<StageEvent*> done_events;
 
-    while (true)
+    while (shutdown == false)
     {
-        struct timespec ts_now;
-        clock_gettime(CLOCK_MONOTONIC, &ts_now);
-    
-        struct timeval now;
-        now.tv_sec = ts_now.tv_sec;
-        now.tv_usec = ts_now.tv_nsec/NSEC_PER_USEC;
-
-        LOG_TRACE("checking timer: sec=%ld, usec=%ld\n", 
-                      now.tv_sec, now.tv_usec);
-
-        // Trigger all events for which the trigger time has already passed.
-        timer_queue_t::iterator first = timer_queue.begin();
-        timer_queue_t::iterator last;
-        std::list<StageEvent*> done_events;
-        for (last = first; last != timer_queue.end(); ++last)
-        {
-            if (TIMEVAL_LESS_THAN(now, last->first.getTime()))
-                break;
-            done_events.push_back(last->second);
-        }
-        timer_queue.erase(first, last);
-        if (! done_events.empty())
+        // Timers armed from here on lower sleep_until and wake the
+        // thread, the exchange orders this before the shard locks.
+        __sync_lock_test_and_set(&sleep_until, TIMERWHEEL_NEVER);
+
+        u64_t now = monotonicUsec();
+        u64_t next = TIMERWHEEL_NEVER;
+
+        LOG_TRACE("checking timer: usec=%llu\n", now);
+
+        // Take all events for which the trigger time has already passed.
+        for (int i = 0; i < TIMER_MAX_SHARDS; ++i)
         {
-            // It is ok to hold the mutex while executing this loop.
-            // Triggering the events only enqueues the event on the
-            // caller's queue--it does not perform any real work.
-            for (std::list<StageEvent*>::iterator i =
-                     done_events.begin();
-                 i != done_events.end(); ++i)
-            {
-                LOG_TRACE("triggering timer event: sec=%ld, usec=%ld, typeid=%s\n",
-                              now.tv_sec, now.tv_usec, typeid(**i).name());
-                (*i)->done();
-                --num_events;
-            }
+            TimerShard* shard = shards[i];
+            if (shard == NULL)
+                continue;
+
+            pthread_mutex_lock(&shard->mutex);
+            shard->wheel.expire(now, done_events);
+            u64_t shard_next = shard->wheel.nextExpiry();
+            pthread_mutex_unlock(&shard->mutex);
+
+            if (shard_next < next)
+                next = shard_next;
         }
-        done_events.clear();
 
-        // Check if the 'shutdown' signal has been received.  The
-        // stage must not release the mutex between this check and the
-        // call to wait on the condition variable.
-        if (shutdown)
+        if (done_events.empty() == false)
         {
-            LOG_INFO("received shutdown signal, abandoning timer maintenance\n");
-            break; // !!! EARLY EXIT !!!
+            __sync_fetch_and_sub(&num_events, (u32_t) done_events.size());
+            dispatchExpired(done_events);
+            done_events.clear();
         }
 
-        // Sleep until the next service interval.
-        first = timer_queue.begin();
-        if (first == timer_queue.end())
+        // Sleep until the next service interval, or earlier if a timer
+        // armed since the sweep has lowered sleep_until.
+        u64_t cur = sleep_until;
+        while (true)
         {
-            // If no timer events are registered, sleep indefinately.
-            // (When new events are registered, the condition variable
-            // will be signalled to allow service to resume.)
-            LOG_TRACE("sleeping indefinately\n");
-            pthread_cond_wait(&timer_condv, &timer_mutex);
+            u64_t want = (cur < next) ? cur : next;
+            u64_t prev = __sync_val_compare_and_swap(&sleep_until, cur, want);
+            if (prev == cur)
+            {
+                next = want;
+                break;
+            }
+            cur = prev;
         }
-        else
+
+        if (waitTimer(next) == false)
+            break;
+    }
+
+    LOG_INFO("received shutdown signal, abandoning timer maintenance\n");
+
+    return;
+}
+
+//! Hand expired events to the stages of their callbacks
+/**
+ *  Events going to the same stage are added in one batch, which takes
+ *  one exchange on the queue of the stage and one pass on the run queue.
+ */
+void
+TimerStage::dispatchExpired(std::vector<StageEvent*>& expired)
+{
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        LOG_TRACE("triggering timer event: type=%s\n",
+                      expired[i]->typeTag().getName());
+
+        Stage* target = expired[i]->doneTarget();
+        if (target == NULL)
+            continue;
+
+        size_t b = 0;
+        while (b < batches.size() && batches[b].stage != target)
+            ++b;
+        if (b == batches.size())
         {
-            // If timer events are registered, sleep until the first
-            // event should be triggered.
-            struct timespec ts;
-            ts.tv_sec = first->first.getTime().tv_sec;
-            ts.tv_nsec = first->first.getTime().tv_usec * NSEC_PER_USEC;
-
-            LOG_TRACE("sleeping until next deadline: sec=%ld, nsec=%ld\n",
-                ts.tv_sec, ts.tv_nsec);
-            pthread_cond_timedwait(&timer_condv, &timer_mutex, &ts);
+            batches.push_back(TimerBatch());
+            batches[b].stage = target;
         }
+        batches[b].events.push_back(expired[i]);
     }
 
-    pthread_mutex_unlock(&timer_mutex);
+    for (size_t b = 0; b < batches.size(); ++b)
+    {
+        std::vector<StageEvent*>& events = batches[b].events;
+        if (events.empty())
+            continue;
+
+        batches[b].stage->addEvents(&events[0], events.size());
+        events.clear();
+    }
 
     return;
 }
 
+//! Sleep until deadline, or until woken up
+/**
+ *  \return
+ *    \c false if the stage shuts down
+ */
+bool
+TimerStage::waitTimer(u64_t deadline)
+{
+    // A zero it_value disarms the timer
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline != TIMERWHEEL_NEVER)
+    {
+        its.it_value.tv_sec = deadline / USEC_PER_SEC;
+        its.it_value.tv_nsec = (deadline % USEC_PER_SEC) * NSEC_PER_USEC;
+        LOG_TRACE("sleeping until next deadline: sec=%ld, nsec=%ld\n",
+            its.it_value.tv_sec, its.it_value.tv_nsec);
+    }
+    else
+    {
+        // If no timer events are registered, sleep indefinately.
+        // (When new events are registered, the eventfd will be
+        // written to allow service to resume.)
+        LOG_TRACE("sleeping indefinately\n");
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    struct epoll_event events[2];
+    int nfds = epoll_wait(epoll_fd, events, 2, -1);
+    for (int i = 0; i < nfds; ++i)
+    {
+        // both fds hold a counter, reading it clears the readiness
+        u64_t counter;
+        ssize_t n = read(events[i].data.fd, &counter, sizeof(counter));
+        (void) n;
+    }
+    if (nfds < 0 && errno != EINTR)
+    {
+        LOG_ERROR("timer epoll_wait failed: %d:%s\n", errno, strerror(errno));
+    }
+
+    return (shutdown == false);
+}
+
 bool
 TimerStage::timerTokenLessThan(const TimerToken& tt1, const TimerToken& tt2)
 {
@@ -0,0 +1,320 @@
+// __CR__
+// Copyright (c) 2008-2010 Longda Corporation
+// All Rights Reserved
+//
+// This software contains the intellectual property of Longda Corporation
+// or is licensed to Longda Corporation from third parties.  Use of this
+// software and the intellectual property contained therein is expressly
+// limited to the terms and conditions of the License Agreement under which
+// it is provided by or on behalf of Longda.
+// __CR__
+
+
+// Include Files
+#include "trace/log.h"
+#include "seda/timerwheel.h"
+
+/**
+ * @author Longda
+ * @date   10/18/26
+ *
+ * Implementation of TimerWheel class.
+ */
+
+#define ROOT_MASK   (TIMERWHEEL_ROOT_SIZE - 1)
+#define LEVEL_MASK  (TIMERWHEEL_LEVEL_SIZE - 1)
+
+//! Shift of the tick bits which index a wheel, level 0 is the root
+#define LEVEL_SHIFT(level) \
+    (TIMERWHEEL_ROOT_BITS + ((level) - 1) * TIMERWHEEL_LEVEL_BITS)
+
+//! First slot of a wheel outside the root
+#define LEVEL_BASE(level) \
+    (TIMERWHEEL_ROOT_SIZE + ((level) - 1) * TIMERWHEEL_LEVEL_SIZE)
+
+
+TimerWheel::TimerWheel(u32_t res, u64_t now) :
+    chunks(),
+    freeNodes(NULL),
+    nodeCount(0),
+    curTick(0),
+    count(0),
+    resolution(res ? res : 1)
+{
+    for (int i = 0; i < TIMERWHEEL_SLOTS; i++) {
+        slots[i].prev = slots[i].next = &slots[i];
+    }
+    for (int i = 0; i < TIMERWHEEL_ROOT_SIZE / 64; i++) {
+        rootBits[i] = 0;
+    }
+    curTick = now / resolution;
+}
+
+
+TimerWheel::~TimerWheel()
+{
+    for (size_t i = 0; i < chunks.size(); i++) {
+        delete [] chunks[i];
+    }
+}
+
+
+u64_t
+TimerWheel::add(StageEvent* event, u64_t deadline)
+{
+    Node* node = allocNode();
+    if (node == NULL) {
+        LOG_ERROR("No memory for timer node");
+        return 0;
+    }
+
+    // the first tick not before the deadline
+    node->event   = event;
+    node->expires = (deadline + resolution - 1) / resolution;
+    link(node);
+    count++;
+
+    return ((u64_t)node->gen << 32) | node->index;
+}
+
+
+StageEvent*
+TimerWheel::cancel(u64_t id)
+{
+    u32_t index = (u32_t)id;
+    if (index >= nodeCount) {
+        return NULL;
+    }
+
+    Node* node = chunks[index / TIMERWHEEL_CHUNK_SIZE] +
+                 index % TIMERWHEEL_CHUNK_SIZE;
+    if (node->gen != (u32_t)(id >> 32) || node->event == NULL) {
+        return NULL;
+    }
+
+    StageEvent* event = node->event;
+    unlink(node);
+    freeNode(node);
+    count--;
+
+    return event;
+}
+
+
+void
+TimerWheel::expire(u64_t now, std::vector<StageEvent*>& expired)
+{
+    u64_t nowTick = now / resolution;
+
+    while (curTick <= nowTick) {
+        if (count == 0) {
+            curTick = nowTick + 1;
+            break;
+        }
+
+        u32_t idx = curTick & ROOT_MASK;
+        if (idx == 0) {
+            // the root wheel turns, bring in the next slot of the wheel
+            // outside, and of the next one as far as they turn too
+            for (int level = 1; level < TIMERWHEEL_LEVELS; level++) {
+                u32_t li = (curTick >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+                cascade(level, li);
+                if (li != 0) {
+                    break;
+                }
+            }
+        }
+        else if (rootEmptyFrom(idx)) {
+            // nothing expires before the root wheel turns
+            u64_t turn = (curTick | ROOT_MASK) + 1;
+            curTick = (turn <= nowTick) ? turn : nowTick + 1;
+            continue;
+        }
+        curTick++;
+
+        Node* head = &slots[idx];
+        Node* node = head->next;
+        while (node != head) {
+            Node* next = node->next;
+            expired.push_back(node->event);
+            freeNode(node);
+            count--;
+            node = next;
+        }
+        head->prev = head->next = head;
+        rootBits[idx >> 6] &= ~((u64_t)1 << (idx & 63));
+    }
+}
+
+
+u64_t
+TimerWheel::nextExpiry() const
+{
+    if (count == 0) {
+        return TIMERWHEEL_NEVER;
+    }
+
+    u32_t idx  = curTick & ROOT_MASK;
+    if (idx == 0) {
+        // the outer wheels cascade on this tick and may bring in a timer
+        // earlier than any in the root wheel
+        return curTick * resolution;
+    }
+
+    u32_t word = idx >> 6;
+    u64_t bits = rootBits[word] & (~(u64_t)0 << (idx & 63));
+    while (bits == 0 && ++word < TIMERWHEEL_ROOT_SIZE / 64) {
+        bits = rootBits[word];
+    }
+    if (bits) {
+        u32_t pos = word * 64 + __builtin_ctzll(bits);
+        return (curTick + (pos - idx)) * resolution;
+    }
+
+    // the earliest timer is in an outer wheel, it is known once the root
+    // wheel turns
+    return ((curTick | ROOT_MASK) + 1) * resolution;
+}
+
+
+void
+TimerWheel::drain(std::vector<StageEvent*>& events)
+{
+    for (int i = 0; i < TIMERWHEEL_SLOTS; i++) {
+        Node* head = &slots[i];
+        Node* node = head->next;
+        while (node != head) {
+            Node* next = node->next;
+            events.push_back(node->event);
+            freeNode(node);
+            node = next;
+        }
+        head->prev = head->next = head;
+    }
+    for (int i = 0; i < TIMERWHEEL_ROOT_SIZE / 64; i++) {
+        rootBits[i] = 0;
+    }
+    count = 0;
+}
+
+
+//! Link node in the slot of its expiry tick
+void
+TimerWheel::link(Node* node)
+{
+    u64_t expires = node->expires;
+    if (expires < curTick) {
+        expires = curTick;
+    }
+    u64_t delta = expires - curTick;
+
+    u32_t slot;
+    if (delta < TIMERWHEEL_ROOT_SIZE) {
+        slot = expires & ROOT_MASK;
+        rootBits[slot >> 6] |= (u64_t)1 << (slot & 63);
+    }
+    else {
+        int level = 1;
+        while (level < TIMERWHEEL_LEVELS - 1 &&
+               delta >= ((u64_t)1 << LEVEL_SHIFT(level + 1))) {
+            level++;
+        }
+        if (delta >= ((u64_t)1 << LEVEL_SHIFT(level + 1))) {
+            // out of range, wait in the last slot of the outermost wheel
+            expires = curTick + ((u64_t)1 << LEVEL_SHIFT(level + 1)) - 1;
+        }
+        slot = LEVEL_BASE(level) + ((expires >> LEVEL_SHIFT(level)) & LEVEL_MASK);
+    }
+
+    Node* head = &slots[slot];
+    node->slot = slot;
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+
+void
+TimerWheel::unlink(Node* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+
+    u32_t slot = node->slot;
+    if (slot < TIMERWHEEL_ROOT_SIZE && slots[slot].next == &slots[slot]) {
+        rootBits[slot >> 6] &= ~((u64_t)1 << (slot & 63));
+    }
+}
+
+
+//! Move the timers of a slot of an outer wheel inwards
+void
+TimerWheel::cascade(int level, u32_t idx)
+{
+    Node* head = &slots[LEVEL_BASE(level) + idx];
+    Node* node = head->next;
+    head->prev = head->next = head;
+
+    while (node != head) {
+        Node* next = node->next;
+        link(node);
+        node = next;
+    }
+}
+
+
+//! Whether the root slots from idx to the end are all empty
+bool
+TimerWheel::rootEmptyFrom(u32_t idx) const
+{
+    u32_t word = idx >> 6;
+    if (rootBits[word] & (~(u64_t)0 << (idx & 63))) {
+        return false;
+    }
+    for (word++; word < TIMERWHEEL_ROOT_SIZE / 64; word++) {
+        if (rootBits[word]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+TimerWheel::Node*
+TimerWheel::allocNode()
+{
+    Node* node = freeNodes;
+    if (node) {
+        freeNodes = node->next;
+        return node;
+    }
+
+    u32_t offset = nodeCount % TIMERWHEEL_CHUNK_SIZE;
+    if (offset == 0) {
+        Node* chunk = new Node[TIMERWHEEL_CHUNK_SIZE];
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunks.push_back(chunk);
+    }
+
+    node = chunks.back() + offset;
+    node->index = nodeCount++;
+    node->gen   = 1;
+    node->event = NULL;
+    return node;
+}
+
+
+void
+TimerWheel::freeNode(Node* node)
+{
+    // stale ids of the node no longer match, 0 is never a valid id
+    if (++node->gen == 0) {
+        node->gen = 1;
+    }
+    node->event = NULL;
+    node->next  = freeNodes;
+    freeNodes   = node;
+}
@@ -15,6 +15,8 @@
 #include "time/timeoutinfo.h"
 
 
+CLOBJPOOL_DEFINE(TimeoutInfo, "TimeoutInfo")
+
 TimeoutInfo::TimeoutInfo(time_t deadLine):
     deadline(deadLine),
     isTimedOut(false),
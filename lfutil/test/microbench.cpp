@@ -0,0 +1,1078 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+/*
+ * microbench.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "conf/ini.h"
+#include "lang/lstring.h"
+#include "time/datetime.h"
+#include "trace/log.h"
+#include "mm/lbufpool.h"
+#include "os/lcpuset.h"
+#include "os/mutex.h"
+
+#include "net/conn.h"
+#include "seda/callback.h"
+#include "seda/sedaconfig.h"
+#include "seda/dispatchtable.h"
+#include "seda/eventqueue.h"
+#include "seda/stageevent.h"
+#include "seda/stage.h"
+#include "seda/threadpool.h"
+#include "seda/timerstage.h"
+#include "seda/timerwheel.h"
+
+#include "microbench.h"
+
+const char MICRO_BENCH_SECTION[] = "MicroBench";
+
+typedef struct _BenchParam
+{
+    Conn   *conn;
+    u64_t   iterations;
+} BenchParam;
+
+static u64_t getBenchValue(std::map<std::string, std::string> &section,
+        const char *key, u64_t defValue)
+{
+    std::map<std::string, std::string>::iterator it = section.find(key);
+    if (it == section.end())
+    {
+        return defValue;
+    }
+
+    u64_t value = defValue;
+    CLstring::strToVal(it->second, value);
+    return value;
+}
+
+//! Run func in threads threads and return the elapsed usec
+static s64_t runBenchThreads(void *(*func)(void *), void *arg, int threads)
+{
+    std::vector<pthread_t> tids(threads);
+
+    s64_t start = Now::usec();
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&tids[i], NULL, func, arg);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+
+    return Now::usec() - start;
+}
+
+/**
+ * The Conn bookkeeping done for every received message: look up the
+ * connection, check its state while the header and the body are read,
+ * then drop the reference
+ */
+static void *connMessageLoop(void *arg)
+{
+    BenchParam *param = (BenchParam *)arg;
+    Conn       *conn  = param->conn;
+
+    for (u64_t i = 0; i < param->iterations; i++)
+    {
+        if (conn->tryAcquire() == false)
+        {
+            break;
+        }
+
+        if (conn->getState() == Conn::CONN_READY &&
+            conn->getNextRecv() == Conn::HEADER)
+        {
+            conn->setNextRecv(Conn::MESSAGE);
+        }
+        if (conn->getNextRecv() == Conn::MESSAGE)
+        {
+            conn->setNextRecv(Conn::HEADER);
+        }
+
+        conn->release();
+    }
+
+    return NULL;
+}
+
+static void benchConnMessage(u64_t iterations, int threads)
+{
+    Conn *conn = new Conn();
+    conn->setState(Conn::CONN_READY);
+
+    BenchParam param;
+    param.conn       = conn;
+    param.iterations = iterations;
+
+    s64_t usec = runBenchThreads(connMessageLoop, &param, threads);
+
+    ASSERT(conn->isIdle(), "Conn is still referenced");
+    delete conn;
+
+    u64_t total = iterations * threads;
+    LOG_INFO("MicroBench conn message: threads:%d, messages:%llu, "
+            "%.1f ns/msg", threads, total, usec * 1000.0 / total);
+}
+
+//! Events a thread holds at once in the allocation benchmark
+#define ALLOC_BENCH_WINDOW  16
+
+/**
+ * An event and its completion callback created and released, as for every
+ * request, taken from the object pools
+ */
+static void *poolAllocLoop(void *arg)
+{
+    BenchParam         *param = (BenchParam *)arg;
+    StageEvent         *events[ALLOC_BENCH_WINDOW];
+    CompletionCallback *callbacks[ALLOC_BENCH_WINDOW];
+
+    for (u64_t i = 0; i < param->iterations; i += ALLOC_BENCH_WINDOW)
+    {
+        for (int j = 0; j < ALLOC_BENCH_WINDOW; j++)
+        {
+            events[j] = new StageEvent();
+            callbacks[j] = new CompletionCallback(NULL, NULL);
+        }
+        for (int j = 0; j < ALLOC_BENCH_WINDOW; j++)
+        {
+            delete callbacks[j];
+            delete events[j];
+        }
+    }
+
+    return NULL;
+}
+
+//! The same objects taken from the heap by the global operator new
+static void *heapAllocLoop(void *arg)
+{
+    BenchParam         *param = (BenchParam *)arg;
+    StageEvent         *events[ALLOC_BENCH_WINDOW];
+    CompletionCallback *callbacks[ALLOC_BENCH_WINDOW];
+
+    for (u64_t i = 0; i < param->iterations; i += ALLOC_BENCH_WINDOW)
+    {
+        for (int j = 0; j < ALLOC_BENCH_WINDOW; j++)
+        {
+            events[j] = ::new StageEvent();
+            callbacks[j] = ::new CompletionCallback(NULL, NULL);
+        }
+        for (int j = 0; j < ALLOC_BENCH_WINDOW; j++)
+        {
+            ::delete callbacks[j];
+            ::delete events[j];
+        }
+    }
+
+    return NULL;
+}
+
+static void benchEventAlloc(const char *name, void *(*func)(void *),
+        u64_t iterations, int threads)
+{
+    BenchParam param;
+    param.conn       = NULL;
+    param.iterations = iterations;
+
+    s64_t usec = runBenchThreads(func, &param, threads);
+
+    u64_t total = iterations * threads;
+    LOG_INFO("MicroBench %s event alloc: threads:%d, events:%llu, "
+            "%.1f ns/event", name, threads, total, usec * 1000.0 / total);
+}
+
+//! Events of one producer, reused once the consumer has taken them
+#define QUEUE_BENCH_WINDOW  256
+
+class QueueBenchEvent : public StageEvent
+{
+public:
+    QueueBenchEvent() : queued(false) {}
+
+    volatile bool queued;
+};
+
+//! The mutex protected deque the stages used to queue events in
+class LockedEventQueue
+{
+public:
+    LockedEventQueue()  { MUTEX_INIT(&mutex, NULL); }
+    ~LockedEventQueue() { MUTEX_DESTROY(&mutex); }
+
+    void push(StageEvent *event)
+    {
+        MUTEX_LOCK(&mutex);
+        events.push_back(event);
+        MUTEX_UNLOCK(&mutex);
+    }
+
+    StageEvent *pop()
+    {
+        StageEvent *event = NULL;
+
+        MUTEX_LOCK(&mutex);
+        if (events.empty() == false)
+        {
+            event = events.front();
+            events.pop_front();
+        }
+        MUTEX_UNLOCK(&mutex);
+
+        return event;
+    }
+
+private:
+    pthread_mutex_t          mutex;
+    std::deque<StageEvent *> events;
+};
+
+template <class Queue>
+struct QueueBenchParam
+{
+    Queue   *queue;
+    u64_t    events;        //!< events per producer
+};
+
+template <class Queue>
+static void *queueProduceLoop(void *arg)
+{
+    QueueBenchParam<Queue> *param = (QueueBenchParam<Queue> *)arg;
+
+    QueueBenchEvent *window = new QueueBenchEvent[QUEUE_BENCH_WINDOW];
+    for (u64_t i = 0; i < param->events; i++)
+    {
+        QueueBenchEvent *event = &window[i % QUEUE_BENCH_WINDOW];
+        while (event->queued)
+        {
+            sched_yield();
+        }
+
+        event->queued = true;
+        param->queue->push(event);
+    }
+
+    // wait for the consumer before the window goes away
+    for (int i = 0; i < QUEUE_BENCH_WINDOW; i++)
+    {
+        while (window[i].queued)
+        {
+            sched_yield();
+        }
+    }
+    delete [] window;
+
+    return NULL;
+}
+
+template <class Queue>
+static void *queueConsumeLoop(void *arg)
+{
+    QueueBenchParam<Queue> *param = (QueueBenchParam<Queue> *)arg;
+
+    u64_t taken = 0;
+    while (taken < param->events)
+    {
+        QueueBenchEvent *event = (QueueBenchEvent *)param->queue->pop();
+        if (event == NULL)
+        {
+            sched_yield();
+            continue;
+        }
+
+        __sync_synchronize();
+        event->queued = false;
+        taken++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Producers fan in to the queue of one stage drained by a single thread,
+ * the way the next stage of CommStage is fed by the net threads
+ */
+template <class Queue>
+static void benchQueue(const char *name, u64_t iterations, int producers)
+{
+    Queue queue;
+
+    QueueBenchParam<Queue> produce;
+    produce.queue  = &queue;
+    produce.events = iterations / producers;
+
+    QueueBenchParam<Queue> consume;
+    consume.queue  = &queue;
+    consume.events = produce.events * producers;
+
+    pthread_t consumer;
+    s64_t     start = Now::usec();
+
+    pthread_create(&consumer, NULL, queueConsumeLoop<Queue>, &consume);
+    runBenchThreads(queueProduceLoop<Queue>, &produce, producers);
+    pthread_join(consumer, NULL);
+
+    s64_t usec = Now::usec() - start;
+
+    LOG_INFO("MicroBench %s queue: producers:%d, events:%llu, "
+            "%.1f ns/event", name, producers, consume.events,
+            usec * 1000.0 / consume.events);
+}
+
+//! Events bounce on this stage until the iterations are used up
+class PoolBenchStage : public Stage
+{
+public:
+    PoolBenchStage(u64_t iterations, bool cbs) :
+        Stage("PoolBenchStage"), remaining((s64_t)iterations), handled(0),
+        callbacks(cbs)
+    {
+    }
+
+    void handleEvent(StageEvent *event)
+    {
+        __sync_add_and_fetch(&handled, 1);
+
+        // every event goes through a callback of this stage first
+        if (callbacks)
+        {
+            CompletionCallback *cb = new CompletionCallback(this, NULL);
+            cb->setInline(true);
+            event->pushCallback(cb);
+            event->done();
+            return;
+        }
+
+        next(event);
+    }
+
+    void callbackEvent(StageEvent *event, CallbackContext *context)
+    {
+        next(event);
+    }
+
+    void next(StageEvent *event)
+    {
+        // rescheduled from a thread of the pool, so by its local queue
+        if (__sync_sub_and_fetch(&remaining, 1) >= 0)
+        {
+            addEvent(event);
+        }
+        else
+        {
+            delete event;
+        }
+    }
+
+    volatile s64_t remaining;
+    volatile u64_t handled;
+    bool           callbacks;
+};
+
+/**
+ * Several events circulate on one stage, each one handled by whichever
+ * thread of the pool gets it, the cost of the scheduling per event
+ */
+static void benchThreadpool(u64_t iterations, int threads, u32_t quantum,
+        u32_t depth, u32_t perThread, s32_t cbDepth)
+{
+    Threadpool      pool(threads, "MicroBench");
+    PoolBenchStage  stage(iterations, cbDepth >= 0);
+
+    pool.setInlineDepth(depth);
+    if (cbDepth >= 0)
+    {
+        pool.setCallbackDepth((u32_t)cbDepth);
+    }
+    stage.setBatch(quantum, 0);
+    stage.setPool(&pool);
+    stage.connect();
+
+    // every event is handled once more to find the iterations used up
+    u64_t events = (u64_t)threads * perThread;
+
+    s64_t start = Now::usec();
+    for (u64_t i = 0; i < events; i++)
+    {
+        stage.addEvent(new StageEvent());
+    }
+    while (stage.handled < iterations + events)
+    {
+        usleep(1000);
+    }
+    s64_t usec = Now::usec() - start;
+
+    stage.disconnect();
+
+    u64_t handled = stage.handled;
+    LOG_INFO("MicroBench threadpool: threads:%d, in flight:%llu, "
+            "quantum:%u, depth:%u, callback depth:%d, events:%llu, "
+            "%.1f ns/event",
+            threads, events, quantum, depth, cbDepth, handled,
+            usec * 1000.0 / handled);
+}
+
+//! Event classes of a stage, the way CTestStage gets four kinds of them
+#define DISPATCH_BENCH_EVENT(cls, parent)                               \
+class cls : public parent                                               \
+{                                                                       \
+    CLTYPETAG(cls, parent)                                              \
+};
+
+DISPATCH_BENCH_EVENT(DispatchEventA, StageEvent)
+DISPATCH_BENCH_EVENT(DispatchEventB, StageEvent)
+DISPATCH_BENCH_EVENT(DispatchEventC, StageEvent)
+DISPATCH_BENCH_EVENT(DispatchEventD, DispatchEventC)
+
+class DispatchBenchStage
+{
+public:
+    DispatchBenchStage()
+    {
+        memset(counts, 0, sizeof(counts));
+
+        table.addHandler<DispatchEventA, &DispatchBenchStage::handleA>();
+        table.addHandler<DispatchEventB, &DispatchBenchStage::handleB>();
+        table.addHandler<DispatchEventC, &DispatchBenchStage::handleC>();
+        table.addHandler<DispatchEventD, &DispatchBenchStage::handleD>();
+    }
+
+    void handleA(DispatchEventA *event) { counts[0]++; }
+    void handleB(DispatchEventB *event) { counts[1]++; }
+    void handleC(DispatchEventC *event) { counts[2]++; }
+    void handleD(DispatchEventD *event) { counts[3]++; }
+
+    //! The dynamic_cast chain the stages used to have in handleEvent
+    void castEvent(StageEvent *event)
+    {
+        DispatchEventA *a = NULL;
+        DispatchEventB *b = NULL;
+        DispatchEventC *c = NULL;
+        DispatchEventD *d = NULL;
+
+        if ((a = dynamic_cast<DispatchEventA *>(event)))
+        {
+            handleA(a);
+        }
+        else if ((b = dynamic_cast<DispatchEventB *>(event)))
+        {
+            handleB(b);
+        }
+        else if ((d = dynamic_cast<DispatchEventD *>(event)))
+        {
+            handleD(d);
+        }
+        else if ((c = dynamic_cast<DispatchEventC *>(event)))
+        {
+            handleC(c);
+        }
+    }
+
+    DispatchTable<DispatchBenchStage> table;
+    u64_t                             counts[4];
+};
+
+/**
+ * Events of four classes in turn handed to a stage, found by their type
+ * tag in a dispatch table and by a chain of dynamic_cast
+ */
+static void benchDispatch(u64_t iterations)
+{
+    DispatchBenchStage stage;
+    StageEvent        *events[4];
+
+    events[0] = new DispatchEventA();
+    events[1] = new DispatchEventB();
+    events[2] = new DispatchEventC();
+    events[3] = new DispatchEventD();
+
+    s64_t start = Now::usec();
+    for (u64_t i = 0; i < iterations; i++)
+    {
+        stage.table.handle(&stage, events[i & 3]);
+    }
+    s64_t tagUsec = Now::usec() - start;
+
+    start = Now::usec();
+    for (u64_t i = 0; i < iterations; i++)
+    {
+        stage.castEvent(events[i & 3]);
+    }
+    s64_t castUsec = Now::usec() - start;
+
+    for (int i = 0; i < 4; i++)
+    {
+        delete events[i];
+    }
+
+    LOG_INFO("MicroBench dispatch: events:%llu, type tag %.1f ns/event, "
+            "dynamic_cast %.1f ns/event, handled:%llu",
+            iterations, tagUsec * 1000.0 / iterations,
+            castUsec * 1000.0 / iterations,
+            stage.counts[0] + stage.counts[1] + stage.counts[2] +
+            stage.counts[3]);
+}
+
+//! Timers kept in the timing wheel of the TimerStage
+class WheelTimers
+{
+public:
+    typedef u64_t Handle;
+
+    WheelTimers(u32_t resolution) : wheel(resolution, 0) {}
+
+    Handle arm(StageEvent *event, u64_t deadline)
+    {
+        return wheel.add(event, deadline);
+    }
+    bool cancel(Handle id) { return wheel.cancel(id) != NULL; }
+    void expire(u64_t now, std::vector<StageEvent *> &expired)
+    {
+        wheel.expire(now, expired);
+    }
+    size_t size() const { return wheel.size(); }
+
+private:
+    TimerWheel wheel;
+};
+
+//! Timers kept in a map ordered by token, as the TimerStage used to
+class MapTimers
+{
+public:
+    typedef TimerToken Handle;
+
+    MapTimers(u32_t resolution) : nonce(0) {}
+
+    Handle arm(StageEvent *event, u64_t deadline)
+    {
+        struct timeval tv;
+        tv.tv_sec = deadline / USEC_PER_SEC;
+        tv.tv_usec = deadline % USEC_PER_SEC;
+        TimerToken token(tv, ++nonce, 0);
+        timers.insert(std::make_pair(token, event));
+        return token;
+    }
+    bool cancel(const Handle &token) { return timers.erase(token) != 0; }
+    void expire(u64_t now, std::vector<StageEvent *> &expired)
+    {
+        std::map<TimerToken, StageEvent *>::iterator it = timers.begin();
+        for (; it != timers.end(); ++it)
+        {
+            const struct timeval &tv = it->first.getTime();
+            if ((u64_t)tv.tv_sec * USEC_PER_SEC + tv.tv_usec > now)
+            {
+                break;
+            }
+            expired.push_back(it->second);
+        }
+        timers.erase(timers.begin(), it);
+    }
+    size_t size() const { return timers.size(); }
+
+private:
+    std::map<TimerToken, StageEvent *> timers;
+    u64_t                              nonce;
+};
+
+/**
+ * pending timers spread over a minute are armed, then each iteration
+ * cancels one of them and arms a new one, as a request timeout does, and
+ * at last the clock runs a millisecond at a time until all have expired
+ */
+template <class Timers>
+static void benchTimers(const char *name, u64_t iterations, u32_t pending)
+{
+    const u32_t resolution = 1000;
+    const u64_t span = 60 * USEC_PER_SEC;
+
+    Timers                    timers(resolution);
+    StageEvent                event;
+    std::vector<typename Timers::Handle> ids(pending);
+    std::vector<StageEvent *> expired;
+    u32_t                     seed = 12345;
+    u64_t                     now = 0;
+
+    s64_t start = Now::usec();
+    for (u32_t i = 0; i < pending; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        ids[i] = timers.arm(&event, now + seed % span);
+    }
+    s64_t fillUsec = Now::usec() - start;
+
+    u64_t cancelled = 0;
+    start = Now::usec();
+    for (u64_t i = 0; i < iterations; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        u32_t victim = seed % pending;
+        cancelled += timers.cancel(ids[victim]);
+        seed = seed * 1103515245 + 12345;
+        ids[victim] = timers.arm(&event, now + seed % span);
+    }
+    s64_t steadyUsec = Now::usec() - start;
+
+    start = Now::usec();
+    while (timers.size())
+    {
+        now += resolution;
+        timers.expire(now, expired);
+    }
+    s64_t expireUsec = Now::usec() - start;
+
+    LOG_INFO("MicroBench timer %s: pending:%u, arm %.1f ns/timer, "
+            "cancel+arm %.1f ns/op, expire %.1f ns/timer, cancelled:%llu, "
+            "expired:%llu",
+            name, pending, fillUsec * 1000.0 / pending,
+            steadyUsec * 1000.0 / iterations,
+            expireUsec * 1000.0 / expired.size(), cancelled,
+            (u64_t)expired.size());
+}
+
+//! Timer callbacks of the TimerStage benchmark counted as they complete
+class TimerBenchEvent : public StageEvent
+{
+public:
+    TimerBenchEvent(s64_t due = 0) : deadline(due) {}
+    ~TimerBenchEvent()
+    {
+        if (deadline)
+        {
+            lateness = Now::usec() - deadline;
+        }
+        __sync_fetch_and_add(&released, 1);
+    }
+
+    s64_t deadline;     //!< usec, 0 when the lateness isn't recorded
+
+    static volatile u64_t released;
+    static volatile s64_t lateness;     //!< of the last one with deadline
+};
+
+volatile u64_t TimerBenchEvent::released = 0;
+volatile s64_t TimerBenchEvent::lateness = 0;
+
+//! Takes the callbacks of fired timers and releases their events
+class TimerBenchStage : public Stage
+{
+public:
+    TimerBenchStage() : Stage("TimerBenchStage") {}
+
+    void handleEvent(StageEvent *event) { delete event; }
+    void callbackEvent(StageEvent *event, CallbackContext *context)
+    {
+        delete event;
+    }
+};
+
+typedef struct _TimerStageParam
+{
+    TimerStage *stage;
+    u64_t       iterations;
+} TimerStageParam;
+
+//! A request timeout armed and cancelled straight on the TimerStage
+static void *timerScheduleLoop(void *arg)
+{
+    TimerStageParam *param = (TimerStageParam *)arg;
+
+    for (u64_t i = 0; i < param->iterations; i++)
+    {
+        TimerToken token = param->stage->schedule(new TimerBenchEvent(),
+                60 * USEC_PER_SEC);
+        param->stage->cancel(token);
+    }
+
+    return NULL;
+}
+
+/**
+ * Timers due at once, armed straight or by a TimerRegisterEvent, and
+ * with a callback run by cbStage if it is set
+ */
+static s64_t timerFireRun(TimerStage *stage, u64_t timers, bool direct,
+        Stage *cbStage)
+{
+    u64_t target = TimerBenchEvent::released + timers;
+
+    s64_t start = Now::usec();
+    for (u64_t i = 0; i < timers; i++)
+    {
+        StageEvent *event = new TimerBenchEvent();
+        if (cbStage)
+        {
+            event->pushCallback(new CompletionCallback(cbStage, NULL));
+        }
+
+        if (direct)
+        {
+            stage->schedule(event, 0);
+        }
+        else
+        {
+            stage->addEvent(new TimerRegisterEvent(event, 0));
+        }
+    }
+    while (TimerBenchEvent::released < target)
+    {
+        sched_yield();
+    }
+
+    return Now::usec() - start;
+}
+
+/**
+ * Timers armed one at a time within 2 msec on an otherwise idle
+ * TimerStage, how late they fire
+ */
+static void benchTimerAccuracy(TimerStage *stage, u32_t timers)
+{
+    std::vector<s64_t> lateness;
+    u32_t              seed = 12345;
+
+    for (u32_t i = 0; i < timers; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        u64_t after = 1 + (seed >> 8) % 2000;
+
+        u64_t target = TimerBenchEvent::released + 1;
+        stage->schedule(new TimerBenchEvent(Now::usec() + after), after);
+        while (TimerBenchEvent::released < target)
+        {
+            sched_yield();
+        }
+        lateness.push_back((s64_t)TimerBenchEvent::lateness);
+    }
+
+    std::sort(lateness.begin(), lateness.end());
+    LOG_INFO("MicroBench timer accuracy: timers:%u, late by p50 %lld us, "
+            "p90 %lld us, p99 %lld us, max %lld us, min %lld us",
+            timers, lateness[timers / 2], lateness[timers * 9 / 10],
+            lateness[timers * 99 / 100], lateness[timers - 1], lateness[0]);
+}
+
+/**
+ * The live TimerStage: arm and cancel from Threads threads through the
+ * direct interface, then timers armed and fired through both interfaces
+ */
+static void benchTimerStage(u64_t iterations, u32_t timers, int threads,
+        u32_t accuracy)
+{
+    TimerStage *stage = dynamic_cast<TimerStage *>(
+            theSedaConfig()->getStage("TimerStage"));
+    if (stage == NULL)
+    {
+        LOG_WARN("MicroBench timer stage: no TimerStage");
+        return;
+    }
+
+    TimerStageParam param;
+    param.stage      = stage;
+    param.iterations = iterations;
+    s64_t cancelUsec = runBenchThreads(timerScheduleLoop, &param, threads);
+
+    s64_t directUsec = timerFireRun(stage, timers, true, NULL);
+    s64_t eventUsec = timerFireRun(stage, timers, false, NULL);
+
+    // the fired timers complete on a stage of their own pool
+    Threadpool      pool(threads, "MicroBench");
+    TimerBenchStage cbStage;
+    cbStage.setPool(&pool);
+    cbStage.connect();
+    s64_t callbackUsec = timerFireRun(stage, timers, true, &cbStage);
+    cbStage.disconnect();
+
+    u64_t total = iterations * threads;
+    LOG_INFO("MicroBench timer stage: threads:%d, schedule+cancel %.1f ns/op, "
+            "timers:%u armed and fired, schedule %.1f ns/timer, "
+            "TimerRegisterEvent %.1f ns/timer, schedule with callback "
+            "%.1f ns/timer",
+            threads, cancelUsec * 1000.0 / total, timers,
+            directUsec * 1000.0 / timers, eventUsec * 1000.0 / timers,
+            callbackUsec * 1000.0 / timers);
+
+    if (accuracy)
+    {
+        benchTimerAccuracy(stage, accuracy);
+    }
+}
+
+//! Buffers in flight between the two threads of the placement benchmark
+#define PLACEMENT_BENCH_WINDOW  64
+
+typedef struct _PlacementParam
+{
+    void * volatile *slots;     //!< buffers handed over, NULL when free
+    u64_t            buffers;
+    u32_t            bufSize;
+    u64_t            sum;       //!< keeps the reads from being dropped
+} PlacementParam;
+
+//! Fill buffers from the pool and hand them over, as a net thread does
+static void *placementProduceLoop(void *arg)
+{
+    PlacementParam *param = (PlacementParam *)arg;
+    CLbufpool      *pool  = theBufPool();
+
+    for (u64_t i = 0; i < param->buffers; i++)
+    {
+        void * volatile *slot = &param->slots[i % PLACEMENT_BENCH_WINDOW];
+        while (*slot != NULL)
+        {
+            sched_yield();
+        }
+
+        void *buf = pool->get(param->bufSize);
+        memset(buf, (int)i, param->bufSize);
+        __sync_synchronize();
+        *slot = buf;
+    }
+
+    return NULL;
+}
+
+//! Read the buffers handed over and release them, as a stage does
+static void *placementConsumeLoop(void *arg)
+{
+    PlacementParam *param = (PlacementParam *)arg;
+    CLbufpool      *pool  = theBufPool();
+    u64_t           sum   = 0;
+
+    for (u64_t i = 0; i < param->buffers; i++)
+    {
+        void * volatile *slot = &param->slots[i % PLACEMENT_BENCH_WINDOW];
+        void *buf;
+        while ((buf = *slot) == NULL)
+        {
+            sched_yield();
+        }
+        __sync_synchronize();
+
+        const u64_t *words = (const u64_t *)buf;
+        for (u32_t j = 0; j < param->bufSize / sizeof(u64_t); j++)
+        {
+            sum += words[j];
+        }
+
+        *slot = NULL;
+        pool->put(buf);
+    }
+
+    param->sum = sum;
+    return NULL;
+}
+
+//! Start a thread on cpu, anywhere if cpu is negative
+static int startPlaced(pthread_t *tid, int cpu, void *(*func)(void *),
+        void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (cpu >= 0)
+    {
+        char list[16];
+        snprintf(list, sizeof(list), "%d", cpu);
+
+        CLcpuset cpus;
+        cpus.parse(list);
+        cpus.apply(&attr);
+    }
+
+    int rc = pthread_create(tid, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+
+    return rc;
+}
+
+//! Hand buffers from a thread on one CPU to a thread on another
+static s64_t placementRun(int producerCpu, int consumerCpu, u64_t buffers,
+        u32_t bufSize)
+{
+    void * volatile slots[PLACEMENT_BENCH_WINDOW];
+    for (int i = 0; i < PLACEMENT_BENCH_WINDOW; i++)
+    {
+        slots[i] = NULL;
+    }
+
+    PlacementParam param;
+    param.slots   = slots;
+    param.buffers = buffers;
+    param.bufSize = bufSize;
+    param.sum     = 0;
+
+    pthread_t producer, consumer;
+    s64_t     start = Now::usec();
+
+    if (startPlaced(&consumer, consumerCpu, placementConsumeLoop, &param))
+    {
+        LOG_ERROR("MicroBench placement: failed to start on cpu %d",
+                consumerCpu);
+        return 0;
+    }
+    if (startPlaced(&producer, producerCpu, placementProduceLoop, &param))
+    {
+        // the consumer waits for the buffers, fill them here
+        LOG_ERROR("MicroBench placement: failed to start on cpu %d",
+                producerCpu);
+        placementProduceLoop(&param);
+    }
+    else
+    {
+        pthread_join(producer, NULL);
+    }
+    pthread_join(consumer, NULL);
+
+    return Now::usec() - start;
+}
+
+/**
+ * Buffers filled on one thread and read on another, the way received
+ * messages go from the net threads to the stages: unpinned, with both
+ * threads on one NUMA node and with them on two nodes
+ */
+static void benchPlacement(u64_t iterations, u32_t bufSize)
+{
+    CLcpuset local;
+    if (local.setNode(0) == false)
+    {
+        LOG_WARN("MicroBench placement: no CPU on NUMA node 0");
+        return;
+    }
+    int first  = local.getCpu(0);
+    int second = (local.count() > 1) ? local.getCpu(1) : first;
+
+    s64_t anyUsec   = placementRun(-1, -1, iterations, bufSize);
+    s64_t localUsec = placementRun(first, second, iterations, bufSize);
+
+    CLcpuset remote;
+    if (CLcpuset::nodeCount() < 2 || remote.setNode(1) == false)
+    {
+        LOG_INFO("MicroBench placement: buffers:%llu of %u bytes, "
+                "unpinned %.1f ns/buffer, cpus %d,%d %.1f ns/buffer, "
+                "one NUMA node only", iterations, bufSize,
+                anyUsec * 1000.0 / iterations, first, second,
+                localUsec * 1000.0 / iterations);
+        return;
+    }
+
+    int   other      = remote.getCpu(0);
+    s64_t remoteUsec = placementRun(first, other, iterations, bufSize);
+
+    LOG_INFO("MicroBench placement: buffers:%llu of %u bytes, "
+            "unpinned %.1f ns/buffer, one node cpus %d,%d %.1f ns/buffer, "
+            "two nodes cpus %d,%d %.1f ns/buffer", iterations, bufSize,
+            anyUsec * 1000.0 / iterations, first, second,
+            localUsec * 1000.0 / iterations, first, other,
+            remoteUsec * 1000.0 / iterations);
+}
+
+void runMicroBench()
+{
+    std::map<std::string, std::string> section =
+            theGlobalProperties()->get(MICRO_BENCH_SECTION);
+
+    int threads = (int)getBenchValue(section, "Threads", 1);
+    if (threads <= 0)
+    {
+        threads = 1;
+    }
+
+    u64_t iterations = getBenchValue(section, "ConnIterations", 0);
+    if (iterations)
+    {
+        benchConnMessage(iterations, threads);
+    }
+
+    iterations = getBenchValue(section, "PoolIterations", 0);
+    if (iterations)
+    {
+        u32_t quantum = (u32_t)getBenchValue(section, "PoolBatchQuantum", 1);
+        u32_t depth = (u32_t)getBenchValue(section, "PoolInlineDepth",
+                THREADPOOL_INLINE_DEPTH);
+        u32_t perThread = (u32_t)getBenchValue(section, "PoolEvents", 4);
+        if (perThread == 0)
+        {
+            perThread = 1;
+        }
+        // unset: no callbacks, 0: every callback rescheduled
+        s32_t cbDepth = (s32_t)getBenchValue(section, "PoolCallbackDepth",
+                (u64_t)-1);
+        benchThreadpool(iterations, threads, quantum, depth, perThread,
+                cbDepth);
+    }
+
+    iterations = getBenchValue(section, "AllocIterations", 0);
+    if (iterations)
+    {
+        benchEventAlloc("pooled", poolAllocLoop, iterations, threads);
+        benchEventAlloc("heap", heapAllocLoop, iterations, threads);
+    }
+
+    iterations = getBenchValue(section, "QueueIterations", 0);
+    int maxProducers = (int)getBenchValue(section, "QueueProducers", 64);
+    for (int producers = 1; iterations && producers <= maxProducers;
+            producers *= 2)
+    {
+        benchQueue<EventQueue>("lock-free", iterations, producers);
+        benchQueue<LockedEventQueue>("locked", iterations, producers);
+    }
+
+    iterations = getBenchValue(section, "DispatchIterations", 0);
+    if (iterations)
+    {
+        benchDispatch(iterations);
+    }
+
+    iterations = getBenchValue(section, "TimerIterations", 0);
+    if (iterations)
+    {
+        u32_t pending = (u32_t)getBenchValue(section, "TimerPending", 100000);
+        if (pending == 0)
+        {
+            pending = 1;
+        }
+        benchTimers<WheelTimers>("wheel", iterations, pending);
+        benchTimers<MapTimers>("map", iterations, pending);
+        u32_t accuracy = (u32_t)getBenchValue(section, "TimerAccuracy", 0);
+        benchTimerStage(iterations, pending, threads, accuracy);
+    }
+
+    iterations = getBenchValue(section, "PlacementIterations", 0);
+    if (iterations)
+    {
+        u32_t bufSize = (u32_t)getBenchValue(section, "PlacementBufSize",
+                16384);
+        if (bufSize < sizeof(u64_t))
+        {
+            bufSize = sizeof(u64_t);
+        }
+        benchPlacement(iterations, bufSize);
+    }
+}
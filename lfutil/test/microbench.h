@@ -0,0 +1,31 @@
+// __CR__
+// Copyright (c) 2008-2012 LongdaFeng
+// All Rights Reserved
+//
+// This software contains the intellectual property of LongdaFeng
+// or is licensed to LongdaFeng from third parties.  Use of this
+// software and the intellectual property contained therein is
+// expressly limited to the terms and conditions of the License Agreement
+// under which it is provided by or on behalf of LongdaFeng.
+// __CR__
+
+/*
+ * microbench.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Longda Feng
+ */
+
+#ifndef MICROBENCH_H_
+#define MICROBENCH_H_
+
+#include "defs.h"
+
+/**
+ * Run the micro benchmarks enabled in the [MicroBench] section, each one
+ * logs a "MicroBench" line with its cost per operation. Called once the
+ * library is initialized and before the test is triggered.
+ */
+void runMicroBench();
+
+#endif /* MICROBENCH_H_ */
@@ -45,6 +45,7 @@
 
 
 #include "teststage.h"
+#include "microbench.h"
 #include "simpledeserializer.h"
 #include "triggertestevent.h"
 
@@ -83,7 +84,12 @@ void startTest(int sig)
         return;
     }
 
-    testStage->addEvent(event);
+    if (testStage->addEvent(event) == false)
+    {
+        LOG_ERROR("%s rejected the event", TEST_STAGE_NAME);
+        event->done();
+        return;
+    }
 
 
     LOG_INFO("Successfully add one event to %s", TEST_STAGE_NAME);
@@ -204,6 +210,8 @@ int main(int argc, char** argv)
         return rc;
     }
 
+    runMicroBench();
+
     setSignalHandlingFunc(startTest);
 
     // wait interrupt signals
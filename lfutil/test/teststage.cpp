@@ -17,12 +17,16 @@
  */
 #include <string>
 #include <string.h>
+#include <algorithm>
+#include <sstream>
 
 #include "linit.h"
 #include "conf/ini.h"
 #include "lang/lstring.h"
 #include "seda/timerstage.h"
 #include "io/io.h"
+#include "time/datetime.h"
+#include "mm/lbufpool.h"
 
 #include "comm/commevent.h"
 #include "comm/request.h"
@@ -34,15 +38,24 @@
 
 
 #define ONE_TIME_NUM 4000
+#define RETRY_DELAY  1      // seconds before a failed request is reissued
 
 //! Constructor
 CTestStage::CTestStage(const char* tag) :
         Stage(tag), mTimerStage(NULL), mCommStage(NULL), mTestTimes(0), mSendCounter(
                 0), mLastSendCounter(0), mRecvCounter(0), mLastRecvCounter(0), mHasOutputState(
-                false)
+                false), mOutstanding(0)
 {
     MUTEX_INIT(&mSendMutex, NULL);
     MUTEX_INIT(&mRecvMutex, NULL);
+    MUTEX_INIT(&mLatencyMutex, NULL);
+
+    mDispatch.addHandler<TriggerTestEvent, &CTestStage::triggerTestEvent>();
+    mDispatch.addHandler<CommEvent, &CTestStage::recvRequest>();
+    mDispatch.addCallback<TriggerTestEvent, &CTestStage::retriggerTestEvent>();
+    mDispatch.addCallback<CommEvent, &CTestStage::recvResponse>();
+    mDispatch.addCallback<CTestStatEvent, &CTestStage::outputStat>();
+    mDispatch.addCallback<CTestRetryEvent, &CTestStage::retrySend>();
 }
 
 //! Destructor
@@ -50,6 +63,7 @@ CTestStage::~CTestStage()
 {
     MUTEX_DESTROY(&mSendMutex);
     MUTEX_DESTROY(&mRecvMutex);
+    MUTEX_DESTROY(&mLatencyMutex);
 }
 
 //! Parse properties, instantiate a stage object
@@ -113,6 +127,13 @@ bool CTestStage::setProperties()
         mTestTimes = -1;
     }
 
+    key = "Outstanding";
+    it = section.find(key);
+    if (it != section.end())
+    {
+        CLstring::strToVal(it->second, mOutstanding);
+    }
+
     key = "TestFile";
     it = section.find(key);
     if (it != section.end())
@@ -129,11 +150,12 @@ bool CTestStage::initialize()
     LOG_TRACE("Enter");
 
     std::list<Stage*>::iterator stgp = nextStageList.begin();
-    mTimerStage = *(stgp++);
+    Stage *timerStage = *(stgp++);
     mCommStage = *(stgp++);
 
-    ASSERT(dynamic_cast<TimerStage *>(mTimerStage),
+    ASSERT(dynamic_cast<TimerStage *>(timerStage),
             "The next stage isn't TimerStage");
+    mTimerStage = static_cast<TimerStage *>(timerStage);
 
     CTestStatEvent *tev = new CTestStatEvent();
     if (tev == NULL)
@@ -160,20 +182,9 @@ void CTestStage::handleEvent(StageEvent* event)
 {
     LOG_TRACE("Enter\n");
 
-    TriggerTestEvent *tev = NULL;
-    CommEvent *cev = NULL;
-
-    if ((tev = dynamic_cast<TriggerTestEvent *>(event)))
+    if (mDispatch.handle(this, event) == false)
     {
-        return triggerTestEvent(event);
-    }
-    else if ((cev = dynamic_cast<CommEvent *>(event)))
-    {
-        return recvRequest(event);
-    }
-    else
-    {
-        LOG_ERROR("Unknow type event");
+        LOG_ERROR("Unknow type event %s", event->typeTag().getName());
         event->done();
     }
 
@@ -185,25 +196,9 @@ void CTestStage::callbackEvent(StageEvent* event, CallbackContext* context)
 {
     LOG_TRACE("Enter\n");
 
-    TriggerTestEvent *tev = NULL;
-    CommEvent *cev = NULL;
-    CTestStatEvent *sev = NULL;
-
-    if ((tev = dynamic_cast<TriggerTestEvent *>(event)))
-    {
-        return retriggerTestEvent(event);
-    }
-    else if ((cev = dynamic_cast<CommEvent *>(event)))
-    {
-        return recvResponse(event);
-    }
-    else if ((sev = dynamic_cast<CTestStatEvent *>(event)))
+    if (mDispatch.callback(this, event, context) == false)
     {
-        outputStat(event);
-    }
-    else
-    {
-        LOG_ERROR("Unknow type event");
+        LOG_ERROR("Unknow type event %s", event->typeTag().getName());
         event->done();
         return;
     }
@@ -268,7 +263,7 @@ void CTestStage::sendRequest()
             delete cev;
             return;
         }
-        IoVec::vec_t *iov = new IoVec::vec_t;
+        IoVec::vec_t *iov = new IoVec::vec_t();
         if (iov == NULL)
         {
             LOG_ERROR("No memory to IoVec::vec_t");
@@ -283,7 +278,12 @@ void CTestStage::sendRequest()
         md.attachMems.push_back(iov);
     }
 
-    mCommStage->addEvent(cev);
+    recordSend(cev);
+    if (mCommStage->addEvent(cev) == false)
+    {
+        // fails the request, its callback sees it
+        cev->shed();
+    }
 
 //    MUTEX_LOCK(&mSendMutex);
     mSendCounter++;
@@ -304,31 +304,16 @@ void CTestStage::startTimer(StageEvent *tev, int seconds)
         return;
     }
 
-    TimerRegisterEvent *tmEvent = new TimerRegisterEvent(tev,
-            seconds * USEC_PER_SEC);
-    if (tmEvent == NULL)
-    {
-        LOG_ERROR("Failed to new TimerRegisterEvent");
-
-        delete cb;
-
-        tev->done();
-
-        return;
-    }
-
     tev->pushCallback(cb);
-    mTimerStage->addEvent(tmEvent);
+    mTimerStage->schedule(tev, seconds * USEC_PER_SEC);
 }
 
-void CTestStage::recvRequest(StageEvent *event)
+void CTestStage::recvRequest(CommEvent *cev)
 {
 //    MUTEX_LOCK(&mRecvMutex);
     mRecvCounter++;
 //    MUTEX_UNLOCK(&mRecvMutex);
 
-    CommEvent *cev = dynamic_cast<CommEvent *>(event);
-
     if (cev->isfailed() == true)
     {
         LOG_ERROR("CommEvent is failed, status:%d", (int)cev->getStatus());
@@ -377,14 +362,16 @@ void CTestStage::recvRequest(StageEvent *event)
 
 }
 
-void CTestStage::recvResponse(StageEvent *event)
+void CTestStage::recvResponse(CommEvent *cev)
 {
 //    MUTEX_LOCK(&mRecvMutex);
     mRecvCounter++;
 //    MUTEX_UNLOCK(&mRecvMutex);
 
-    CommEvent *cev = dynamic_cast<CommEvent *>(event);
-    if (cev->isfailed() == true)
+    recordRecv(cev);
+
+    bool failed = cev->isfailed();
+    if (failed == true)
     {
         LOG_ERROR("CommEvent is failed, status:%d", (int)cev->getStatus());
 
@@ -394,26 +381,60 @@ void CTestStage::recvResponse(StageEvent *event)
     if (response == NULL)
     {
         LOG_ERROR("CommEvent no response");
-        cev->done();
+        failed = true;
+    }
+    else
+    {
+        LOG_DEBUG("Response status:%d:%s", response->mStatus,
+                response->mErrMsg);
+    }
+    cev->done();
+
+    if (mOutstanding == 0)
+    {
+        return;
+    }
 
+    if (failed)
+    {
+        // reissue a failed request later, the server may be down and the
+        // closed loop would spin on it
+        CTestRetryEvent *rev = new CTestRetryEvent();
+        if (rev == NULL)
+        {
+            LOG_ERROR("No memory to alloc CTestRetryEvent");
+            return;
+        }
+        startTimer(rev, RETRY_DELAY);
         return;
     }
 
-    LOG_DEBUG("Response status:%d:%s", response->mStatus, response->mErrMsg);
-    cev->done();
+    // closed loop, issue the next request as soon as one returns
+    sendRequest();
 
     return;
 
 }
 
-void CTestStage::triggerTestEvent(StageEvent *event)
+void CTestStage::triggerTestEvent(TriggerTestEvent *tev)
 {
     LOG_TRACE("Handle TestEvent");
 
-    TriggerTestEvent *tev = dynamic_cast<TriggerTestEvent *>(event);
     bool finished = false;
 
-    if (mTestTimes == -1)
+    if (mOutstanding)
+    {
+        for (u32_t i = 0; i < mOutstanding; i++)
+        {
+            sendRequest();
+        }
+        LOG_INFO("Start latency test with %u outstanding requests",
+                mOutstanding);
+
+        tev->done();
+        return;
+    }
+    else if (mTestTimes == -1)
     {
         int i = 0;
         while (i < ONE_TIME_NUM)
@@ -446,7 +467,7 @@ void CTestStage::triggerTestEvent(StageEvent *event)
 
     if (finished == true)
     {
-        event->done();
+        tev->done();
         return;
     }
 
@@ -455,19 +476,23 @@ void CTestStage::triggerTestEvent(StageEvent *event)
     return;
 }
 
-void CTestStage::retriggerTestEvent(StageEvent *event)
+void CTestStage::retriggerTestEvent(TriggerTestEvent *event)
 {
 
     static int i = 0;
 
     LOG_DEBUG("Handle Callback %d", i++);
 
-    addEvent(event);
+    if (addEvent(event) == false)
+    {
+        // the stage is overloaded, try again after the next sleep
+        startTimer(event, event->mSleepTime);
+    }
 
     LOG_DEBUG("Finish handle");
 }
 
-void CTestStage::outputStat(StageEvent *event)
+void CTestStage::outputStat(CTestStatEvent *event)
 {
     u32_t sendTPS = 0;
     u32_t recvTPS = 0;
@@ -484,6 +509,10 @@ void CTestStage::outputStat(StageEvent *event)
 
     LOG_INFO("Send TPS:%u, Recv TPS:%u, SendTotal:%u, RecvTotal:%u",
             sendTPS/10, recvTPS/10, mLastSendCounter, mLastRecvCounter);
+    if (getOverloads())
+    {
+        LOG_INFO("Events finding the queue full:%llu", getOverloads());
+    }
 
     if (recvTPS == 0)
     {
@@ -493,6 +522,17 @@ void CTestStage::outputStat(StageEvent *event)
 
     }
 
+    outputLatency();
+
+    std::string poolStr;
+    theBufPool()->output(poolStr);
+    LOG_INFO("%s", poolStr.c_str());
+
+    StageEvent::objPool()->output(poolStr);
+    LOG_INFO("%s", poolStr.c_str());
+    CompletionCallback::objPool()->output(poolStr);
+    LOG_INFO("%s", poolStr.c_str());
+
     startTimer(event, 10);
 
 #if 0
@@ -502,3 +542,92 @@ void CTestStage::outputStat(StageEvent *event)
 #endif
 
 }
+
+void CTestStage::retrySend(CTestRetryEvent *event)
+{
+    event->done();
+
+    sendRequest();
+}
+
+void CTestStage::recordSend(StageEvent *event)
+{
+    // latency is only sampled by the closed loop test
+    if (mOutstanding == 0)
+    {
+        return;
+    }
+
+    s64_t now = Now::usec();
+
+    MUTEX_LOCK(&mLatencyMutex);
+    mInflight[event] = now;
+    MUTEX_UNLOCK(&mLatencyMutex);
+}
+
+void CTestStage::recordRecv(StageEvent *event)
+{
+    s64_t now = Now::usec();
+
+    MUTEX_LOCK(&mLatencyMutex);
+    std::map<StageEvent *, s64_t>::iterator it = mInflight.find(event);
+    if (it != mInflight.end())
+    {
+        mLatencies.push_back((u32_t)(now - it->second));
+
+        // split the round trip by the stages the request went through
+        s64_t last = it->second;
+        u32_t count = theEventHistoryFlag() ? event->getHistoryCount() : 0;
+        for (u32_t i = 0; i < count; i++)
+        {
+            const StageEvent::HistEntry &entry = event->getHistory(i);
+            std::pair<u64_t, u64_t> &hop = mHopLatencies[
+                    std::make_pair(entry.stage, (int)entry.type)];
+            hop.first += entry.usec - last;
+            hop.second++;
+            last = entry.usec;
+        }
+
+        mInflight.erase(it);
+    }
+    MUTEX_UNLOCK(&mLatencyMutex);
+}
+
+void CTestStage::outputLatency()
+{
+    std::vector<u32_t> samples;
+    std::map<std::pair<Stage *, int>, std::pair<u64_t, u64_t> > hops;
+
+    MUTEX_LOCK(&mLatencyMutex);
+    samples.swap(mLatencies);
+    hops.swap(mHopLatencies);
+    MUTEX_UNLOCK(&mLatencyMutex);
+
+    if (samples.empty())
+    {
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    size_t count = samples.size();
+    LOG_INFO("RTT(us) samples:%u, p50:%u, p90:%u, p99:%u, max:%u",
+            (u32_t)count, samples[count * 50 / 100], samples[count * 90 / 100],
+            samples[count * 99 / 100], samples[count - 1]);
+
+    if (hops.empty())
+    {
+        return;
+    }
+
+    std::ostringstream os;
+    std::map<std::pair<Stage *, int>, std::pair<u64_t, u64_t> >::iterator it;
+    for (it = hops.begin(); it != hops.end(); it++)
+    {
+        os << " " << it->first.first->getName() << ":"
+           << StageEvent::histTypeName((StageEvent::HistType)it->first.second)
+           << ":" << it->second.first / it->second.second;
+    }
+    LOG_INFO("RTT(us) by hop, average since the previous one:%s",
+            os.str().c_str());
+}
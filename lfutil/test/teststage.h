@@ -19,6 +19,9 @@
 #ifndef CTESTSTAGE_H_
 #define CTESTSTAGE_H_
 
+#include <map>
+#include <vector>
+
 #include "defs.h"
 #include "trace/log.h"
 #include "os/mutex.h"
@@ -26,16 +29,32 @@
 #include "seda/stage.h"
 #include "seda/stageevent.h"
 #include "seda/callback.h"
+#include "seda/dispatchtable.h"
 
 #include "net/endpoint.h"
 
+class CommEvent;
+class TriggerTestEvent;
+class TimerStage;
+
 class CTestStatEvent : public StageEvent
 {
+    CLTYPETAG(CTestStatEvent, StageEvent)
+
 public:
     CTestStatEvent(){}
     ~CTestStatEvent(){}
 };
 
+class CTestRetryEvent : public StageEvent
+{
+    CLTYPETAG(CTestRetryEvent, StageEvent)
+
+public:
+    CTestRetryEvent(){}
+    ~CTestRetryEvent(){}
+};
+
 /**
  *
  */
@@ -58,19 +77,27 @@ protected:
 protected:
     void sendRequest();
 
-    void recvRequest(StageEvent *event);
+    void recvRequest(CommEvent *cev);
 
-    void recvResponse(StageEvent *event);
+    void recvResponse(CommEvent *cev);
 
-    void triggerTestEvent(StageEvent *event);
+    void triggerTestEvent(TriggerTestEvent *tev);
 
-    void retriggerTestEvent(StageEvent *event);
+    void retriggerTestEvent(TriggerTestEvent *event);
 
     void startTimer(StageEvent *tev, int seconds);
 
-    void outputStat(StageEvent *event);
+    void outputStat(CTestStatEvent *event);
+
+    void retrySend(CTestRetryEvent *event);
+
+    void recordSend(StageEvent *event);
+    void recordRecv(StageEvent *event);
+    void outputLatency();
 private:
-    Stage                    *mTimerStage;
+    DispatchTable<CTestStage> mDispatch;
+
+    TimerStage               *mTimerStage;
     Stage                    *mCommStage;
     EndPoint                  mPeerEp;
     int                       mTestTimes;
@@ -84,6 +111,14 @@ private:
     pthread_mutex_t           mRecvMutex;
 
     bool                      mHasOutputState;
+
+    //! closed loop latency test, keep mOutstanding requests in flight
+    u32_t                     mOutstanding;
+    std::map<StageEvent *, s64_t> mInflight;
+    std::vector<u32_t>        mLatencies;   //!< round trip time in usec
+    //! usec sum and count from the previous hop, by stage and hop type
+    std::map<std::pair<Stage *, int>, std::pair<u64_t, u64_t> > mHopLatencies;
+    pthread_mutex_t           mLatencyMutex;
 };
 
 #endif /* CTESTSTAGE_H_ */
@@ -25,6 +25,8 @@
 
 class TriggerTestEvent : public StageEvent
 {
+    CLTYPETAG(TriggerTestEvent, StageEvent)
+
 public:
     TriggerTestEvent(int sleepTime):mSleepTime(sleepTime), mTimes(0){MUTEX_INIT(&mTestMutex, NULL);};
     ~TriggerTestEvent(){MUTEX_DESTROY(&mTestMutex);}